@@ -3,6 +3,7 @@
 #include <glaze/glaze.hpp>
 
 #include <filesystem>
+#include <optional>
 #include <string>
 #include <vector>
 
@@ -14,12 +15,18 @@ namespace remote_scan
       std::string url;
       std::string apiKey;
 
+      // Requests sent to the server at the same time by different scans. 0 leaves them unbounded.
+      int maxConcurrentRequests{0};
+
+      bool operator==(const ServerConfig&) const = default;
+
       struct glaze
       {
          static constexpr auto value = glz::object(
             "server_name", &ServerConfig::name,
             "url", &ServerConfig::url,
-            "api_key", &ServerConfig::apiKey
+            "api_key", &ServerConfig::apiKey,
+            "max_concurrent_requests", &ServerConfig::maxConcurrentRequests
          );
       };
    };
@@ -82,10 +89,14 @@ namespace remote_scan
    {
       std::filesystem::path path;
 
+      // "watch" (default) uses kernel watches, "poll" polls the path for network shares
+      std::string mode;
+
       struct glaze
       {
          static constexpr auto value = glz::object(
-            "path", &ScanConfigPath::path
+            "path", &ScanConfigPath::path,
+            "mode", &ScanConfigPath::mode
          );
       };
    };
@@ -99,6 +110,15 @@ namespace remote_scan
       std::filesystem::path basePath;
       std::vector<ScanConfigPath> pathsFromBase;
 
+      // Number of folders below the base path that settle independently, 0 settles the whole scan together
+      int groupDepth{0};
+
+      // Storm thresholds. Above them pending paths are collapsed to folders and then to a scan of the scan paths.
+      // Off unless configured so existing setups keep notifying every path.
+      int stormEventsPerSecond{0};
+      int stormMaxPendingPaths{0};
+      int stormMaxFolders{0};
+
       struct glaze
       {
          static constexpr auto value = glz::object(
@@ -107,7 +127,11 @@ namespace remote_scan
             "emby", &ScanConfig::embyLibraries,
             "jellyfin", &ScanConfig::jellyfinLibraries,
             "base_path", &ScanConfig::basePath,
-            "paths_from_base", &ScanConfig::pathsFromBase
+            "paths_from_base", &ScanConfig::pathsFromBase,
+            "group_depth", &ScanConfig::groupDepth,
+            "storm_events_per_second", &ScanConfig::stormEventsPerSecond,
+            "storm_max_pending_paths", &ScanConfig::stormMaxPendingPaths,
+            "storm_max_folders", &ScanConfig::stormMaxFolders
          );
       };
    };
@@ -136,15 +160,49 @@ namespace remote_scan
       };
    };
 
+   // Overrides the timing of one priority class: media, delete or metadata
+   struct PriorityClassConfig
+   {
+      std::string priorityClass;
+      std::optional<int> secondsBeforeNotify;
+      std::optional<int> secondsBetweenNotifies;
+
+      struct glaze
+      {
+         static constexpr auto value = glz::object(
+            "class", &PriorityClassConfig::priorityClass,
+            "seconds_before_notify", &PriorityClassConfig::secondsBeforeNotify,
+            "seconds_between_notifies", &PriorityClassConfig::secondsBetweenNotifies
+         );
+      };
+   };
+
    struct RemoteScanConfig
    {
       bool dryRun{false};
       int secondsBeforeNotify{90};
       int secondsBetweenNotifies{15};
+      int maxSecondsPending{900};
+      int watchRegistrationThreads{4};
+      int pollIntervalSeconds{60};
+      int pollThreads{4};
+      int priorityAgingSeconds{600};
+
+      // Holding notifications for busy servers changes when they are sent so both have to be turned on
+      int serverActivityPollSeconds{0};
+      int maxSecondsDeferred{0};
+      std::string controlSocket;
+      std::string forwardTo;
+      std::string aggregatorListen;
+      std::string forwardKey;
+      std::string webhookListen;
+      std::string webhookKey;
+      std::vector<PriorityClassConfig> priorityClasses;
       std::vector<ScanConfig> scans;
       std::vector<RemoteScanIgnoreFolder> ignoreFolders;
       std::vector<RemoteScanFileExtension> validFileExtensions;
       std::vector<RemoteScanFileExtension> imageExtensions;
+      std::vector<RemoteScanFileExtension> metadataExtensions{RemoteScanFileExtension{"nfo"}};
 
       struct glaze
       {
@@ -152,10 +210,25 @@ namespace remote_scan
             "dry_run", &RemoteScanConfig::dryRun,
             "seconds_before_notify", &RemoteScanConfig::secondsBeforeNotify,
             "seconds_between_notifies", &RemoteScanConfig::secondsBetweenNotifies,
+            "max_seconds_pending", &RemoteScanConfig::maxSecondsPending,
+            "watch_registration_threads", &RemoteScanConfig::watchRegistrationThreads,
+            "poll_interval_seconds", &RemoteScanConfig::pollIntervalSeconds,
+            "poll_threads", &RemoteScanConfig::pollThreads,
+            "priority_aging_seconds", &RemoteScanConfig::priorityAgingSeconds,
+            "server_activity_poll_seconds", &RemoteScanConfig::serverActivityPollSeconds,
+            "max_seconds_deferred", &RemoteScanConfig::maxSecondsDeferred,
+            "control_socket", &RemoteScanConfig::controlSocket,
+            "forward_to", &RemoteScanConfig::forwardTo,
+            "aggregator_listen", &RemoteScanConfig::aggregatorListen,
+            "forward_key", &RemoteScanConfig::forwardKey,
+            "webhook_listen", &RemoteScanConfig::webhookListen,
+            "webhook_key", &RemoteScanConfig::webhookKey,
+            "priority_classes", &RemoteScanConfig::priorityClasses,
             "scans", &RemoteScanConfig::scans,
             "ignore_folders", &RemoteScanConfig::ignoreFolders,
             "valid_file_extensions", &RemoteScanConfig::validFileExtensions,
-            "image_extensions", &RemoteScanConfig::imageExtensions
+            "image_extensions", &RemoteScanConfig::imageExtensions,
+            "metadata_extensions", &RemoteScanConfig::metadataExtensions
          );
       };
    };
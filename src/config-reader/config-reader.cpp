@@ -7,6 +7,7 @@
 #include <filesystem>
 #include <format>
 #include <fstream>
+#include <utility>
 
 namespace remote_scan
 {
@@ -27,6 +28,7 @@ namespace remote_scan
    void ConfigReader::ReadConfigFile(const char* path)
    {
       std::filesystem::path pathFileName = std::filesystem::path(path) / "config.conf";
+      configFile_ = pathFileName;
       std::ifstream file(pathFileName, std::ios::in | std::ios::binary);
 
       if (!file.is_open())
@@ -53,6 +55,11 @@ namespace remote_scan
       return configValid_;
    }
 
+   const std::filesystem::path& ConfigReader::GetConfigFile() const
+   {
+      return configFile_;
+   }
+
    const std::vector<ServerConfig>& ConfigReader::GetPlexServers() const
    {
       return configData_.plexServers;
@@ -83,6 +90,29 @@ namespace remote_scan
       return configData_.remoteScan;
    }
 
+   std::shared_ptr<ConfigReader> ConfigReader::CreateWithTimings(int secondsBeforeNotify, int secondsBetweenNotifies) const
+   {
+      auto configReader = std::make_shared<ConfigReader>(*this);
+      configReader->configData_.remoteScan.secondsBeforeNotify = secondsBeforeNotify;
+      configReader->configData_.remoteScan.secondsBetweenNotifies = secondsBetweenNotifies;
+      return configReader;
+   }
+
+   std::shared_ptr<ConfigReader> ConfigReader::CreateWithScans(std::vector<ScanConfig> scans) const
+   {
+      auto configReader = std::make_shared<ConfigReader>(*this);
+      configReader->configData_.remoteScan.scans = std::move(scans);
+      return configReader;
+   }
+
+   std::shared_ptr<ConfigReader> ConfigReader::CreateWithServers(std::vector<ServerConfig> plexServers, std::vector<ServerConfig> embyServers) const
+   {
+      auto configReader = std::make_shared<ConfigReader>(*this);
+      configReader->configData_.plexServers = std::move(plexServers);
+      configReader->configData_.embyServers = std::move(embyServers);
+      return configReader;
+   }
+
    const std::vector<RemoteScanIgnoreFolder>& ConfigReader::GetIgnoreFolders() const
    {
       return configData_.remoteScan.ignoreFolders;
@@ -97,4 +127,9 @@ namespace remote_scan
    {
       return configData_.remoteScan.imageExtensions;
    }
+
+   const std::vector<RemoteScanFileExtension>& ConfigReader::GetMetadataExtensions() const
+   {
+      return configData_.remoteScan.metadataExtensions;
+   }
 }
\ No newline at end of file
@@ -2,6 +2,8 @@
 
 #include "config-reader/config-reader-types.h"
 
+#include <filesystem>
+#include <memory>
 #include <vector>
 
 namespace remote_scan
@@ -13,6 +15,7 @@ namespace remote_scan
       virtual ~ConfigReader() = default;
 
       [[nodiscard]] bool IsConfigValid() const;
+      [[nodiscard]] const std::filesystem::path& GetConfigFile() const;
 
       [[nodiscard]] const std::vector<ServerConfig>& GetPlexServers() const;
       [[nodiscard]] const std::vector<ServerConfig>& GetEmbyServers() const;
@@ -23,11 +26,22 @@ namespace remote_scan
       [[nodiscard]] const std::vector<RemoteScanIgnoreFolder>& GetIgnoreFolders() const;
       [[nodiscard]] const std::vector<RemoteScanFileExtension>& GetImageExtensions() const;
       [[nodiscard]] const std::vector<RemoteScanFileExtension>& GetValidFileExtensions() const;
+      [[nodiscard]] const std::vector<RemoteScanFileExtension>& GetMetadataExtensions() const;
+
+      // Copy of this configuration with other default notify timings. Used by the tuner tool to try settings.
+      [[nodiscard]] std::shared_ptr<ConfigReader> CreateWithTimings(int secondsBeforeNotify, int secondsBetweenNotifies) const;
+
+      // Copy of this configuration with other scans. Used by the soak tool to watch its own tree.
+      [[nodiscard]] std::shared_ptr<ConfigReader> CreateWithScans(std::vector<ScanConfig> scans) const;
+
+      // Copy of this configuration with other media servers. Used by the load and soak tools to notify a local stand-in.
+      [[nodiscard]] std::shared_ptr<ConfigReader> CreateWithServers(std::vector<ServerConfig> plexServers, std::vector<ServerConfig> embyServers) const;
 
    private:
       void ReadConfigFile(const char* path);
 
       bool configValid_{false};
+      std::filesystem::path configFile_;
       ConfigData configData_;
    };
 }
\ No newline at end of file
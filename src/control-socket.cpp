@@ -0,0 +1,280 @@
+﻿#include "control-socket.h"
+
+#include "monitor.h"
+#include "types.h"
+
+#include <warp/log/log.h>
+
+#include <chrono>
+#include <format>
+#include <utility>
+
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#endif
+
+namespace remote_scan
+{
+   namespace
+   {
+      // How often the accept loop checks for shutdown
+      constexpr int ACCEPT_POLL_MS{500};
+
+      // How long a client has to send its command
+      constexpr int COMMAND_TIMEOUT_MS{2000};
+
+      // Longest command line accepted
+      constexpr size_t MAX_COMMAND_LENGTH{1024};
+
+      std::string_view Trim(std::string_view value)
+      {
+         const auto first = value.find_first_not_of(" \t\r\n");
+         if (first == std::string_view::npos) return {};
+         return value.substr(first, value.find_last_not_of(" \t\r\n") - first + 1);
+      }
+
+      std::string_view GetStormName(StormMode stormMode)
+      {
+         switch (stormMode)
+         {
+            case StormMode::FOLDERS:
+               return "folders";
+            case StormMode::LIBRARY:
+               return "library";
+            default:
+               return "none";
+         }
+      }
+
+#ifndef _WIN32
+      // True if a process still accepts connections on the socket file
+      bool GetSocketListening(const sockaddr_un& address)
+      {
+         const int probe = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+         if (probe < 0) return false;
+
+         const bool listening = ::connect(probe, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0;
+         ::close(probe);
+         return listening;
+      }
+#endif
+   }
+
+   ControlSocket::ControlSocket(std::filesystem::path socketPath, Monitor& monitor)
+      : socketPath_(std::move(socketPath))
+      , monitor_(monitor)
+   {
+   }
+
+   ControlSocket::~ControlSocket()
+   {
+      Shutdown();
+   }
+
+   const std::filesystem::path& ControlSocket::GetPath() const
+   {
+      return socketPath_;
+   }
+
+#ifndef _WIN32
+   bool ControlSocket::Start()
+   {
+      sockaddr_un address{};
+      address.sun_family = AF_UNIX;
+      const auto pathString = socketPath_.string();
+      if (pathString.size() >= sizeof(address.sun_path))
+      {
+         warp::log::Error("Control socket path {} is too long", pathString);
+         return false;
+      }
+      std::memcpy(address.sun_path, pathString.c_str(), pathString.size() + 1);
+
+      listenSocket_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (listenSocket_ < 0)
+      {
+         warp::log::Error("Failed to create the control socket ... {}", std::strerror(errno));
+         return false;
+      }
+
+      // A socket file left behind by an earlier run would make the bind fail. Only a socket nothing answers on is removed.
+      struct stat pathStat{};
+      if (::lstat(pathString.c_str(), &pathStat) == 0)
+      {
+         if (!S_ISSOCK(pathStat.st_mode))
+         {
+            warp::log::Error("Control socket path {} exists and is not a socket ... Not removed", pathString);
+            ::close(std::exchange(listenSocket_, -1));
+            return false;
+         }
+
+         if (GetSocketListening(address))
+         {
+            warp::log::Error("Control socket {} is in use by another instance", pathString);
+            ::close(std::exchange(listenSocket_, -1));
+            return false;
+         }
+
+         ::unlink(pathString.c_str());
+      }
+
+      // Only the owner and group may control notifications. The socket is created with those permissions
+      // so no other user can connect before they are set.
+      const auto oldMask = ::umask(0117);
+      const bool bound = ::bind(listenSocket_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0;
+      const auto bindError = errno;
+      ::umask(oldMask);
+
+      if (!bound || ::listen(listenSocket_, 8) != 0)
+      {
+         warp::log::Error("Failed to listen on control socket {} ... {}", pathString, std::strerror(bound ? errno : bindError));
+         ::close(std::exchange(listenSocket_, -1));
+         return false;
+      }
+
+      workThread_ = std::jthread([this](std::stop_token stopToken) {
+         this->Work(stopToken);
+      });
+
+      warp::log::Info("Control socket listening on {}", pathString);
+      return true;
+   }
+
+   void ControlSocket::Shutdown()
+   {
+      if (workThread_.joinable())
+      {
+         workThread_.request_stop();
+         workThread_.join();
+      }
+
+      if (listenSocket_ >= 0)
+      {
+         ::close(std::exchange(listenSocket_, -1));
+         ::unlink(socketPath_.c_str());
+      }
+   }
+
+   void ControlSocket::Work(std::stop_token stopToken)
+   {
+      while (!stopToken.stop_requested())
+      {
+         pollfd listenPoll{.fd = listenSocket_, .events = POLLIN, .revents = 0};
+         if (::poll(&listenPoll, 1, ACCEPT_POLL_MS) <= 0) continue;
+
+         const auto connection = ::accept4(listenSocket_, nullptr, nullptr, SOCK_CLOEXEC);
+         if (connection < 0) continue;
+
+         HandleConnection(connection);
+         ::close(connection);
+      }
+   }
+
+   void ControlSocket::HandleConnection(int connection)
+   {
+      // Read until the end of the first line, the client closing its side or the timeout
+      std::string line;
+      char buffer[256];
+      const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(COMMAND_TIMEOUT_MS);
+      while (line.find('\n') == std::string::npos && line.size() < MAX_COMMAND_LENGTH)
+      {
+         const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+         pollfd connectionPoll{.fd = connection, .events = POLLIN, .revents = 0};
+         if (remaining <= 0 || ::poll(&connectionPoll, 1, static_cast<int>(remaining)) <= 0) break;
+
+         const auto bytes = ::recv(connection, buffer, sizeof(buffer), 0);
+         if (bytes <= 0) break;
+         line.append(buffer, static_cast<size_t>(bytes));
+      }
+
+      auto reply = RunCommand(line.substr(0, line.find('\n')));
+      reply += '\n';
+
+      size_t sent{0};
+      while (sent < reply.size())
+      {
+         const auto bytes = ::send(connection, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+         if (bytes <= 0) break;
+         sent += static_cast<size_t>(bytes);
+      }
+   }
+#else
+   bool ControlSocket::Start()
+   {
+      warp::log::Warning("The control socket is not supported on Windows ... Ignoring control_socket");
+      return false;
+   }
+
+   void ControlSocket::Shutdown()
+   {
+   }
+
+   void ControlSocket::Work(std::stop_token)
+   {
+   }
+
+   void ControlSocket::HandleConnection(int)
+   {
+   }
+#endif
+
+   std::string ControlSocket::GetPendingText()
+   {
+      auto pending = monitor_.GetPending();
+
+      std::string text = std::format("{} {} pending groups", monitor_.GetPaused() ? "paused" : "running", pending.size());
+      for (const auto& info : pending)
+      {
+         text += std::format("\n{} priority:{} paths:{} age:{}s idle:{}s",
+                             info.scanName,
+                             GetPriorityName(info.priority),
+                             info.pathCount,
+                             info.age.count(),
+                             info.idle.count());
+         if (!info.groupPath.empty()) text += std::format(" group:{}", info.groupPath.generic_string());
+         if (info.stormMode != StormMode::NONE) text += std::format(" storm:{}", GetStormName(info.stormMode));
+         if (info.flush) text += " flushing";
+         if (info.settled) text += " webhook";
+         if (info.deferred) text += " deferred";
+      }
+      return text;
+   }
+
+   std::string ControlSocket::RunCommand(std::string_view line)
+   {
+      line = Trim(line);
+      const auto space = line.find(' ');
+      const auto command = line.substr(0, space);
+      const auto argument = (space == std::string_view::npos) ? std::string_view() : Trim(line.substr(space + 1));
+
+      warp::log::Info("Control socket command {}", line);
+
+      if (command == "list")
+      {
+         return GetPendingText();
+      }
+      else if (command == "flush")
+      {
+         const auto scanName = (argument == "all") ? std::string_view() : argument;
+         return std::format("ok flushed {} pending groups", monitor_.Flush(scanName));
+      }
+      else if (command == "pause" || command == "resume")
+      {
+         monitor_.SetPaused(command == "pause");
+         return std::format("ok {}", command == "pause" ? "paused" : "resumed");
+      }
+      else if (command == "drop")
+      {
+         if (argument.empty()) return "error drop needs a scan name";
+         return std::format("ok dropped {} pending paths", monitor_.Drop(argument));
+      }
+
+      return "error unknown command ... Expected list, flush [scan|all], pause, resume or drop <scan>";
+   }
+}
\ No newline at end of file
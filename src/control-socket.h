@@ -0,0 +1,45 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <thread>
+
+namespace remote_scan
+{
+   class Monitor;
+
+   // Local Unix domain socket that accepts one text command per connection and writes back the result.
+   // Lets import scripts notify a scan as soon as they are done and lets notifications be held during maintenance.
+   //   list           Pending groups with their age and path count
+   //   flush [scan]   Notify a scan, or every scan, without waiting for the settle time
+   //   pause|resume   Hold or release notifications. Changes keep being collected while paused.
+   //   drop <scan>    Discard the pending changes of a scan
+   // Not available on Windows.
+   class ControlSocket
+   {
+   public:
+      ControlSocket(std::filesystem::path socketPath, Monitor& monitor);
+      virtual ~ControlSocket();
+
+      ControlSocket(const ControlSocket&) = delete;
+      ControlSocket& operator=(const ControlSocket&) = delete;
+
+      [[nodiscard]] const std::filesystem::path& GetPath() const;
+
+      // Returns false if the socket could not be created
+      bool Start();
+      void Shutdown();
+
+   private:
+      void Work(std::stop_token stopToken);
+      void HandleConnection(int connection);
+      [[nodiscard]] std::string RunCommand(std::string_view line);
+      [[nodiscard]] std::string GetPendingText();
+
+      std::filesystem::path socketPath_;
+      Monitor& monitor_;
+      int listenSocket_{-1};
+      std::jthread workThread_;
+   };
+}
\ No newline at end of file
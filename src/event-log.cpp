@@ -0,0 +1,228 @@
+﻿#include "event-log.h"
+
+#include <warp/log/log.h>
+#include <warp/log/log-utils.h>
+#include <warp/utils.h>
+
+#include <algorithm>
+#include <chrono>
+#include <format>
+#include <map>
+#include <tuple>
+#include <utility>
+
+namespace remote_scan
+{
+   namespace
+   {
+      // Entries kept while the log thread catches up. Older entries are dropped beyond this.
+      constexpr size_t BUFFER_CAPACITY{8192};
+
+      // How often buffered entries are written
+      constexpr auto FLUSH_INTERVAL{std::chrono::seconds(1)};
+
+      // More entries than this in one flush are summarized instead of logged one per line
+      constexpr size_t STORM_LINE_LIMIT{50};
+
+      // Number of busiest folders listed in a summary
+      constexpr size_t SUMMARY_TOP_FOLDERS{5};
+   }
+
+   EventLog::EventLog()
+      : buffer_(BUFFER_CAPACITY)
+      , drained_(BUFFER_CAPACITY)
+   {
+      workThread_ = std::jthread([this](std::stop_token stopToken) {
+         this->Work(stopToken);
+      });
+   }
+
+   EventLog::~EventLog()
+   {
+      Shutdown();
+   }
+
+   void EventLog::Add(EventLogType type, const ActiveMonitor& monitor, const ActiveMonitorPath& path, std::string_view target, bool dryRun)
+   {
+      std::scoped_lock lock(bufferLock_);
+
+      size_t index{0};
+      if (count_ == buffer_.size())
+      {
+         index = head_;
+         head_ = (head_ + 1) % buffer_.size();
+         ++dropped_;
+      }
+      else
+      {
+         index = (head_ + count_) % buffer_.size();
+         ++count_;
+      }
+
+      // Assigning reuses the storage of the entry the slot held before
+      auto& entry = buffer_[index];
+      entry.type = type;
+      entry.scanName = monitor.scanName;
+      entry.priority = monitor.priority;
+      entry.effect = path.effect;
+      entry.path = path.path;
+      entry.fileName = path.fileName;
+      entry.target = target;
+      entry.dryRun = dryRun;
+   }
+
+   void EventLog::Shutdown()
+   {
+      if (workThread_.joinable())
+      {
+         workThread_.request_stop();
+         workThread_.join();
+      }
+   }
+
+   std::span<const EventLogEntry> EventLog::Drain(uint64_t& dropped)
+   {
+      size_t head{0};
+      size_t count{0};
+      {
+         std::scoped_lock lock(bufferLock_);
+         buffer_.swap(drained_);
+         head = std::exchange(head_, 0);
+         count = std::exchange(count_, 0);
+         dropped = std::exchange(dropped_, 0);
+      }
+
+      // Rotating swaps the entries so every slot keeps its storage for the next swap
+      std::ranges::rotate(drained_, drained_.begin() + static_cast<std::ptrdiff_t>(head));
+      return {drained_.data(), count};
+   }
+
+   std::filesystem::path EventLog::GetDisplayFullPath(const EventLogEntry& entry)
+   {
+      auto displayFolder = warp::GetDisplayFolder(entry.path);
+      return entry.fileName.empty() ? displayFolder : displayFolder / entry.fileName;
+   }
+
+   void EventLog::WriteEntry(const EventLogEntry& entry)
+   {
+      if (entry.type == EventLogType::ADDED)
+      {
+         warp::log::Info("{} Scan moved to {} {} {} {}",
+                         warp::GetAnsiText("-->", ANSI_MONITOR_ADDED),
+                         warp::GetTag("monitor", entry.scanName),
+                         warp::GetTag("priority", std::string(GetPriorityName(entry.priority))),
+                         warp::GetTag("effect", std::string(GetEffectName(entry.effect))),
+                         warp::GetTag("media", GetDisplayFullPath(entry).generic_string()));
+      }
+      else
+      {
+         warp::log::Info("{}{} Moved {} to target {} {}",
+                         entry.dryRun ? "[DRY RUN] " : "",
+                         warp::GetAnsiText(">>>", ANSI_MONITOR_PROCESSED),
+                         warp::GetTag("monitor", entry.scanName),
+                         entry.target,
+                         warp::GetTag("media", GetDisplayFullPath(entry).generic_string()));
+      }
+   }
+
+   void EventLog::WriteSummary(const std::vector<const EventLogEntry*>& entries)
+   {
+      const auto& first = *entries.front();
+
+      size_t effectCounts[4]{};
+      std::map<std::string, size_t> folderCounts;
+      for (const auto* entry : entries)
+      {
+         ++effectCounts[static_cast<size_t>(entry->effect)];
+         ++folderCounts[GetDisplayFullPath(*entry).parent_path().generic_string()];
+      }
+
+      std::vector<std::pair<std::string, size_t>> topFolders(folderCounts.begin(), folderCounts.end());
+      const auto topCount = std::min(topFolders.size(), SUMMARY_TOP_FOLDERS);
+      std::ranges::partial_sort(topFolders, topFolders.begin() + static_cast<std::ptrdiff_t>(topCount), std::ranges::greater{}, &std::pair<std::string, size_t>::second);
+
+      std::string folders;
+      for (size_t i = 0; i < topCount; ++i)
+      {
+         if (!folders.empty()) folders += ", ";
+         folders += std::format("{} ({})", topFolders[i].first, topFolders[i].second);
+      }
+
+      const auto effects = std::format("{} {} {} {}",
+                                       warp::GetTag("create", std::to_string(effectCounts[static_cast<size_t>(EffectType::CREATE)])),
+                                       warp::GetTag("modify", std::to_string(effectCounts[static_cast<size_t>(EffectType::MODIFY)])),
+                                       warp::GetTag("delete", std::to_string(effectCounts[static_cast<size_t>(EffectType::DESTROY)])),
+                                       warp::GetTag("rename", std::to_string(effectCounts[static_cast<size_t>(EffectType::RENAME)])));
+
+      if (first.type == EventLogType::ADDED)
+      {
+         warp::log::Info("{} Scan moved {} paths to {} {} top folders: {}",
+                         warp::GetAnsiText("-->", ANSI_MONITOR_ADDED),
+                         entries.size(),
+                         warp::GetTag("monitor", first.scanName),
+                         effects,
+                         folders);
+      }
+      else
+      {
+         warp::log::Info("{}{} Moved {} paths of {} to target {} top folders: {}",
+                         first.dryRun ? "[DRY RUN] " : "",
+                         warp::GetAnsiText(">>>", ANSI_MONITOR_PROCESSED),
+                         entries.size(),
+                         warp::GetTag("monitor", first.scanName),
+                         first.target,
+                         folders);
+      }
+   }
+
+   void EventLog::Write(std::span<const EventLogEntry> entries, uint64_t dropped)
+   {
+      if (dropped > 0)
+      {
+         warp::log::Warning("Event log buffer full ... {} path log lines were dropped", dropped);
+      }
+
+      if (entries.size() <= STORM_LINE_LIMIT)
+      {
+         for (const auto& entry : entries)
+         {
+            WriteEntry(entry);
+         }
+         return;
+      }
+
+      // Summarize each scan and target in the order they first appeared
+      std::vector<std::vector<const EventLogEntry*>> groups;
+      std::map<std::tuple<EventLogType, std::string_view, std::string_view>, size_t> groupIndexes;
+      for (const auto& entry : entries)
+      {
+         auto [iter, added] = groupIndexes.try_emplace({entry.type, entry.scanName, entry.target}, groups.size());
+         if (added) groups.emplace_back();
+         groups[iter->second].emplace_back(&entry);
+      }
+
+      for (const auto& group : groups)
+      {
+         WriteSummary(group);
+      }
+   }
+
+   void EventLog::Work(std::stop_token stopToken)
+   {
+      std::mutex m;
+      std::unique_lock lock(m);
+      while (!stopToken.stop_requested())
+      {
+         workCv_.wait_for(lock, stopToken, FLUSH_INTERVAL, [] { return false; });
+
+         uint64_t dropped{0};
+         const auto entries = Drain(dropped);
+         Write(entries, dropped);
+      }
+
+      // Write whatever arrived between the last flush and the stop request
+      uint64_t dropped{0};
+      const auto entries = Drain(dropped);
+      Write(entries, dropped);
+   }
+}
\ No newline at end of file
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "types.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace remote_scan
+{
+   enum class EventLogType
+   {
+      ADDED,
+      NOTIFIED
+   };
+
+   struct EventLogEntry
+   {
+      EventLogType type{EventLogType::ADDED};
+
+      // Interned with InternScanName
+      std::string_view scanName;
+      MonitorPriority priority{MonitorPriority::MEDIA};
+      EffectType effect{EffectType::MODIFY};
+
+      // Turned into the display path on the log thread so the event path does not pay for it
+      std::filesystem::path path;
+      std::filesystem::path fileName;
+
+      // Formatted servers the path was sent to. Only used for notified entries.
+      std::string target;
+      bool dryRun{false};
+   };
+
+   // Writes the per path log lines of the event path on its own thread.
+   // Entries go into a bounded ring buffer so the monitor and notify threads never wait on formatting
+   // or on forwarding to Apprise or Gotify. When a flush holds more entries than a storm limit
+   // a summary per scan with counts by effect and the busiest folders is logged instead.
+   class EventLog
+   {
+   public:
+      EventLog();
+      virtual ~EventLog();
+
+      EventLog(const EventLog&) = delete;
+      EventLog& operator=(const EventLog&) = delete;
+
+      // Never blocks on logging. The oldest entry is dropped when the buffer is full.
+      // The path is copied into a ring slot that keeps its storage from earlier entries so adding does not allocate.
+      void Add(EventLogType type, const ActiveMonitor& monitor, const ActiveMonitorPath& path, std::string_view target = {}, bool dryRun = false);
+
+      // Stops the log thread after writing everything still buffered
+      void Shutdown();
+
+   private:
+      void Work(std::stop_token stopToken);
+
+      // Swaps the filled ring for the spare one and returns its entries oldest first
+      [[nodiscard]] std::span<const EventLogEntry> Drain(uint64_t& dropped);
+      static void Write(std::span<const EventLogEntry> entries, uint64_t dropped);
+      [[nodiscard]] static std::filesystem::path GetDisplayFullPath(const EventLogEntry& entry);
+      static void WriteEntry(const EventLogEntry& entry);
+      static void WriteSummary(const std::vector<const EventLogEntry*>& entries);
+
+      std::mutex bufferLock_;
+      std::vector<EventLogEntry> buffer_;
+
+      // Only touched by the log thread outside of the swap in Drain
+      std::vector<EventLogEntry> drained_;
+      size_t head_{0};
+      size_t count_{0};
+      uint64_t dropped_{0};
+
+      std::condition_variable_any workCv_;
+      std::jthread workThread_;
+   };
+}
\ No newline at end of file
@@ -0,0 +1,537 @@
+﻿#include "forwarding.h"
+
+#include <warp/log/log.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <sstream>
+#include <string_view>
+#include <utility>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#endif
+
+namespace remote_scan
+{
+   namespace
+   {
+      // Sent first on every connection followed by a frame holding the key
+      constexpr std::array<char, 8> FORWARD_MAGIC{'R', 'S', 'F', 'W', 'D', '0', '0', '1'};
+
+      // Events of one burst share a frame
+      constexpr auto BATCH_DELAY{std::chrono::milliseconds(100)};
+      constexpr size_t MAX_BATCH_EVENTS{1000};
+
+      // Events kept while the aggregator cannot be reached. The oldest are dropped beyond this.
+      constexpr size_t MAX_QUEUED_EVENTS{100000};
+
+      constexpr auto MIN_RETRY_DELAY{std::chrono::seconds(1)};
+      constexpr auto MAX_RETRY_DELAY{std::chrono::seconds(30)};
+      constexpr int CONNECT_TIMEOUT_MS{5000};
+      constexpr int SEND_TIMEOUT_SECONDS{10};
+
+      // How often blocking socket waits check for shutdown
+      constexpr int POLL_MS{500};
+
+      // Guards against allocating garbage lengths from a corrupt stream
+      constexpr uint32_t MAX_FRAME_BYTES{16 * 1024 * 1024};
+
+      std::string EncodeFrameLength(size_t length)
+      {
+         std::string header(4, '\0');
+         for (size_t i = 0; i < header.size(); ++i)
+         {
+            header[i] = static_cast<char>((length >> (8 * i)) & 0xFF);
+         }
+         return header;
+      }
+
+#ifndef _WIN32
+      bool SendAll(int connection, std::string_view data)
+      {
+         while (!data.empty())
+         {
+            const auto bytes = ::send(connection, data.data(), data.size(), MSG_NOSIGNAL);
+            if (bytes <= 0) return false;
+            data.remove_prefix(static_cast<size_t>(bytes));
+         }
+         return true;
+      }
+
+      bool SendFrame(int connection, std::string_view payload)
+      {
+         return SendAll(connection, EncodeFrameLength(payload.size())) && SendAll(connection, payload);
+      }
+
+      // Waits for the whole buffer so a stop request is noticed while the peer is idle
+      bool ReceiveAll(int connection, char* buffer, size_t size, std::stop_token stopToken)
+      {
+         while (size > 0)
+         {
+            pollfd connectionPoll{.fd = connection, .events = POLLIN, .revents = 0};
+            const auto ready = ::poll(&connectionPoll, 1, POLL_MS);
+            if (stopToken.stop_requested()) return false;
+            if (ready < 0 && errno != EINTR) return false;
+            if (ready <= 0) continue;
+
+            const auto bytes = ::recv(connection, buffer, size, 0);
+            if (bytes <= 0) return false;
+            buffer += bytes;
+            size -= static_cast<size_t>(bytes);
+         }
+         return true;
+      }
+
+      std::optional<std::string> ReceiveFrame(int connection, std::stop_token stopToken)
+      {
+         std::array<unsigned char, 4> header{};
+         if (!ReceiveAll(connection, reinterpret_cast<char*>(header.data()), header.size(), stopToken)) return std::nullopt;
+
+         uint32_t length{0};
+         for (size_t i = 0; i < header.size(); ++i)
+         {
+            length |= static_cast<uint32_t>(header[i]) << (8 * i);
+         }
+         if (length > MAX_FRAME_BYTES) return std::nullopt;
+
+         std::string payload(length, '\0');
+         if (!ReceiveAll(connection, payload.data(), payload.size(), stopToken)) return std::nullopt;
+         return payload;
+      }
+
+      // Non blocking connect so an unreachable aggregator does not hold the forwarder for minutes
+      int ConnectTo(const addrinfo& address)
+      {
+         auto connection = ::socket(address.ai_family, address.ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, address.ai_protocol);
+         if (connection < 0) return -1;
+
+         if (::connect(connection, address.ai_addr, address.ai_addrlen) != 0)
+         {
+            pollfd connectPoll{.fd = connection, .events = POLLOUT, .revents = 0};
+            int error{0};
+            socklen_t errorLength{sizeof(error)};
+            if (errno != EINPROGRESS
+                || ::poll(&connectPoll, 1, CONNECT_TIMEOUT_MS) <= 0
+                || ::getsockopt(connection, SOL_SOCKET, SO_ERROR, &error, &errorLength) != 0
+                || error != 0)
+            {
+               ::close(connection);
+               return -1;
+            }
+         }
+
+         ::fcntl(connection, F_SETFL, ::fcntl(connection, F_GETFL) & ~O_NONBLOCK);
+
+         // A stalled aggregator fails the send instead of blocking the forwarder
+         timeval sendTimeout{.tv_sec = SEND_TIMEOUT_SECONDS, .tv_usec = 0};
+         ::setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+         return connection;
+      }
+#endif
+   }
+
+   EventForwarder::EventForwarder(std::string address, std::string key)
+      : address_(std::move(address))
+      , key_(std::move(key))
+   {
+   }
+
+   EventForwarder::~EventForwarder()
+   {
+      Shutdown();
+   }
+
+   const std::string& EventForwarder::GetAddress() const
+   {
+      return address_;
+   }
+
+   void EventForwarder::Start()
+   {
+      workThread_ = std::jthread([this](std::stop_token stopToken) {
+         this->Work(stopToken);
+      });
+
+      warp::log::Info("Forwarding changes to the aggregator at {}", address_);
+   }
+
+   void EventForwarder::Shutdown()
+   {
+      if (workThread_.joinable())
+      {
+         workThread_.request_stop();
+         workThread_.join();
+      }
+   }
+
+   void EventForwarder::Add(const FileMonitorData& fileMonitor)
+   {
+      {
+         std::scoped_lock lock(queueLock_);
+         queue_.emplace_back(TraceRecord{
+            .time = std::chrono::system_clock::now(),
+            .scanName = std::string(fileMonitor.scanName),
+            .path = fileMonitor.path,
+            .filename = fileMonitor.filename,
+            .isDirectory = fileMonitor.isDirectory,
+            .effect = fileMonitor.effect,
+            .movedFrom = fileMonitor.movedFrom
+         });
+         DropOverflowLocked();
+      }
+
+      queueCv_.notify_one();
+   }
+
+   void EventForwarder::DropOverflowLocked()
+   {
+      if (queue_.size() <= MAX_QUEUED_EVENTS) return;
+
+      if (droppedEvents_ == 0)
+      {
+         warp::log::Warning("Aggregator at {} is not keeping up ... Dropping the oldest queued changes", address_);
+      }
+
+      const auto overflow = queue_.size() - MAX_QUEUED_EVENTS;
+      queue_.erase(queue_.begin(), queue_.begin() + static_cast<std::ptrdiff_t>(overflow));
+      droppedEvents_ += overflow;
+   }
+
+   void EventForwarder::Requeue(std::vector<TraceRecord>& batch)
+   {
+      std::scoped_lock lock(queueLock_);
+      queue_.insert(queue_.begin(), std::make_move_iterator(batch.begin()), std::make_move_iterator(batch.end()));
+      DropOverflowLocked();
+   }
+
+#ifndef _WIN32
+   int EventForwarder::Connect()
+   {
+      auto hostPort = SplitHostPort(address_);
+      if (!hostPort || hostPort->first.empty())
+      {
+         warp::log::Error("Forward address {} is not valid ... Expected host:port", address_);
+         return -1;
+      }
+
+      addrinfo hints{};
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      addrinfo* addresses{nullptr};
+      if (::getaddrinfo(hostPort->first.c_str(), hostPort->second.c_str(), &hints, &addresses) != 0) return -1;
+
+      auto connection{-1};
+      for (auto* address = addresses; address && connection < 0; address = address->ai_next)
+      {
+         connection = ConnectTo(*address);
+      }
+      ::freeaddrinfo(addresses);
+      if (connection < 0) return -1;
+
+      std::string handshake(FORWARD_MAGIC.data(), FORWARD_MAGIC.size());
+      handshake += EncodeFrameLength(key_.size());
+      handshake += key_;
+      if (!SendAll(connection, handshake))
+      {
+         ::close(connection);
+         return -1;
+      }
+      return connection;
+   }
+
+   bool EventForwarder::SendBatch(int connection, TraceEncoder& encoder, const std::vector<TraceRecord>& batch)
+   {
+      std::ostringstream payload(std::ios::binary);
+      for (const auto& record : batch)
+      {
+         encoder.Encode(payload, record.GetFileMonitorData(), record.time);
+      }
+      return SendFrame(connection, payload.view());
+   }
+
+   void EventForwarder::Work(std::stop_token stopToken)
+   {
+      auto connection{-1};
+      TraceEncoder encoder;
+      auto retryDelay{MIN_RETRY_DELAY};
+      bool connectFailed{false};
+
+      while (true)
+      {
+         std::vector<TraceRecord> batch;
+         {
+            std::unique_lock lock(queueLock_);
+            queueCv_.wait(lock, stopToken, [this] { return !queue_.empty(); });
+
+            // Changes queued before the stop are still sent if the aggregator is connected
+            if (queue_.empty() || (stopToken.stop_requested() && connection < 0)) break;
+
+            // Let the rest of a burst join the batch
+            if (!stopToken.stop_requested())
+            {
+               queueCv_.wait_for(lock, stopToken, BATCH_DELAY, [this] { return queue_.size() >= MAX_BATCH_EVENTS; });
+            }
+
+            const auto count = std::min(queue_.size(), MAX_BATCH_EVENTS);
+            batch.assign(std::make_move_iterator(queue_.begin()), std::make_move_iterator(queue_.begin() + static_cast<std::ptrdiff_t>(count)));
+            queue_.erase(queue_.begin(), queue_.begin() + static_cast<std::ptrdiff_t>(count));
+         }
+
+         if (connection < 0)
+         {
+            connection = Connect();
+            if (connection < 0)
+            {
+               if (!std::exchange(connectFailed, true))
+               {
+                  warp::log::Warning("Could not connect to the aggregator at {} ... Queuing changes until it is reachable", address_);
+               }
+
+               Requeue(batch);
+
+               std::unique_lock lock(queueLock_);
+               queueCv_.wait_for(lock, stopToken, retryDelay, [] { return false; });
+               retryDelay = std::min(retryDelay * 2, MAX_RETRY_DELAY);
+               continue;
+            }
+
+            // Each connection starts a new record stream
+            encoder = TraceEncoder();
+            retryDelay = MIN_RETRY_DELAY;
+            connectFailed = false;
+
+            size_t dropped{0};
+            {
+               std::scoped_lock lock(queueLock_);
+               dropped = std::exchange(droppedEvents_, 0);
+            }
+            warp::log::Info("Connected to the aggregator at {}", address_);
+            if (dropped > 0) warp::log::Warning("Dropped {} changes while the aggregator at {} was unreachable", dropped, address_);
+         }
+
+         if (!SendBatch(connection, encoder, batch))
+         {
+            warp::log::Warning("Lost the connection to the aggregator at {} ... Reconnecting", address_);
+            ::close(std::exchange(connection, -1));
+
+            // The aggregator may have received part of the batch. Sending it again only repeats changes it already has.
+            Requeue(batch);
+         }
+      }
+
+      if (connection >= 0) ::close(connection);
+
+      std::scoped_lock lock(queueLock_);
+      if (!queue_.empty()) warp::log::Warning("Dropped {} changes not yet sent to the aggregator at {}", queue_.size(), address_);
+   }
+#else
+   int EventForwarder::Connect()
+   {
+      return -1;
+   }
+
+   bool EventForwarder::SendBatch(int, TraceEncoder&, const std::vector<TraceRecord>&)
+   {
+      return false;
+   }
+
+   void EventForwarder::Work(std::stop_token)
+   {
+      warp::log::Warning("Forwarding is not supported on Windows ... Ignoring forward_to");
+   }
+#endif
+
+   EventAggregator::EventAggregator(std::string address, std::string key, FileMonitorFunc fileMonitorFunc)
+      : address_(std::move(address))
+      , key_(std::move(key))
+      , fileMonitorFunc_(std::move(fileMonitorFunc))
+   {
+   }
+
+   EventAggregator::~EventAggregator()
+   {
+      Shutdown();
+   }
+
+   const std::string& EventAggregator::GetAddress() const
+   {
+      return address_;
+   }
+
+   const std::string& EventAggregator::GetKey() const
+   {
+      return key_;
+   }
+
+#ifndef _WIN32
+   bool EventAggregator::Start()
+   {
+      auto hostPort = SplitHostPort(address_);
+      if (!hostPort)
+      {
+         warp::log::Error("Aggregator address {} is not valid ... Expected host:port or :port", address_);
+         return false;
+      }
+
+      // Forwarded changes are trusted as if they were seen locally so only the key keeps out other machines
+      const auto host = hostPort->first.empty() ? DEFAULT_LISTEN_HOST : hostPort->first;
+      if (key_.empty() && !GetIsLoopbackHost(host))
+      {
+         warp::log::Error("Aggregator address {} accepts other machines so forward_key is required ... Not aggregating forwarded changes", address_);
+         return false;
+      }
+
+      addrinfo hints{};
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      hints.ai_flags = AI_PASSIVE;
+      addrinfo* addresses{nullptr};
+      if (::getaddrinfo(host.c_str(), hostPort->second.c_str(), &hints, &addresses) != 0)
+      {
+         warp::log::Error("Aggregator address {} could not be resolved", address_);
+         return false;
+      }
+
+      for (auto* address = addresses; address && listenSocket_ < 0; address = address->ai_next)
+      {
+         listenSocket_ = ::socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+         if (listenSocket_ < 0) continue;
+
+         int reuse{1};
+         ::setsockopt(listenSocket_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+         if (::bind(listenSocket_, address->ai_addr, address->ai_addrlen) != 0 || ::listen(listenSocket_, 8) != 0)
+         {
+            ::close(std::exchange(listenSocket_, -1));
+         }
+      }
+      ::freeaddrinfo(addresses);
+
+      if (listenSocket_ < 0)
+      {
+         warp::log::Error("Failed to listen for forwarded changes on {} ... {}", address_, std::strerror(errno));
+         return false;
+      }
+
+      workThread_ = std::jthread([this](std::stop_token stopToken) {
+         this->Work(stopToken);
+      });
+
+      warp::log::Info("Aggregating forwarded changes on {}:{}", host, hostPort->second);
+      return true;
+   }
+
+   void EventAggregator::Shutdown()
+   {
+      if (workThread_.joinable())
+      {
+         workThread_.request_stop();
+         workThread_.join();
+      }
+
+      if (listenSocket_ >= 0)
+      {
+         ::close(std::exchange(listenSocket_, -1));
+      }
+   }
+
+   void EventAggregator::Work(std::stop_token stopToken)
+   {
+      while (!stopToken.stop_requested())
+      {
+         // Threads of forwarders that went away are joined as new ones connect
+         connections_.remove_if([](const auto& connection) { return connection.done.load(); });
+
+         pollfd listenPoll{.fd = listenSocket_, .events = POLLIN, .revents = 0};
+         if (::poll(&listenPoll, 1, POLL_MS) <= 0) continue;
+
+         sockaddr_storage peerAddress{};
+         socklen_t peerLength{sizeof(peerAddress)};
+         const auto connection = ::accept4(listenSocket_, reinterpret_cast<sockaddr*>(&peerAddress), &peerLength, SOCK_CLOEXEC);
+         if (connection < 0) continue;
+
+         std::array<char, NI_MAXHOST> host{};
+         std::array<char, NI_MAXSERV> port{};
+         std::string peer("unknown");
+         if (::getnameinfo(reinterpret_cast<sockaddr*>(&peerAddress), peerLength, host.data(), host.size(), port.data(), port.size(), NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+         {
+            peer = std::string(host.data()) + ":" + port.data();
+         }
+
+         int keepAlive{1};
+         ::setsockopt(connection, SOL_SOCKET, SO_KEEPALIVE, &keepAlive, sizeof(keepAlive));
+
+         auto& entry = connections_.emplace_back();
+         entry.thread = std::jthread([this, connection, peer, &entry](std::stop_token connectionStop) {
+            this->HandleConnection(connection, peer, connectionStop);
+            ::close(connection);
+            entry.done = true;
+         });
+      }
+
+      // Stops and joins every forwarder connection
+      connections_.clear();
+   }
+
+   void EventAggregator::HandleConnection(int connection, const std::string& peer, std::stop_token stopToken)
+   {
+      std::array<char, FORWARD_MAGIC.size()> magic{};
+      auto key = ReceiveAll(connection, magic.data(), magic.size(), stopToken) ? ReceiveFrame(connection, stopToken) : std::nullopt;
+      if (magic != FORWARD_MAGIC || !key || *key != key_)
+      {
+         warp::log::Warning("Rejected forwarder {} ... Not a remote-scan forwarder or forward_key does not match", peer);
+         return;
+      }
+
+      warp::log::Info("Forwarder {} connected", peer);
+
+      TraceDecoder decoder;
+      while (auto frame = ReceiveFrame(connection, stopToken))
+      {
+         std::istringstream input(std::move(*frame), std::ios::binary);
+         while (input.peek() != std::char_traits<char>::eof())
+         {
+            auto record = decoder.Decode(input);
+            if (!record)
+            {
+               warp::log::Warning("Forwarder {} sent a corrupt batch ... Closing the connection", peer);
+               return;
+            }
+
+            // Forwarded changes settle from when they arrive here since the clocks of the nodes may differ
+            fileMonitorFunc_(record->GetFileMonitorData());
+         }
+      }
+
+      if (!stopToken.stop_requested()) warp::log::Info("Forwarder {} disconnected", peer);
+   }
+#else
+   bool EventAggregator::Start()
+   {
+      warp::log::Warning("Aggregating is not supported on Windows ... Ignoring aggregator_listen");
+      return false;
+   }
+
+   void EventAggregator::Shutdown()
+   {
+   }
+
+   void EventAggregator::Work(std::stop_token)
+   {
+   }
+
+   void EventAggregator::HandleConnection(int, const std::string&, std::stop_token)
+   {
+   }
+#endif
+}
\ No newline at end of file
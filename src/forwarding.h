@@ -0,0 +1,103 @@
+#pragma once
+
+#include "trace.h"
+#include "types.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace remote_scan
+{
+   // Sends the file monitor events of this instance to an aggregator instead of notifying the media servers.
+   // Events are sent in batches over TCP in the trace record format. While the aggregator cannot be reached
+   // events are kept in a bounded queue and sent once it is back.
+   // Not available on Windows.
+   class EventForwarder
+   {
+   public:
+      EventForwarder(std::string address, std::string key);
+      virtual ~EventForwarder();
+
+      EventForwarder(const EventForwarder&) = delete;
+      EventForwarder& operator=(const EventForwarder&) = delete;
+
+      [[nodiscard]] const std::string& GetAddress() const;
+
+      void Start();
+      void Shutdown();
+
+      void Add(const FileMonitorData& fileMonitor);
+
+   private:
+      void Work(std::stop_token stopToken);
+
+      // Returns the connected socket or -1
+      [[nodiscard]] int Connect();
+      [[nodiscard]] bool SendBatch(int connection, TraceEncoder& encoder, const std::vector<TraceRecord>& batch);
+
+      // Puts an unsent batch back in front of the queue
+      void Requeue(std::vector<TraceRecord>& batch);
+      void DropOverflowLocked();
+
+      std::string address_;
+      std::string key_;
+
+      std::mutex queueLock_;
+      std::condition_variable_any queueCv_;
+      std::deque<TraceRecord> queue_;
+      size_t droppedEvents_{0};
+
+      std::jthread workThread_;
+   };
+
+   // Receives the events of forwarding instances and hands them to the monitor of this instance
+   // so the notifies of every node share one settle and throttle schedule.
+   // Not available on Windows.
+   class EventAggregator
+   {
+   public:
+      using FileMonitorFunc = std::function<void(FileMonitorData&& fileMonitor)>;
+
+      EventAggregator(std::string address, std::string key, FileMonitorFunc fileMonitorFunc);
+      virtual ~EventAggregator();
+
+      EventAggregator(const EventAggregator&) = delete;
+      EventAggregator& operator=(const EventAggregator&) = delete;
+
+      [[nodiscard]] const std::string& GetAddress() const;
+      [[nodiscard]] const std::string& GetKey() const;
+
+      // Returns false if the address could not be listened on
+      bool Start();
+      void Shutdown();
+
+   private:
+      struct Connection
+      {
+         std::jthread thread;
+         std::atomic<bool> done{false};
+      };
+
+      void Work(std::stop_token stopToken);
+      void HandleConnection(int connection, const std::string& peer, std::stop_token stopToken);
+
+      std::string address_;
+      std::string key_;
+      FileMonitorFunc fileMonitorFunc_;
+      int listenSocket_{-1};
+
+      // Only touched by the accept thread
+      std::list<Connection> connections_;
+
+      std::jthread workThread_;
+   };
+}
\ No newline at end of file
@@ -0,0 +1,213 @@
+﻿#include "media-index.h"
+
+#include <warp/log/log.h>
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <system_error>
+#include <utility>
+
+namespace remote_scan
+{
+   namespace
+   {
+      bool IsWithin(const std::filesystem::path& path, const std::filesystem::path& parent)
+      {
+         auto [parentEnd, pathIter] = std::mismatch(parent.begin(), parent.end(), path.begin(), path.end());
+         return parentEnd == parent.end();
+      }
+   }
+
+   MediaIndex::MediaIndex(FileCheckFunc isMediaFunc)
+      : isMediaFunc_(std::move(isMediaFunc))
+   {
+   }
+
+   MediaIndex::~MediaIndex()
+   {
+      Shutdown();
+   }
+
+   void MediaIndex::Shutdown()
+   {
+      if (buildThread_.joinable())
+      {
+         buildThread_.request_stop();
+         buildThread_.join();
+      }
+   }
+
+   bool MediaIndex::Walk(const std::filesystem::path& directory, DirectoryMap& directories, size_t maxFiles, std::stop_token stopToken) const
+   {
+      size_t fileCount{0};
+      std::error_code ec;
+      for (auto iter = std::filesystem::recursive_directory_iterator(directory, std::filesystem::directory_options::skip_permission_denied, ec);
+           !ec && iter != std::filesystem::recursive_directory_iterator();
+           iter.increment(ec))
+      {
+         if (stopToken.stop_requested()) return false;
+
+         std::error_code typeEc;
+         if (!iter->is_regular_file(typeEc) || !isMediaFunc_(iter->path().filename())) continue;
+
+         if (++fileCount > maxFiles) return false;
+         directories[iter->path().parent_path()].emplace_back(iter->path().filename().native());
+      }
+      return true;
+   }
+
+   void MediaIndex::Build(std::vector<std::filesystem::path> roots)
+   {
+      {
+         // A reload that leaves the roots alone keeps the current index
+         std::scoped_lock lock(indexLock_);
+         if (roots == roots_ && (ready_ || buildThread_.joinable())) return;
+      }
+
+      Shutdown();
+
+      {
+         std::scoped_lock lock(indexLock_);
+         ready_ = false;
+         roots_ = roots;
+         directories_.clear();
+      }
+
+      if (roots.empty()) return;
+
+      buildThread_ = std::jthread([this, roots = std::move(roots)](std::stop_token stopToken) {
+         const auto start = std::chrono::steady_clock::now();
+
+         DirectoryMap directories;
+         for (const auto& root : roots)
+         {
+            if (!Walk(root, directories, std::numeric_limits<size_t>::max(), stopToken)) return;
+         }
+
+         size_t fileCount{0};
+         const auto folderCount = directories.size();
+         for (auto& [directory, files] : directories)
+         {
+            std::ranges::sort(files);
+            fileCount += files.size();
+         }
+
+         // Changes seen while walking are picked up by the walk itself or by the events that follow
+         {
+            std::scoped_lock lock(indexLock_);
+            directories_ = std::move(directories);
+            ready_ = true;
+         }
+
+         warp::log::Info("Media index built with {} files in {} folders in {}ms",
+                         fileCount,
+                         folderCount,
+                         std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+      });
+   }
+
+   bool MediaIndex::GetIndexedLocked(const std::filesystem::path& path) const
+   {
+      return ready_ && std::ranges::any_of(roots_, [&path](const auto& root) { return IsWithin(path, root); });
+   }
+
+   void MediaIndex::AddFile(const std::filesystem::path& directory, const std::filesystem::path& filename)
+   {
+      if (!isMediaFunc_(filename)) return;
+
+      std::scoped_lock lock(indexLock_);
+      if (!GetIndexedLocked(directory)) return;
+
+      // Only a new directory or a new file name allocates
+      auto directoryIter = directories_.find(directory);
+      if (directoryIter == directories_.end()) directoryIter = directories_.emplace(directory, FileNames()).first;
+
+      auto& files = directoryIter->second;
+      const auto& name = filename.native();
+      auto iter = std::ranges::lower_bound(files, name);
+      if (iter == files.end() || *iter != name) files.insert(iter, name);
+   }
+
+   void MediaIndex::RemoveFile(const std::filesystem::path& directory, const std::filesystem::path& filename)
+   {
+      std::scoped_lock lock(indexLock_);
+
+      auto directoryIter = directories_.find(directory);
+      if (directoryIter == directories_.end()) return;
+
+      auto& files = directoryIter->second;
+      const auto& name = filename.native();
+      auto iter = std::ranges::lower_bound(files, name);
+      if (iter != files.end() && *iter == name) files.erase(iter);
+      if (files.empty()) directories_.erase(directoryIter);
+   }
+
+   std::optional<std::vector<std::filesystem::path>> MediaIndex::AddDirectory(const std::filesystem::path& directory, size_t maxFiles)
+   {
+      {
+         std::scoped_lock lock(indexLock_);
+         if (!GetIndexedLocked(directory)) return std::nullopt;
+      }
+
+      // The walk runs without the lock since the directory may be large or on a slow share
+      DirectoryMap directories;
+      if (!Walk(directory, directories, maxFiles, {})) return std::nullopt;
+
+      std::vector<std::filesystem::path> mediaFiles;
+      std::scoped_lock lock(indexLock_);
+      for (auto& [path, files] : directories)
+      {
+         std::ranges::sort(files);
+         for (const auto& file : files)
+         {
+            mediaFiles.emplace_back(path / file);
+         }
+         directories_.insert_or_assign(path, std::move(files));
+      }
+      return mediaFiles;
+   }
+
+   std::optional<std::vector<std::filesystem::path>> MediaIndex::RemoveDirectory(const std::filesystem::path& directory, size_t maxFiles)
+   {
+      std::scoped_lock lock(indexLock_);
+      if (!GetIndexedLocked(directory)) return std::nullopt;
+
+      // Children sort directly after their parent so the whole subtree is one range
+      std::vector<std::filesystem::path> mediaFiles;
+      auto iter = directories_.lower_bound(directory);
+      while (iter != directories_.end() && IsWithin(iter->first, directory))
+      {
+         for (const auto& file : iter->second)
+         {
+            mediaFiles.emplace_back(iter->first / file);
+         }
+         iter = directories_.erase(iter);
+      }
+
+      if (mediaFiles.size() > maxFiles) return std::nullopt;
+      return mediaFiles;
+   }
+
+   void MediaIndex::MoveDirectory(const std::filesystem::path& from, const std::filesystem::path& to)
+   {
+      std::scoped_lock lock(indexLock_);
+
+      std::vector<std::pair<std::filesystem::path, FileNames>> moved;
+      auto iter = directories_.lower_bound(from);
+      while (iter != directories_.end() && IsWithin(iter->first, from))
+      {
+         auto relativePath = iter->first.lexically_relative(from);
+         moved.emplace_back((relativePath == ".") ? to : to / relativePath, std::move(iter->second));
+         iter = directories_.erase(iter);
+      }
+
+      // A directory moved out of the roots is only forgotten
+      if (!GetIndexedLocked(to)) return;
+
+      for (auto& [path, files] : moved)
+      {
+         directories_.insert_or_assign(std::move(path), std::move(files));
+      }
+   }
+}
\ No newline at end of file
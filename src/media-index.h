@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace remote_scan
+{
+   // In memory index of the media files below a set of roots. Each directory holding media files stores
+   // only the file names. Lets a created or removed directory be expanded into the media files it holds
+   // so Emby can update those files instead of scanning the whole library.
+   class MediaIndex
+   {
+   public:
+      using FileCheckFunc = std::function<bool(const std::filesystem::path& filename)>;
+
+      explicit MediaIndex(FileCheckFunc isMediaFunc);
+      virtual ~MediaIndex();
+
+      MediaIndex(const MediaIndex&) = delete;
+      MediaIndex& operator=(const MediaIndex&) = delete;
+
+      // Rebuilds the index for the roots on a background thread. Directories are not expanded until it completes.
+      void Build(std::vector<std::filesystem::path> roots);
+      void Shutdown();
+
+      // Take the directory and file name separately as events carry them so no full path is built
+      void AddFile(const std::filesystem::path& directory, const std::filesystem::path& filename);
+      void RemoveFile(const std::filesystem::path& directory, const std::filesystem::path& filename);
+
+      // Walks a directory that was created or moved in and returns its media files after adding them to the index.
+      // Returns nullopt if the directory is not indexed or holds more than maxFiles media files.
+      [[nodiscard]] std::optional<std::vector<std::filesystem::path>> AddDirectory(const std::filesystem::path& directory, size_t maxFiles);
+
+      // Removes the media files of a directory that was removed and returns them.
+      // Returns nullopt if the directory is not indexed or held more than maxFiles media files.
+      [[nodiscard]] std::optional<std::vector<std::filesystem::path>> RemoveDirectory(const std::filesystem::path& directory, size_t maxFiles);
+
+      // Moves the indexed files of a directory to its new location without touching the disk
+      void MoveDirectory(const std::filesystem::path& from, const std::filesystem::path& to);
+
+   private:
+      // File names are kept in the native string type of the platform so events can be compared without converting
+      using FileNames = std::vector<std::filesystem::path::string_type>;
+      using DirectoryMap = std::map<std::filesystem::path, FileNames>;
+
+      [[nodiscard]] bool GetIndexedLocked(const std::filesystem::path& path) const;
+      [[nodiscard]] bool Walk(const std::filesystem::path& directory, DirectoryMap& directories, size_t maxFiles, std::stop_token stopToken) const;
+
+      FileCheckFunc isMediaFunc_;
+
+      std::mutex indexLock_;
+      bool ready_{false};
+      std::vector<std::filesystem::path> roots_;
+      DirectoryMap directories_;
+
+      std::jthread buildThread_;
+   };
+}
\ No newline at end of file
@@ -8,45 +8,273 @@
 #include <warp/utils.h>
 
 #include <algorithm>
+#include <array>
 #include <cctype>
+#include <format>
+#include <iterator>
 #include <ranges>
 #include <set>
+#include <string_view>
+#include <type_traits>
 
 namespace remote_scan
 {
-   Monitor::Monitor(std::shared_ptr<ConfigReader> configReader)
-      : configReader_(configReader)
-      , notify_(configReader_, [this](const std::filesystem::path& path) { return this->GetFileImage(path); })
+   namespace
    {
-      const auto& ignoreFolders = configReader_->GetIgnoreFolders();
-      for (const auto& ignoreFolder : ignoreFolders)
+      // Extensions longer than this are never in the configured sets
+      constexpr size_t MAX_EXTENSION_LENGTH{16};
+      using ExtensionBuffer = std::array<char, MAX_EXTENSION_LENGTH>;
+
+      // Lower cases the extension of a file name and its dot into the buffer so checking an event does not allocate.
+      // Returns an empty view when there is no extension or it cannot match any configured extension.
+      std::string_view GetLowerExtension(const std::filesystem::path& filename, ExtensionBuffer& buffer)
       {
-         ignoreFolders_.emplace_back(ignoreFolder.folder);
+         using UnsignedChar = std::make_unsigned_t<std::filesystem::path::value_type>;
+
+         const auto& name = filename.native();
+         const auto dot = name.rfind('.');
+         if (dot == std::filesystem::path::string_type::npos || dot == 0 || name.size() - dot > buffer.size()) return {};
+
+         const auto length = name.size() - dot;
+         for (size_t i = 0; i < length; ++i)
+         {
+            const auto c = static_cast<UnsignedChar>(name[dot + i]);
+            if (c > 127) return {};
+            buffer[i] = static_cast<char>(std::tolower(static_cast<int>(c)));
+         }
+         return {buffer.data(), length};
       }
 
-      auto addExtensionsToSet = [](const auto& extensions, std::unordered_set<std::string>& set) {
-         for (const auto& ext : extensions)
+      std::shared_ptr<const MonitorFilters> CreateFilters(const ConfigReader& configReader)
+      {
+         auto filters = std::make_shared<MonitorFilters>();
+         for (const auto& scan : configReader.GetRemoteScanConfig().scans)
          {
-            auto lowerExt = warp::ToLower(ext.extension);
-            if (!lowerExt.empty() && lowerExt[0] != '.')
+            auto& settings = filters->scanSettings[scan.name];
+            settings.name = InternScanName(scan.name);
+            settings.basePath = NormalizePath(scan.basePath);
+            settings.groupDepth = static_cast<size_t>(std::max(scan.groupDepth, 0));
+            for (const auto& pathConfig : scan.pathsFromBase)
             {
-               lowerExt = "." + lowerExt;
+               settings.roots.emplace_back(NormalizePath(scan.basePath / pathConfig.path));
             }
-            set.insert(lowerExt);
+            settings.stormEventsPerSecond = static_cast<size_t>(std::max(scan.stormEventsPerSecond, 0));
+            settings.stormMaxPendingPaths = static_cast<size_t>(std::max(scan.stormMaxPendingPaths, 0));
+            settings.stormMaxFolders = static_cast<size_t>(std::max(scan.stormMaxFolders, 0));
+            for (const auto& library : scan.plexLibraries)
+            {
+               settings.libraryTargets.emplace_back(GetLibraryTarget("plex", library.server, library.library));
+            }
+            for (const auto& library : scan.embyLibraries)
+            {
+               settings.libraryTargets.emplace_back(GetLibraryTarget("emby", library.server, library.library));
+            }
+            if (!scan.plexLibraries.empty()) settings.notifyTargets.emplace_back(NotifyTarget::PLEX);
+            if (!scan.embyLibraries.empty()) settings.notifyTargets.emplace_back(NotifyTarget::EMBY);
+            if (settings.notifyTargets.empty()) settings.notifyTargets.emplace_back(NotifyTarget::ALL);
          }
-      };
 
-      addExtensionsToSet(configReader_->GetImageExtensions(), validImageExtensions_);
-      addExtensionsToSet(configReader_->GetValidFileExtensions(), validExtensions_);
+         for (const auto& ignoreFolder : configReader.GetIgnoreFolders())
+         {
+            filters->ignoreFolders.emplace_back(ignoreFolder.folder);
+         }
+
+         auto addExtensionsToSet = [](const auto& extensions, ExtensionSet& set) {
+            for (const auto& ext : extensions)
+            {
+               auto lowerExt = warp::ToLower(ext.extension);
+               if (!lowerExt.empty() && lowerExt[0] != '.')
+               {
+                  lowerExt = "." + lowerExt;
+               }
+               set.insert(lowerExt);
+            }
+         };
+
+         addExtensionsToSet(configReader.GetImageExtensions(), filters->validImageExtensions);
+         addExtensionsToSet(configReader.GetValidFileExtensions(), filters->validExtensions);
+         addExtensionsToSet(configReader.GetMetadataExtensions(), filters->metadataExtensions);
+         return filters;
+      }
+
+      std::optional<MonitorPriority> GetPriorityFromName(std::string_view name)
+      {
+         const auto lowerName = warp::ToLower(name);
+         for (size_t i = 0; i < MONITOR_PRIORITY_COUNT; ++i)
+         {
+            if (lowerName == GetPriorityName(static_cast<MonitorPriority>(i))) return static_cast<MonitorPriority>(i);
+         }
+         return std::nullopt;
+      }
+
+      bool GetSharesLibrary(const MonitorFilters& filters, std::string_view scanName, std::string_view otherScanName)
+      {
+         auto settingsIter = filters.scanSettings.find(scanName);
+         auto otherIter = filters.scanSettings.find(otherScanName);
+         if (settingsIter == filters.scanSettings.end() || otherIter == filters.scanSettings.end()) return false;
+
+         return std::ranges::any_of(settingsIter->second.libraryTargets, [&otherIter](const auto& target) {
+            return std::ranges::find(otherIter->second.libraryTargets, target) != otherIter->second.libraryTargets.end();
+         });
+      }
+
+      bool IsWithin(const std::filesystem::path& path, const std::filesystem::path& parent)
+      {
+         auto [parentEnd, pathIter] = std::mismatch(parent.begin(), parent.end(), path.begin(), path.end());
+         return parentEnd == parent.end();
+      }
+
+      // Created or removed directories with more media files than this still scan the whole library
+      constexpr size_t MAX_EXPANDED_FILES{1000};
+
+      // How long watch events for a file reported by a download manager are dropped. Long enough for polled paths to catch up.
+      constexpr auto SETTLED_DUPLICATE_WINDOW{std::chrono::minutes(10)};
+
+      // Only scans notifying Emby need their directories expanded into files
+      std::vector<std::filesystem::path> GetIndexRoots(const ConfigReader& configReader)
+      {
+         std::vector<std::filesystem::path> roots;
+         for (const auto& scan : configReader.GetRemoteScanConfig().scans)
+         {
+            if (scan.embyLibraries.empty()) continue;
+
+            for (const auto& pathConfig : scan.pathsFromBase)
+            {
+               roots.emplace_back(NormalizePath(scan.basePath / pathConfig.path));
+            }
+         }
+         return roots;
+      }
+   }
+
+   Monitor::Monitor(std::shared_ptr<ConfigReader> configReader)
+      : Monitor(configReader, nullptr)
+   {
+      // A library finishing its scan may release held notifies
+      serverActivity_ = std::make_unique<ServerActivity>(configReader_, [this] { workCv_.notify_one(); });
+   }
+
+   Monitor::Monitor(std::shared_ptr<ConfigReader> configReader, NotifyFunc notifyFunc)
+      : configReader_(configReader)
+      , notifyFunc_(std::move(notifyFunc))
+      , filters_(CreateFilters(*configReader_))
+      , mediaIndex_([this](const std::filesystem::path& filename) { return this->GetFileMedia(filename); })
+      , notifyWorkers_([this](ActiveMonitor& monitor, NotifyTarget target) { this->NotifyMonitor(monitor, target); },
+                       [this](std::string_view scanName) { this->NotifyDone(scanName); })
+   {
+      lastPriorityNotifyTimes_.fill(std::chrono::system_clock::time_point::min());
+      SetTimingsLocked(configReader_->GetRemoteScanConfig());
+   }
+
+   void Monitor::SetTimingsLocked(const RemoteScanConfig& config)
+   {
+      globalDelay_ = std::chrono::seconds(config.secondsBetweenNotifies);
+      priorityAging_ = std::chrono::seconds(std::max(config.priorityAgingSeconds, 0));
+      maxPending_ = std::chrono::seconds(std::max(config.maxSecondsPending, 0));
+      maxDeferred_ = std::chrono::seconds(std::max(config.maxSecondsDeferred, 0));
+
+      // Every class settles like before and only shares the global throttle unless configured otherwise
+      for (auto& timing : priorityTimings_)
+      {
+         timing.settleDelay = std::chrono::seconds(config.secondsBeforeNotify);
+         timing.throttleDelay = std::chrono::seconds(0);
+      }
+
+      for (const auto& classConfig : config.priorityClasses)
+      {
+         auto priority = GetPriorityFromName(classConfig.priorityClass);
+         if (!priority)
+         {
+            warp::log::Warning("Unknown priority class {} ... Expected media, delete or metadata", classConfig.priorityClass);
+            continue;
+         }
+
+         auto& timing = priorityTimings_[static_cast<size_t>(*priority)];
+         if (classConfig.secondsBeforeNotify) timing.settleDelay = std::chrono::seconds(*classConfig.secondsBeforeNotify);
+         if (classConfig.secondsBetweenNotifies) timing.throttleDelay = std::chrono::seconds(*classConfig.secondsBetweenNotifies);
+      }
+   }
+
+   void Monitor::UpdateConfig(std::shared_ptr<ConfigReader> configReader)
+   {
+      auto filters = CreateFilters(*configReader);
+      {
+         std::scoped_lock lock(filtersLock_);
+         filters_ = filters;
+      }
+
+      // Workers of removed scans or of server types a scan no longer notifies would otherwise sit idle
+      notifyWorkers_.Remove([this, &filters](std::string_view scanName, NotifyTarget target) {
+         if (!filters->scanSettings.contains(scanName)) return false;
+
+         const auto targets = GetNotifyTargets(*filters, scanName);
+         return std::ranges::find(targets, target) != targets.end();
+      });
+
+      {
+         std::scoped_lock lock(workLock_);
+         configReader_ = configReader;
+
+         const auto& config = configReader_->GetRemoteScanConfig();
+         SetTimingsLocked(config);
+
+         std::erase_if(activeMonitors_, [&config](const auto& monitor) {
+            if (std::ranges::any_of(config.scans, [&monitor](const auto& scan) { return scan.name == monitor.scanName; })) return false;
+
+            warp::log::Warning("Scan {} removed from the configuration ... Dropped {} pending paths", monitor.scanName, monitor.paths.size());
+            return true;
+         });
+      }
+
+      // The settle and throttle delays may have changed
+      workCv_.notify_one();
+
+      mediaIndex_.Build(GetIndexRoots(*configReader));
+
+      if (serverActivity_)
+      {
+         serverActivity_->UpdateConfig(configReader);
+      }
+
+      if (notify_)
+      {
+         notify_->UpdateConfig(configReader);
+      }
+   }
+
+   void Monitor::Connect()
+   {
+      if (notify_ || notifyFunc_) return;
+
+      std::shared_ptr<ConfigReader> configReader;
+      {
+         std::scoped_lock lock(workLock_);
+         configReader = configReader_;
+      }
+
+      notify_ = std::make_unique<Notify>(configReader,
+                                         eventLog_,
+                                         [this](const std::filesystem::path& path) { return this->GetFileMetadata(path); },
+                                         [this](const std::filesystem::path& path) { return this->GetFileMedia(path); });
    }
 
    void Monitor::GetTasks(std::vector<warp::Task>& tasks)
    {
-      notify_.GetTasks(tasks);
+      if (notify_)
+      {
+         notify_->GetTasks(tasks);
+      }
    }
 
    void Monitor::Run()
    {
+      mediaIndex_.Build(GetIndexRoots(*configReader_));
+
+      if (serverActivity_)
+      {
+         serverActivity_->Run();
+      }
+
       // Create the thread to monitor active scans
       workThread_ = std::jthread([this](std::stop_token stopToken) {
          this->Work(stopToken);
@@ -55,6 +283,11 @@ namespace remote_scan
 
    void Monitor::Shutdown()
    {
+      if (serverActivity_)
+      {
+         serverActivity_->Shutdown();
+      }
+
       if (workThread_.joinable())
       {
          workThread_.request_stop();
@@ -62,213 +295,969 @@ namespace remote_scan
          warp::log::Info("Waiting for monitor thread to finish...");
          workThread_.join();
       }
+
+      warp::log::Info("Waiting for notify workers to finish...");
+      notifyWorkers_.Shutdown();
+
+      mediaIndex_.Shutdown();
+      eventLog_.Shutdown();
+
+      if (notify_)
+      {
+         notify_->LogStatistics();
+      }
+   }
+
+   std::chrono::system_clock::time_point Monitor::GetReadyTimeLocked(const ActiveMonitor& monitor) const
+   {
+      if (monitor.flush) return std::chrono::system_clock::time_point::min();
+
+      // A monitor is ready once it settles and its class throttle has passed. Files reported by a download manager have already settled.
+      const auto index = static_cast<size_t>(monitor.priority);
+      const auto& timing = priorityTimings_[index];
+      auto readyAt = monitor.settled ? monitor.time : monitor.time + timing.settleDelay;
+
+      // A monitor that never settles is forced once it has been pending too long and one of its paths has settled
+      if (maxPending_.count() > 0 && readyAt > monitor.firstTime + maxPending_)
+      {
+         auto pathSettledAt = std::chrono::system_clock::time_point::max();
+         for (const auto& path : monitor.paths)
+         {
+            pathSettledAt = std::min(pathSettledAt, path.time + timing.settleDelay);
+         }
+         readyAt = std::min(readyAt, std::max(monitor.firstTime + maxPending_, pathSettledAt));
+      }
+
+      auto throttleAt = lastPriorityNotifyTimes_[index] + timing.throttleDelay;
+      readyAt = (readyAt > throttleAt) ? readyAt : throttleAt;
+
+      // A library its server is already scanning holds the notify until the scan finishes or the deferral limit passes.
+      // Changes arriving in the meantime merge into the held monitor.
+      if (GetDeferredLocked(monitor)) readyAt += maxDeferred_;
+      return readyAt;
+   }
+
+   bool Monitor::GetSettledLocked(const ActiveMonitor& monitor, std::chrono::system_clock::time_point now) const
+   {
+      return monitor.flush || monitor.settled || monitor.time + priorityTimings_[static_cast<size_t>(monitor.priority)].settleDelay <= now;
+   }
+
+   bool Monitor::GetDeferredLocked(const ActiveMonitor& monitor) const
+   {
+      if (!serverActivity_ || maxDeferred_.count() <= 0 || monitor.flush) return false;
+
+      auto filters = GetFilters();
+      auto settingsIter = filters->scanSettings.find(monitor.scanName);
+      if (settingsIter == filters->scanSettings.end()) return false;
+
+      return std::ranges::any_of(settingsIter->second.libraryTargets, [this](const auto& target) {
+         return serverActivity_->GetBusy(target);
+      });
+   }
+
+   ActiveMonitor Monitor::TakeStablePathsLocked(ActiveMonitor& monitor, std::chrono::system_clock::time_point now) const
+   {
+      const auto settleDelay = priorityTimings_[static_cast<size_t>(monitor.priority)].settleDelay;
+
+      ActiveMonitor stableMonitor;
+      stableMonitor.scanName = monitor.scanName;
+      stableMonitor.priority = monitor.priority;
+      stableMonitor.firstTime = monitor.firstTime;
+      stableMonitor.time = monitor.firstTime;
+
+      std::vector<ActiveMonitorPath> changingPaths;
+      for (auto& path : monitor.paths)
+      {
+         if (path.time + settleDelay <= now)
+         {
+            stableMonitor.time = std::max(stableMonitor.time, path.time);
+            stableMonitor.paths.emplace_back(std::move(path));
+         }
+         else
+         {
+            changingPaths.emplace_back(std::move(path));
+         }
+      }
+
+      // The paths still changing start a fresh batch
+      monitor.paths = std::move(changingPaths);
+      monitor.firstTime = now;
+      monitor.lastPathIndex = monitor.paths.size();
+      return stableMonitor;
+   }
+
+   int64_t Monitor::GetEffectiveRankLocked(const ActiveMonitor& monitor, std::chrono::system_clock::time_point now) const
+   {
+      // Waiting monitors move up one class for every aging period so metadata is never starved by a steady stream of media
+      auto rank = static_cast<int64_t>(monitor.priority);
+      if (priorityAging_.count() > 0 && now > monitor.firstTime)
+      {
+         rank -= (now - monitor.firstTime) / priorityAging_;
+      }
+      return std::max<int64_t>(rank, 0);
+   }
+
+   std::optional<std::chrono::system_clock::time_point> Monitor::GetNextWakeTimeLocked() const
+   {
+      // The earliest time we can process any item is after it is ready and the global throttle has passed.
+      // Scans still being notified are left out until their worker is done.
+      auto readyAt = std::chrono::system_clock::time_point::max();
+      for (const auto& monitor : activeMonitors_)
+      {
+         if (busyScans_.contains(monitor.scanName) || (paused_ && !monitor.flush)) continue;
+
+         // Flushed monitors skip the global throttle as well
+         if (monitor.flush) return std::chrono::system_clock::time_point::min();
+         readyAt = std::min(readyAt, GetReadyTimeLocked(monitor));
+      }
+
+      if (readyAt == std::chrono::system_clock::time_point::max()) return std::nullopt;
+
+      auto throttleAt = lastNotifyTime_ + globalDelay_;
+      return (readyAt > throttleAt) ? readyAt : throttleAt;
+   }
+
+   std::vector<ActiveMonitor> Monitor::TakeReadyMonitorsLocked(std::chrono::system_clock::time_point now)
+   {
+      auto wakeTime = GetNextWakeTimeLocked();
+      if (!wakeTime || now < *wakeTime) return {};
+
+      // Of the ready monitors the most urgent class goes first and the oldest within a class
+      auto bestIter = activeMonitors_.end();
+      int64_t bestRank{0};
+      for (auto iter = activeMonitors_.begin(); iter != activeMonitors_.end(); ++iter)
+      {
+         if (busyScans_.contains(iter->scanName) || (paused_ && !iter->flush) || GetReadyTimeLocked(*iter) > now) continue;
+
+         // Flushed monitors go first since someone is waiting on them
+         auto rank = iter->flush ? -1 : GetEffectiveRankLocked(*iter, now);
+         if (bestIter == activeMonitors_.end() || rank < bestRank || (rank == bestRank && iter->time < bestIter->time))
+         {
+            bestIter = iter;
+            bestRank = rank;
+         }
+      }
+
+      if (bestIter == activeMonitors_.end()) return {};
+
+      std::optional<ActiveMonitor> monitor;
+      if (GetSettledLocked(*bestIter, now))
+      {
+         monitor = std::move(*bestIter);
+         activeMonitors_.erase(bestIter);
+      }
+      else
+      {
+         monitor = TakeStablePathsLocked(*bestIter, now);
+         warp::log::Info("Scan {} still changing after {}s ... Notifying {} settled paths and keeping {} changing paths",
+                         monitor->scanName,
+                         maxPending_.count(),
+                         monitor->paths.size(),
+                         bestIter->paths.size());
+
+         if (bestIter->paths.empty()) activeMonitors_.erase(bestIter);
+      }
+
+      // Other groups of the same scan that have settled go out in the same request so each server still gets one merged scan.
+      // The same group from another class joins too so an upgrade removing the old file and adding the new one is one request.
+      std::erase_if(activeMonitors_, [&](auto& other) {
+         if (other.scanName != monitor->scanName || !GetSettledLocked(other, now)) return false;
+         if (other.priority != monitor->priority && other.groupPath != monitor->groupPath) return false;
+
+         MergeMonitor(*monitor, other);
+         return true;
+      });
+
+      lastNotifyTime_ = now;
+      lastPriorityNotifyTimes_[static_cast<size_t>(monitor->priority)] = now;
+
+      // Settled scans notifying the same libraries go out right after so a change seen by overlapping scans
+      // reaches each library once instead of again after the next throttle
+      std::vector<ActiveMonitor> monitors;
+      monitors.emplace_back(std::move(*monitor));
+
+      auto filters = GetFilters();
+      std::erase_if(activeMonitors_, [&](auto& other) {
+         const auto& first = monitors.front();
+         if (other.scanName == first.scanName || other.priority != first.priority || !GetSettledLocked(other, now)) return false;
+         if (busyScans_.contains(other.scanName) || (paused_ && !other.flush) || !GetSharesLibrary(*filters, first.scanName, other.scanName)) return false;
+         if (GetDeferredLocked(other)) return false;
+
+         auto scanIter = std::ranges::find(monitors, other.scanName, &ActiveMonitor::scanName);
+         if (scanIter != monitors.end())
+         {
+            MergeMonitor(*scanIter, other);
+         }
+         else
+         {
+            monitors.emplace_back(std::move(other));
+         }
+         return true;
+      });
+
+      // Moves going out with these batches no longer cover later events
+      std::erase_if(pendingMoves_, [this](const auto& move) { return FindMoveLocked(move).first == nullptr; });
+
+      return monitors;
+   }
+
+   std::optional<std::chrono::system_clock::time_point> Monitor::GetNextWakeTime()
+   {
+      std::scoped_lock lock(workLock_);
+      return GetNextWakeTimeLocked();
+   }
+
+   bool Monitor::NotifyReady(std::chrono::system_clock::time_point now)
+   {
+      std::vector<ActiveMonitor> monitorsToProcess;
+      {
+         std::scoped_lock lock(workLock_);
+         monitorsToProcess = TakeReadyMonitorsLocked(now);
+      }
+
+      if (monitorsToProcess.empty()) return false;
+
+      for (auto& monitor : monitorsToProcess)
+      {
+         NotifyMonitor(monitor, NotifyTarget::ALL);
+      }
+      return true;
+   }
+
+   std::vector<PendingMonitorInfo> Monitor::GetPending()
+   {
+      const auto now = std::chrono::system_clock::now();
+
+      std::scoped_lock lock(workLock_);
+      std::vector<PendingMonitorInfo> pending;
+      pending.reserve(activeMonitors_.size());
+      for (const auto& monitor : activeMonitors_)
+      {
+         pending.emplace_back(PendingMonitorInfo{
+            .scanName = std::string(monitor.scanName),
+            .priority = monitor.priority,
+            .groupPath = monitor.groupPath,
+            .pathCount = monitor.paths.size(),
+            .age = std::chrono::duration_cast<std::chrono::seconds>(now - monitor.firstTime),
+            .idle = std::chrono::duration_cast<std::chrono::seconds>(now - monitor.time),
+            .stormMode = monitor.stormMode,
+            .flush = monitor.flush,
+            .settled = monitor.settled,
+            .deferred = GetDeferredLocked(monitor)
+         });
+      }
+      return pending;
+   }
+
+   size_t Monitor::Flush(std::string_view scanName)
+   {
+      size_t flushed{0};
+      {
+         std::scoped_lock lock(workLock_);
+         for (auto& monitor : activeMonitors_)
+         {
+            if (!scanName.empty() && monitor.scanName != scanName) continue;
+
+            monitor.flush = true;
+            ++flushed;
+         }
+      }
+
+      workCv_.notify_one();
+      return flushed;
+   }
+
+   void Monitor::SetPaused(bool paused)
+   {
+      {
+         std::scoped_lock lock(workLock_);
+         paused_ = paused;
+      }
+
+      workCv_.notify_one();
+   }
+
+   bool Monitor::GetPaused()
+   {
+      std::scoped_lock lock(workLock_);
+      return paused_;
+   }
+
+   size_t Monitor::Drop(std::string_view scanName)
+   {
+      std::scoped_lock lock(workLock_);
+
+      size_t dropped{0};
+      std::erase_if(activeMonitors_, [&](const auto& monitor) {
+         if (monitor.scanName != scanName) return false;
+
+         dropped += monitor.paths.size();
+         return true;
+      });
+      return dropped;
+   }
+
+   std::map<std::string, NotifyServerStatistics> Monitor::GetNotifyStatistics()
+   {
+      return notify_ ? notify_->GetServerStatistics() : std::map<std::string, NotifyServerStatistics>();
+   }
+
+   std::optional<std::chrono::milliseconds> Monitor::GetNotifyLatency(size_t percent)
+   {
+      return notify_ ? notify_->GetLatencyPercentile(percent) : std::nullopt;
+   }
+
+   void Monitor::ExpandDirectories(ActiveMonitor& monitor)
+   {
+      // Removed directories were expanded when their event arrived. Modified directories are storm folders and keep their scan.
+      for (auto& path : monitor.paths)
+      {
+         if (!path.fileName.empty() || path.expandedFiles || path.effect == EffectType::DESTROY || path.effect == EffectType::MODIFY) continue;
+
+         path.expandedFiles = mediaIndex_.AddDirectory(path.path, MAX_EXPANDED_FILES);
+      }
+   }
+
+   void Monitor::NotifyMonitor(ActiveMonitor& monitor, NotifyTarget target)
+   {
+      // Only Emby updates the files of a directory
+      if (target != NotifyTarget::PLEX) ExpandDirectories(monitor);
+
+      warp::log::Trace("Throttle passed. Notifying for: {} {}", monitor.scanName, warp::GetTag("priority", std::string(GetPriorityName(monitor.priority))));
+      if (notifyFunc_)
+      {
+         notifyFunc_(monitor);
+      }
+      else
+      {
+         notify_->NotifyMediaServers(monitor, target);
+      }
+   }
+
+   std::vector<NotifyTarget> Monitor::GetNotifyTargets(const MonitorFilters& filters, std::string_view scanName) const
+   {
+      // A notify function receives the whole batch at once
+      auto settingsIter = filters.scanSettings.find(scanName);
+      if (notifyFunc_ || settingsIter == filters.scanSettings.end()) return {NotifyTarget::ALL};
+      return settingsIter->second.notifyTargets;
+   }
+
+   void Monitor::NotifyDone(std::string_view scanName)
+   {
+      {
+         std::scoped_lock lock(workLock_);
+         if (auto iter = busyScans_.find(scanName); iter != busyScans_.end()) busyScans_.erase(iter);
+      }
+
+      // Changes collected while the scan was notifying may be ready now
+      workCv_.notify_one();
    }
 
    void Monitor::Work(std::stop_token stopToken)
    {
       warp::log::Info("Process thread started");
 
-      const auto& config = configReader_->GetRemoteScanConfig();
-      const auto settleDelay = std::chrono::seconds(config.secondsBeforeNotify);
-      const auto globalDelay = std::chrono::seconds(config.secondsBetweenNotifies);
-
       while (!stopToken.stop_requested())
       {
-         std::optional<ActiveMonitor> monitorToProcess;
+         std::vector<ActiveMonitor> monitorsToProcess;
 
          {
             std::unique_lock lock(workLock_);
 
-            // If the queue is empty, wait indefinitely until data arrives or stop is requested.
-            if (activeMonitors_.empty())
+            // If nothing can be scheduled, wait indefinitely until data arrives, a worker finishes or stop is requested.
+            if (!GetNextWakeTimeLocked())
             {
                workCv_.wait(lock, stopToken, [this] {
-                  return !activeMonitors_.empty();
+                  return GetNextWakeTimeLocked().has_value();
                });
             }
 
             // Always check stopToken after waking up from a wait.
             if (stopToken.stop_requested()) break;
 
-            // Helper to calculate the earliest possible time we can process the oldest item.
-            auto getNextWakeTime = [&]() -> std::chrono::system_clock::time_point {
-               if (activeMonitors_.empty()) return std::chrono::system_clock::now();
-
-               auto oldest = std::ranges::min_element(activeMonitors_, {}, &ActiveMonitor::time);
-               auto readyAt = oldest->time + settleDelay;
-               auto throttleAt = lastNotifyTime_ + globalDelay;
-               return (readyAt > throttleAt) ? readyAt : throttleAt;
-            };
-
-            auto wakeTime = getNextWakeTime();
+            auto wakeTime = GetNextWakeTimeLocked();
             auto now = std::chrono::system_clock::now();
 
             // If the current time is before our calculated wake time, we must sleep.
-            if (now < wakeTime)
+            if (wakeTime && now < *wakeTime)
             {
-               workCv_.wait_until(lock, stopToken, wakeTime, [] { return false; });
-
-               if (stopToken.stop_requested()) break;
+               // Flushes and libraries finishing their scans can bring the wake time forward
+               workCv_.wait_until(lock, stopToken, *wakeTime, [this, &wakeTime] {
+                  auto nextWakeTime = GetNextWakeTimeLocked();
+                  return !nextWakeTime || *nextWakeTime < *wakeTime;
+               });
 
                // Re-evaluate conditions after waking up.
                // New items might have been added that pushed the 'wakeTime' further out.
-               now = std::chrono::system_clock::now();
-               if (activeMonitors_.empty() || now < getNextWakeTime())
-               {
-                  continue; // Back to the start of the while loop to re-calculate.
-               }
+               continue;
             }
 
             // If we are here, we have passed all throttle and settle checks.
-            auto oldestIter = std::ranges::min_element(activeMonitors_, {}, &ActiveMonitor::time);
-            if (oldestIter != activeMonitors_.end())
+            monitorsToProcess = TakeReadyMonitorsLocked(now);
+            for (const auto& monitor : monitorsToProcess)
             {
-               monitorToProcess = std::move(*oldestIter);
-               activeMonitors_.erase(oldestIter);
-               lastNotifyTime_ = std::chrono::system_clock::now();
+               busyScans_.emplace(monitor.scanName);
             }
-
          } // Lock is released here.
 
-         // Perform the actual notification outside of the lock.
-         if (monitorToProcess)
+         // The notifications run on the scan workers so a slow server does not hold up the other scans
+         if (monitorsToProcess.empty()) continue;
+
+         auto filters = GetFilters();
+         for (auto& monitor : monitorsToProcess)
          {
-            warp::log::Trace("Throttle passed. Notifying for: {}", monitorToProcess->scanName);
-            notify_.NotifyMediaServers(*monitorToProcess);
+            const auto targets = GetNotifyTargets(*filters, monitor.scanName);
+            notifyWorkers_.Add(std::move(monitor), targets);
          }
       }
 
       warp::log::Info("Work thread has exited");
    }
 
-   void Monitor::LogMonitorAdded(std::string_view scanName, const ActiveMonitorPath& monitor)
-   {
-      std::string effectType;
-      switch (monitor.effect)
-      {
-         case EffectType::RENAME: effectType = "Rename"; break;
-         case EffectType::CREATE: effectType = "Create"; break;
-         case EffectType::DESTROY: effectType = "Delete"; break;
-         default: effectType = "Modify"; break;
-      }
-      warp::log::Info("{} Scan moved to {} {} {}",
-                      warp::GetAnsiText("-->", ANSI_MONITOR_ADDED),
-                      warp::GetTag("monitor", scanName),
-                      warp::GetTag("effect", effectType),
-                      warp::GetTag("media", monitor.displayFullPath.generic_string()));
-   }
-
-   void Monitor::AddNewFileMonitor(const FileMonitorData& fileMonitor)
+   ActiveMonitorPath* Monitor::AddNewFileMonitor(FileMonitorData&& fileMonitor, const ScanSettings& settings, MonitorPriority priority, size_t groupLength, std::chrono::system_clock::time_point now)
    {
       // Brand new monitor entry
       auto& newMonitor = activeMonitors_.emplace_back();
-      newMonitor.scanName = fileMonitor.scanName;
-      newMonitor.time = std::chrono::system_clock::now();
-      newMonitor.lastPath = fileMonitor.path;
-
-      auto displayFolder = warp::GetDisplayFolder(fileMonitor.path);
-      auto displayFullPath = fileMonitor.filename.empty() ? std::move(displayFolder) : displayFolder / fileMonitor.filename;
+      newMonitor.scanName = settings.name;
+      newMonitor.priority = priority;
+      newMonitor.groupPath = GetGroupPath(fileMonitor.path, groupLength);
+      newMonitor.firstTime = now;
+      newMonitor.time = now;
+      newMonitor.lastPathIndex = 0;
 
       auto& newPath = newMonitor.paths.emplace_back(ActiveMonitorPath{
-         .path = fileMonitor.path,
-         .fileName = fileMonitor.filename,
+         .path = std::move(fileMonitor.path),
+         .fileName = std::move(fileMonitor.filename),
          .effect = fileMonitor.effect,
-         .displayFullPath = std::move(displayFullPath)
+         .time = now,
+         .expandedFiles = std::nullopt,
+         .movedFrom = std::move(fileMonitor.movedFrom)
       });
-      LogMonitorAdded(fileMonitor.scanName, newPath);
+      return &newPath;
    }
 
-   void Monitor::UpdateExistingFileMonitor(const FileMonitorData& fileMonitor, ActiveMonitor& activeMonitor)
+   ActiveMonitorPath* Monitor::UpdateExistingFileMonitor(FileMonitorData&& fileMonitor, ActiveMonitor& activeMonitor, std::chrono::system_clock::time_point now)
    {
-      auto now = std::chrono::system_clock::now();
       auto msSinceLastUpdate = std::chrono::duration_cast<std::chrono::milliseconds>(now - activeMonitor.time).count();
 
       activeMonitor.time = now;
 
-      if (fileMonitor.effect == EffectType::MODIFY && msSinceLastUpdate < 500 && fileMonitor.path == activeMonitor.lastPath)
+      // Repeated modifies of the same file only refresh its time
+      if (fileMonitor.effect == EffectType::MODIFY && msSinceLastUpdate < 500 && activeMonitor.lastPathIndex < activeMonitor.paths.size())
       {
-         return;
+         auto& lastPath = activeMonitor.paths[activeMonitor.lastPathIndex];
+         if (lastPath.path == fileMonitor.path && lastPath.fileName == fileMonitor.filename)
+         {
+            lastPath.time = now;
+            return nullptr;
+         }
       }
 
-      activeMonitor.lastPath = fileMonitor.path;
-
       auto pathIter = std::ranges::find_if(activeMonitor.paths, [&fileMonitor](const auto& monitorPath) {
          return monitorPath.path == fileMonitor.path && monitorPath.fileName == fileMonitor.filename;
       });
 
-      if (pathIter == activeMonitor.paths.end())
+      if (pathIter != activeMonitor.paths.end())
       {
-         auto displayFolder = warp::GetDisplayFolder(fileMonitor.path);
-         auto displayFullPath = fileMonitor.filename.empty() ? std::move(displayFolder) : displayFolder / fileMonitor.filename;
+         pathIter->time = now;
+         if (!fileMonitor.movedFrom.empty())
+         {
+            pathIter->effect = EffectType::RENAME;
+            pathIter->movedFrom = std::move(fileMonitor.movedFrom);
+         }
+         activeMonitor.lastPathIndex = static_cast<size_t>(pathIter - activeMonitor.paths.begin());
+         return nullptr;
+      }
+      else
+      {
+         activeMonitor.lastPathIndex = activeMonitor.paths.size();
 
          auto& newPath = activeMonitor.paths.emplace_back(ActiveMonitorPath{
-            .path = fileMonitor.path,
-            .fileName = fileMonitor.filename,
+            .path = std::move(fileMonitor.path),
+            .fileName = std::move(fileMonitor.filename),
             .effect = fileMonitor.effect,
-            .displayFullPath = std::move(displayFullPath)
+            .time = now,
+            .expandedFiles = std::nullopt,
+            .movedFrom = std::move(fileMonitor.movedFrom)
          });
-         LogMonitorAdded(fileMonitor.scanName, newPath);
+         return &newPath;
+      }
+   }
+
+   std::filesystem::path Monitor::GetTopFolder(const ScanSettings& settings, const std::filesystem::path& path)
+   {
+      for (const auto& root : settings.roots)
+      {
+         auto [rootEnd, pathIter] = std::mismatch(root.begin(), root.end(), path.begin(), path.end());
+         if (rootEnd != root.end()) continue;
+
+         // The folder directly below the scan path, for example the show or movie folder
+         if (pathIter == path.end() || pathIter->empty()) return root;
+         return root / *pathIter;
+      }
+      return path;
+   }
+
+   void Monitor::CheckStorm(const ScanSettings& settings, ActiveMonitor& activeMonitor, std::chrono::system_clock::time_point now)
+   {
+      if (now - activeMonitor.rateWindowStart >= std::chrono::seconds(1))
+      {
+         activeMonitor.rateWindowStart = now;
+         activeMonitor.rateWindowEvents = 0;
+      }
+      ++activeMonitor.rateWindowEvents;
+
+      auto createFolderPath = [](const std::filesystem::path& folder, std::chrono::system_clock::time_point time) {
+         return ActiveMonitorPath{
+            .path = folder,
+            .fileName = {},
+            .effect = EffectType::MODIFY,
+            .time = time,
+            .expandedFiles = std::nullopt,
+            .movedFrom = {}
+         };
+      };
+
+      if (activeMonitor.stormMode == StormMode::NONE)
+      {
+         const auto rateExceeded = settings.stormEventsPerSecond > 0 && activeMonitor.rateWindowEvents > settings.stormEventsPerSecond;
+         const auto sizeExceeded = settings.stormMaxPendingPaths > 0 && activeMonitor.paths.size() > settings.stormMaxPendingPaths;
+         if (!rateExceeded && !sizeExceeded) return;
+
+         // Only the top level folders are kept from now on so memory stays bounded and each folder gets one scan
+         std::vector<ActiveMonitorPath> folders;
+         auto addFolder = [&](const std::filesystem::path& changedPath, std::chrono::system_clock::time_point time) {
+            auto folder = GetTopFolder(settings, changedPath);
+            auto folderIter = std::ranges::find(folders, folder, &ActiveMonitorPath::path);
+            if (folderIter == folders.end())
+            {
+               folders.emplace_back(createFolderPath(folder, time));
+            }
+            else
+            {
+               folderIter->time = std::max(folderIter->time, time);
+            }
+         };
+
+         for (const auto& path : activeMonitor.paths)
+         {
+            addFolder(path.path, path.time);
+
+            // The folder a directory moved out of needs its scan as well
+            if (!path.movedFrom.empty()) addFolder(path.movedFrom, path.time);
+         }
+
+         warp::log::Warning("Event storm on scan {} {} ... Collapsed {} pending paths into {} folders",
+                            activeMonitor.scanName,
+                            warp::GetTag("events_per_second", std::to_string(activeMonitor.rateWindowEvents)),
+                            activeMonitor.paths.size(),
+                            folders.size());
+
+         activeMonitor.paths = std::move(folders);
+         activeMonitor.stormMode = StormMode::FOLDERS;
+         activeMonitor.lastPathIndex = activeMonitor.paths.size();
+      }
+
+      if (activeMonitor.stormMode == StormMode::FOLDERS && settings.stormMaxFolders > 0 && activeMonitor.paths.size() > settings.stormMaxFolders)
+      {
+         warp::log::Warning("Event storm on scan {} touched more than {} folders ... Scanning the scan paths as a whole",
+                            activeMonitor.scanName,
+                            settings.stormMaxFolders);
+
+         activeMonitor.paths.clear();
+         for (const auto& root : settings.roots)
+         {
+            activeMonitor.paths.emplace_back(createFolderPath(root, now));
+         }
+         activeMonitor.stormMode = StormMode::LIBRARY;
+         activeMonitor.lastPathIndex = activeMonitor.paths.size();
       }
    }
 
-   void Monitor::AddFileMonitor(const FileMonitorData& fileMonitor)
+   ActiveMonitorPath* Monitor::UpdateStormFileMonitor(const FileMonitorData& fileMonitor, const ScanSettings& settings, ActiveMonitor& activeMonitor, std::chrono::system_clock::time_point now)
    {
+      activeMonitor.time = now;
+
+      // Every scan path is already pending so only the times need to move
+      if (activeMonitor.stormMode == StormMode::LIBRARY)
+      {
+         for (auto& path : activeMonitor.paths)
+         {
+            path.time = now;
+         }
+         return nullptr;
+      }
+
+      // The folder a directory moved out of is scanned along with the one it moved into
+      if (!fileMonitor.movedFrom.empty())
+      {
+         auto oldFolder = GetTopFolder(settings, fileMonitor.movedFrom);
+         auto oldFolderIter = std::ranges::find(activeMonitor.paths, oldFolder, &ActiveMonitorPath::path);
+         if (oldFolderIter != activeMonitor.paths.end())
+         {
+            oldFolderIter->time = now;
+         }
+         else
+         {
+            activeMonitor.paths.emplace_back(ActiveMonitorPath{
+               .path = std::move(oldFolder),
+               .fileName = {},
+               .effect = EffectType::MODIFY,
+               .time = now,
+               .expandedFiles = std::nullopt,
+               .movedFrom = {}
+            });
+         }
+      }
+
+      auto folder = GetTopFolder(settings, fileMonitor.path);
+      auto folderIter = std::ranges::find(activeMonitor.paths, folder, &ActiveMonitorPath::path);
+      if (folderIter != activeMonitor.paths.end())
+      {
+         folderIter->time = now;
+         return nullptr;
+      }
+
+      auto& newPath = activeMonitor.paths.emplace_back(ActiveMonitorPath{
+         .path = folder,
+         .fileName = {},
+         .effect = EffectType::MODIFY,
+         .time = now,
+         .expandedFiles = std::nullopt,
+         .movedFrom = {}
+      });
+      return &newPath;
+   }
+
+   void Monitor::AddFileMonitor(const MonitorFilters& filters, const ScanSettings& settings, FileMonitorData&& fileMonitor, std::chrono::system_clock::time_point now, bool settled)
+   {
+      const auto priority = GetPriority(filters, fileMonitor);
+      const auto groupLength = GetGroupLength(settings, fileMonitor.path);
+
+      // A removed directory is expanded from the index before its files are forgotten
+      std::optional<std::vector<std::filesystem::path>> removedFiles;
+      if (fileMonitor.isDirectory)
+      {
+         if (fileMonitor.effect == EffectType::DESTROY) removedFiles = mediaIndex_.RemoveDirectory(fileMonitor.path, MAX_EXPANDED_FILES);
+         if (!fileMonitor.movedFrom.empty()) mediaIndex_.MoveDirectory(fileMonitor.movedFrom, fileMonitor.path);
+      }
+      else if (fileMonitor.effect == EffectType::DESTROY)
+      {
+         mediaIndex_.RemoveFile(fileMonitor.path, fileMonitor.filename);
+      }
+      else
+      {
+         mediaIndex_.AddFile(fileMonitor.path, fileMonitor.filename);
+      }
+
       std::unique_lock lock(workLock_);
 
-      auto monitorIter = std::ranges::find_if(activeMonitors_,
-          [&fileMonitor](const auto& monitor) { return monitor.scanName == fileMonitor.scanName; });
+      if (settled)
+      {
+         RemoveWatchedFileLocked(fileMonitor);
+         settledFiles_.emplace_back(SettledFile{
+            .file = fileMonitor.path / fileMonitor.filename,
+            .removed = fileMonitor.effect == EffectType::DESTROY,
+            .time = now
+         });
+      }
+      else if (!settledFiles_.empty() && GetSettledDuplicateLocked(fileMonitor, now))
+      {
+         return;
+      }
+
+      if (!pendingMoves_.empty() && UpdateCoveringMoveLocked(fileMonitor, now)) return;
+
+      // Kept so later events below the move can be matched to it
+      std::optional<PendingMove> move;
+      if (!fileMonitor.movedFrom.empty())
+      {
+         move = PendingMove{.scanName = settings.name, .oldPath = fileMonitor.movedFrom, .newPath = fileMonitor.path};
+      }
+
+      // Reported files keep to their own monitors so watch events never hold them back
+      auto monitorIter = std::ranges::find_if(activeMonitors_, [&](const auto& monitor) {
+         return monitor.scanName == settings.name
+                && monitor.priority == priority
+                && monitor.settled == settled
+                && GetInGroup(monitor.groupPath, fileMonitor.path, groupLength);
+      });
 
+      ActiveMonitorPath* addedPath{nullptr};
+      ActiveMonitor* activeMonitor{nullptr};
       if (monitorIter != activeMonitors_.end())
       {
-         UpdateExistingFileMonitor(fileMonitor, *monitorIter);
+         activeMonitor = &*monitorIter;
+         if (activeMonitor->stormMode != StormMode::NONE)
+         {
+            addedPath = UpdateStormFileMonitor(fileMonitor, settings, *activeMonitor, now);
+         }
+         else
+         {
+            addedPath = UpdateExistingFileMonitor(std::move(fileMonitor), *activeMonitor, now);
+         }
       }
       else
       {
-         AddNewFileMonitor(fileMonitor);
+         addedPath = AddNewFileMonitor(std::move(fileMonitor), settings, priority, groupLength, now);
+         activeMonitor = &activeMonitors_.back();
+         activeMonitor->settled = settled;
+      }
+
+      if (addedPath)
+      {
+         if (removedFiles && activeMonitor->stormMode == StormMode::NONE) addedPath->expandedFiles = std::move(removedFiles);
+
+         // Logged before a storm check can collapse the paths. The entry is copied into a ring slot
+         // that keeps its storage so logging does not allocate.
+         eventLog_.Add(EventLogType::ADDED, *activeMonitor, *addedPath);
       }
 
+      CheckStorm(settings, *activeMonitor, now);
+
+      // Storms keep folders only so there is no move left to match
+      if (move && activeMonitor->stormMode == StormMode::NONE) pendingMoves_.emplace_back(std::move(*move));
+
       lock.unlock();
       workCv_.notify_one();
    }
 
-   bool Monitor::GetScanPathValid(const std::filesystem::path& path) const
+   void Monitor::RemoveWatchedFileLocked(const FileMonitorData& fileMonitor)
+   {
+      // Storm folders cover more than the reported file so they are kept
+      std::erase_if(activeMonitors_, [&fileMonitor](auto& monitor) {
+         if (monitor.settled || monitor.scanName != fileMonitor.scanName || monitor.stormMode != StormMode::NONE) return false;
+
+         const auto removed = std::erase_if(monitor.paths, [&fileMonitor](const auto& path) {
+            return path.path == fileMonitor.path && path.fileName == fileMonitor.filename;
+         });
+         if (removed > 0) monitor.lastPathIndex = monitor.paths.size();
+         return monitor.paths.empty();
+      });
+   }
+
+   bool Monitor::GetSettledDuplicateLocked(const FileMonitorData& fileMonitor, std::chrono::system_clock::time_point now)
+   {
+      std::erase_if(settledFiles_, [now](const auto& settledFile) { return settledFile.time + SETTLED_DUPLICATE_WINDOW < now; });
+      if (fileMonitor.isDirectory) return false;
+
+      // A later removal of an imported file, or a new file where one was deleted, is a change of its own
+      const auto removed = fileMonitor.effect == EffectType::DESTROY;
+      return std::ranges::any_of(settledFiles_, [&fileMonitor, removed](const auto& settledFile) {
+         return settledFile.removed == removed
+                && settledFile.file.filename() == fileMonitor.filename
+                && settledFile.file.parent_path() == fileMonitor.path;
+      });
+   }
+
+   std::pair<ActiveMonitor*, ActiveMonitorPath*> Monitor::FindMoveLocked(const PendingMove& move)
+   {
+      for (auto& monitor : activeMonitors_)
+      {
+         if (monitor.scanName != move.scanName) continue;
+
+         auto pathIter = std::ranges::find_if(monitor.paths, [&move](const auto& path) {
+            return path.fileName.empty() && path.path == move.newPath && path.movedFrom == move.oldPath;
+         });
+         if (pathIter != monitor.paths.end()) return {&monitor, &*pathIter};
+      }
+      return {nullptr, nullptr};
+   }
+
+   bool Monitor::UpdateCoveringMoveLocked(const FileMonitorData& fileMonitor, std::chrono::system_clock::time_point now)
+   {
+      const auto eventPath = fileMonitor.isDirectory ? fileMonitor.path : fileMonitor.path / fileMonitor.filename;
+      for (size_t i = 0; i < pendingMoves_.size(); ++i)
+      {
+         const auto& move = pendingMoves_[i];
+         if (move.scanName != fileMonitor.scanName) continue;
+
+         // Anything at the old location and files appearing below the new one are already part of the move.
+         // Removals below the new location happened after the move and are notified on their own.
+         const auto belowNewPath = fileMonitor.effect != EffectType::DESTROY && eventPath != move.newPath && IsWithin(eventPath, move.newPath);
+         if (!belowNewPath && !IsWithin(eventPath, move.oldPath)) continue;
+
+         auto [monitor, movePath] = FindMoveLocked(move);
+         if (!monitor)
+         {
+            pendingMoves_.erase(pendingMoves_.begin() + static_cast<std::ptrdiff_t>(i));
+            return false;
+         }
+
+         // Files still arriving below the move hold it back the same as changes to its own path
+         monitor->time = now;
+         movePath->time = now;
+         return true;
+      }
+      return false;
+   }
+
+   std::shared_ptr<const MonitorFilters> Monitor::GetFilters() const
+   {
+      std::scoped_lock lock(filtersLock_);
+      return filters_;
+   }
+
+   bool Monitor::GetScanPathValid(const MonitorFilters& filters, const std::filesystem::path& path)
    {
-      return !std::ranges::any_of(ignoreFolders_, [&path](const auto& ignore) {
+      return !std::ranges::any_of(filters.ignoreFolders, [&path](const auto& ignore) {
          return std::ranges::any_of(path, [&ignore](const auto& part) {
             return part == ignore;
          });
       });
    }
 
-   bool Monitor::GetFileImage(const std::filesystem::path& filename) const
+   bool Monitor::GetFileImage(const MonitorFilters& filters, const std::filesystem::path& filename)
+   {
+      ExtensionBuffer buffer;
+      auto lowerExt = GetLowerExtension(filename, buffer);
+      return !lowerExt.empty() && filters.validImageExtensions.contains(lowerExt);
+   }
+
+   bool Monitor::GetFileMetadata(const MonitorFilters& filters, const std::filesystem::path& filename)
+   {
+      ExtensionBuffer buffer;
+      auto lowerExt = GetLowerExtension(filename, buffer);
+      return !lowerExt.empty() && (filters.validImageExtensions.contains(lowerExt) || filters.metadataExtensions.contains(lowerExt));
+   }
+
+   bool Monitor::GetFileMetadata(const std::filesystem::path& filename) const
+   {
+      return GetFileMetadata(*GetFilters(), filename);
+   }
+
+   bool Monitor::GetFileMedia(const std::filesystem::path& filename) const
+   {
+      auto filters = GetFilters();
+      return GetFileExtensionValid(*filters, filename) && !GetFileMetadata(*filters, filename);
+   }
+
+   bool Monitor::GetFileExtensionValid(const MonitorFilters& filters, const std::filesystem::path& filename)
+   {
+      if (filters.validExtensions.empty()) return true;
+
+      ExtensionBuffer buffer;
+      auto lowerExt = GetLowerExtension(filename, buffer);
+      return !lowerExt.empty() && filters.validExtensions.contains(lowerExt);
+   }
+
+   MonitorPriority Monitor::GetPriority(const MonitorFilters& filters, const FileMonitorData& fileMonitor)
+   {
+      if (fileMonitor.effect == EffectType::DESTROY) return MonitorPriority::DELETION;
+      if (fileMonitor.isDirectory) return MonitorPriority::MEDIA;
+
+      return GetFileMetadata(filters, fileMonitor.filename) ? MonitorPriority::METADATA : MonitorPriority::MEDIA;
+   }
+
+   size_t Monitor::GetGroupLength(const ScanSettings& settings, const std::filesystem::path& path)
    {
-      auto ext = filename.extension();
-      if (ext.empty()) return false;
+      if (settings.groupDepth == 0) return 0;
 
-      std::string lowerExt = warp::ToLower(ext.string());
-      return validImageExtensions_.contains(lowerExt);
+      // The group is the base path plus the first folders below it, for example the show or movie folder
+      auto [baseEnd, pathIter] = std::mismatch(settings.basePath.begin(), settings.basePath.end(), path.begin(), path.end());
+      if (baseEnd != settings.basePath.end()) return 0;
+
+      auto length = static_cast<size_t>(std::distance(settings.basePath.begin(), settings.basePath.end()));
+      for (size_t depth = 0; depth < settings.groupDepth && pathIter != path.end(); ++depth, ++pathIter)
+      {
+         if (pathIter->empty()) break;
+         ++length;
+      }
+      return length;
    }
 
-   bool Monitor::GetFileExtensionValid(const std::filesystem::path& filename) const
+   bool Monitor::GetInGroup(const std::filesystem::path& groupPath, const std::filesystem::path& path, size_t groupLength)
    {
-      if (validExtensions_.empty()) return true;
+      size_t length{0};
+      auto pathIter = path.begin();
+      for (const auto& part : groupPath)
+      {
+         if (pathIter == path.end() || pathIter->native() != part.native()) return false;
+         ++pathIter;
+         ++length;
+      }
+      return length == groupLength;
+   }
 
-      auto ext = filename.extension();
-      if (ext.empty()) return false;
+   std::filesystem::path Monitor::GetGroupPath(const std::filesystem::path& path, size_t groupLength)
+   {
+      std::filesystem::path groupPath;
+      auto pathIter = path.begin();
+      for (size_t length = 0; length < groupLength && pathIter != path.end(); ++length, ++pathIter)
+      {
+         groupPath /= *pathIter;
+      }
+      return groupPath;
+   }
 
-      std::string lowerExt = warp::ToLower(ext.string());
-      return validExtensions_.contains(lowerExt);
+   void Monitor::Process(FileMonitorData fileMonitor)
+   {
+      Process(std::move(fileMonitor), std::chrono::system_clock::now());
    }
 
-   void Monitor::Process(const FileMonitorData& fileMonitor)
+   void Monitor::Process(FileMonitorData fileMonitor, std::chrono::system_clock::time_point now)
    {
+      auto filters = GetFilters();
+
+      // Forwarded changes may name a scan this instance does not have
+      auto settingsIter = filters->scanSettings.find(fileMonitor.scanName);
+      if (settingsIter == filters->scanSettings.end()) return;
+
+      // A move out of an ignored folder is a new directory and a move into one removes the directory
+      if (!fileMonitor.movedFrom.empty() && !GetScanPathValid(*filters, fileMonitor.movedFrom))
+      {
+         fileMonitor.effect = EffectType::CREATE;
+         fileMonitor.movedFrom.clear();
+      }
+      else if (!fileMonitor.movedFrom.empty() && !GetScanPathValid(*filters, fileMonitor.path))
+      {
+         fileMonitor.effect = EffectType::DESTROY;
+         fileMonitor.path = std::move(fileMonitor.movedFrom);
+         fileMonitor.movedFrom.clear();
+      }
+
       // Is the scan path valid and this is a destroy or the file being added has a valid extension
-      if (GetScanPathValid(fileMonitor.path)
+      if (GetScanPathValid(*filters, fileMonitor.path)
           && (fileMonitor.isDirectory
-              || GetFileExtensionValid(fileMonitor.filename)
-              || GetFileImage(fileMonitor.filename)))
+              || GetFileExtensionValid(*filters, fileMonitor.filename)
+              || GetFileImage(*filters, fileMonitor.filename)))
+      {
+         AddFileMonitor(*filters, settingsIter->second, std::move(fileMonitor), now, false);
+      }
+   }
+
+   std::vector<std::string> Monitor::ProcessSettled(const std::filesystem::path& file, EffectType effect)
+   {
+      const auto now = std::chrono::system_clock::now();
+      const auto normalFile = NormalizePath(file);
+      auto filters = GetFilters();
+
+      std::vector<std::string> scans;
+      if (!GetScanPathValid(*filters, normalFile.parent_path())
+          || !(GetFileExtensionValid(*filters, normalFile.filename()) || GetFileImage(*filters, normalFile.filename())))
       {
-         AddFileMonitor(fileMonitor);
+         return scans;
+      }
+
+      // Every scan watching the file gets it the same as a watch event
+      for (const auto& [scanName, settings] : filters->scanSettings)
+      {
+         if (!std::ranges::any_of(settings.roots, [&normalFile](const auto& root) { return IsWithin(normalFile, root); })) continue;
+
+         scans.emplace_back(scanName);
+         AddFileMonitor(*filters,
+                        settings,
+                        FileMonitorData{
+                           .scanName = settings.name,
+                           .path = normalFile.parent_path(),
+                           .filename = normalFile.filename(),
+                           .isDirectory = false,
+                           .effect = effect,
+                           .movedFrom = {}
+                        },
+                        now,
+                        true);
       }
+      return scans;
    }
 }
\ No newline at end of file
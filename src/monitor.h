@@ -1,16 +1,27 @@
 #pragma once
 
 #include "config-reader/config-reader-types.h"
+#include "event-log.h"
+#include "media-index.h"
 #include "notify.h"
+#include "notify-workers.h"
+#include "server-activity.h"
 #include "types.h"
 
 #include <warp/log/log-types.h>
 #include <warp/types.h>
 
+#include <array>
 #include <chrono>
 #include <condition_variable>
+#include <cstdint>
 #include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <set>
 #include <string>
 #include <string_view>
 #include <thread>
@@ -21,48 +32,246 @@ namespace remote_scan
 {
    class ConfigReader;
 
+   // Per scan settings for grouping pending paths and for event storms
+   struct ScanSettings
+   {
+      // Interned with InternScanName so monitors and log entries share it
+      std::string_view name;
+      std::filesystem::path basePath;
+      size_t groupDepth{0};
+
+      // The configured scan paths. Storms collapse pending paths to the folders directly below these.
+      std::vector<std::filesystem::path> roots;
+      size_t stormEventsPerSecond{0};
+      size_t stormMaxPendingPaths{0};
+      size_t stormMaxFolders{0};
+
+      // Server and library pairs the scan notifies. Settled scans sharing one are notified together.
+      std::vector<std::string> libraryTargets;
+
+      // Server types notified by workers of their own
+      std::vector<NotifyTarget> notifyTargets;
+   };
+
+   // Transparent hash so extensions are looked up from a view without building a string
+   struct ExtensionHash
+   {
+      using is_transparent = void;
+
+      [[nodiscard]] size_t operator()(std::string_view value) const
+      {
+         return std::hash<std::string_view>{}(value);
+      }
+   };
+
+   using ExtensionSet = std::unordered_set<std::string, ExtensionHash, std::equal_to<>>;
+
+   // Path and extension filters built from the configuration. Replaced as a whole when the configuration is reloaded.
+   struct MonitorFilters
+   {
+      std::map<std::string, ScanSettings, std::less<>> scanSettings;
+      std::vector<std::filesystem::path> ignoreFolders;
+      ExtensionSet validImageExtensions;
+      ExtensionSet validExtensions;
+      ExtensionSet metadataExtensions;
+   };
+
+   // Summary of a pending monitor reported by the control socket
+   struct PendingMonitorInfo
+   {
+      std::string scanName;
+      MonitorPriority priority{MonitorPriority::MEDIA};
+      std::filesystem::path groupPath;
+      size_t pathCount{0};
+
+      // Time since the first and since the last change
+      std::chrono::seconds age{0};
+      std::chrono::seconds idle{0};
+      StormMode stormMode{StormMode::NONE};
+      bool flush{false};
+
+      // Reported by a download manager webhook
+      bool settled{false};
+
+      // Held back because a library it notifies is being scanned by its server
+      bool deferred{false};
+   };
+
    class Monitor
    {
    public:
+      using NotifyFunc = std::function<void(const ActiveMonitor& monitor)>;
+
       explicit Monitor(std::shared_ptr<ConfigReader> configReader);
+
+      // Replaces the media server notifications with the supplied function. Used by the replay tool.
+      Monitor(std::shared_ptr<ConfigReader> configReader, NotifyFunc notifyFunc);
       virtual ~Monitor() = default;
 
       Monitor(const Monitor&) = delete;
       Monitor& operator=(const Monitor&) = delete;
 
+      // Connects to the media servers. Events are collected before this so watches can start first
+      // but nothing may be notified until it returns. Does nothing when notifying through a function.
+      void Connect();
+
       void GetTasks(std::vector<warp::Task>& tasks);
 
       void Run();
       void Shutdown();
 
-      void Process(const FileMonitorData& fileMonitor);
+      // Swaps in a reloaded configuration. Pending monitors are kept unless their scan was removed.
+      void UpdateConfig(std::shared_ptr<ConfigReader> configReader);
+
+      // Events are taken by value so the paths of an accepted event move into the pending path without a copy
+      void Process(FileMonitorData fileMonitor);
+      void Process(FileMonitorData fileMonitor, std::chrono::system_clock::time_point now);
+
+      // Adds a file a download manager reported as imported, renamed or deleted. It is notified as soon as the
+      // throttle allows and events from the watches for the same file are dropped. Returns the scans covering the file.
+      std::vector<std::string> ProcessSettled(const std::filesystem::path& file, EffectType effect);
+
+      // Earliest time a pending monitor can be notified or nullopt if nothing is pending
+      [[nodiscard]] std::optional<std::chrono::system_clock::time_point> GetNextWakeTime();
+
+      // Notifies the next monitor if it is ready at the supplied time. Returns true if a monitor was notified.
+      bool NotifyReady(std::chrono::system_clock::time_point now);
+
+      [[nodiscard]] std::vector<PendingMonitorInfo> GetPending();
+
+      // Notifies the pending changes of a scan, or of every scan when the name is empty, without waiting
+      // for them to settle. Flushed scans are notified even while paused. Returns the number of monitors flushed.
+      size_t Flush(std::string_view scanName);
+
+      // Changes keep collecting while paused and are notified once resumed
+      void SetPaused(bool paused);
+      [[nodiscard]] bool GetPaused();
+
+      // Discards the pending changes of a scan. Returns the number of paths dropped.
+      size_t Drop(std::string_view scanName);
+
+      // Request counts of the media server notifications. Empty when notifying through a function or before Connect.
+      [[nodiscard]] std::map<std::string, NotifyServerStatistics> GetNotifyStatistics();
+
+      // Event to notify latency at the percentile over the recent notifies. nullopt under the same conditions or before the first notify.
+      [[nodiscard]] std::optional<std::chrono::milliseconds> GetNotifyLatency(size_t percent);
 
    private:
       void Work(std::stop_token stopToken);
 
-      [[nodiscard]] bool GetScanPathValid(const std::filesystem::path& path) const;
-      [[nodiscard]] bool GetFileImage(const std::filesystem::path& filename) const;
-      [[nodiscard]] bool GetFileExtensionValid(const std::filesystem::path& filename) const;
+      // Settle and throttle budgets of one priority class
+      struct PriorityTiming
+      {
+         std::chrono::seconds settleDelay{0};
+         std::chrono::seconds throttleDelay{0};
+      };
+
+      void SetTimingsLocked(const RemoteScanConfig& config);
+      [[nodiscard]] std::chrono::system_clock::time_point GetReadyTimeLocked(const ActiveMonitor& monitor) const;
+      [[nodiscard]] bool GetSettledLocked(const ActiveMonitor& monitor, std::chrono::system_clock::time_point now) const;
+      [[nodiscard]] bool GetDeferredLocked(const ActiveMonitor& monitor) const;
+      [[nodiscard]] ActiveMonitor TakeStablePathsLocked(ActiveMonitor& monitor, std::chrono::system_clock::time_point now) const;
+      [[nodiscard]] int64_t GetEffectiveRankLocked(const ActiveMonitor& monitor, std::chrono::system_clock::time_point now) const;
+      [[nodiscard]] std::optional<std::chrono::system_clock::time_point> GetNextWakeTimeLocked() const;
+      // The first monitor is the one that became ready followed by settled monitors of scans sharing a library with it
+      [[nodiscard]] std::vector<ActiveMonitor> TakeReadyMonitorsLocked(std::chrono::system_clock::time_point now);
+      void ExpandDirectories(ActiveMonitor& monitor);
+      void NotifyMonitor(ActiveMonitor& monitor, NotifyTarget target);
+      void NotifyDone(std::string_view scanName);
+      [[nodiscard]] std::vector<NotifyTarget> GetNotifyTargets(const MonitorFilters& filters, std::string_view scanName) const;
+
+      [[nodiscard]] std::shared_ptr<const MonitorFilters> GetFilters() const;
+
+      [[nodiscard]] static bool GetScanPathValid(const MonitorFilters& filters, const std::filesystem::path& path);
+      [[nodiscard]] static bool GetFileImage(const MonitorFilters& filters, const std::filesystem::path& filename);
+      [[nodiscard]] static bool GetFileExtensionValid(const MonitorFilters& filters, const std::filesystem::path& filename);
+      [[nodiscard]] static bool GetFileMetadata(const MonitorFilters& filters, const std::filesystem::path& filename);
+      [[nodiscard]] bool GetFileMetadata(const std::filesystem::path& filename) const;
+      [[nodiscard]] bool GetFileMedia(const std::filesystem::path& filename) const;
+      [[nodiscard]] static MonitorPriority GetPriority(const MonitorFilters& filters, const FileMonitorData& fileMonitor);
+      [[nodiscard]] static std::filesystem::path GetTopFolder(const ScanSettings& settings, const std::filesystem::path& path);
+
+      // Events are matched to the group of a pending monitor by the leading components of their path
+      // so a group path is only built when a new monitor needs one. The length is zero when the scan is not grouped.
+      [[nodiscard]] static size_t GetGroupLength(const ScanSettings& settings, const std::filesystem::path& path);
+      [[nodiscard]] static bool GetInGroup(const std::filesystem::path& groupPath, const std::filesystem::path& path, size_t groupLength);
+      [[nodiscard]] static std::filesystem::path GetGroupPath(const std::filesystem::path& path, size_t groupLength);
+
+      // All return the newly added path or nullptr. It is logged while the work lock is still held.
+      [[nodiscard]] ActiveMonitorPath* AddNewFileMonitor(FileMonitorData&& fileMonitor, const ScanSettings& settings, MonitorPriority priority, size_t groupLength, std::chrono::system_clock::time_point now);
+      [[nodiscard]] ActiveMonitorPath* UpdateExistingFileMonitor(FileMonitorData&& fileMonitor, ActiveMonitor& activeMonitor, std::chrono::system_clock::time_point now);
+      [[nodiscard]] ActiveMonitorPath* UpdateStormFileMonitor(const FileMonitorData& fileMonitor, const ScanSettings& settings, ActiveMonitor& activeMonitor, std::chrono::system_clock::time_point now);
+      void CheckStorm(const ScanSettings& settings, ActiveMonitor& activeMonitor, std::chrono::system_clock::time_point now);
+      void AddFileMonitor(const MonitorFilters& filters, const ScanSettings& settings, FileMonitorData&& fileMonitor, std::chrono::system_clock::time_point now, bool settled);
 
-      void LogMonitorAdded(std::string_view scanName,
-                           const ActiveMonitorPath& monitor);
+      // A file reported by a download manager. Watch events repeating it are dropped for a while.
+      struct SettledFile
+      {
+         std::filesystem::path file;
+         bool removed{false};
+         std::chrono::system_clock::time_point time;
+      };
 
-      void AddNewFileMonitor(const FileMonitorData& fileMonitor);
-      void UpdateExistingFileMonitor(const FileMonitorData& fileMonitor, ActiveMonitor& activeMonitor);
-      void AddFileMonitor(const FileMonitorData& fileMonitor);
+      // Drops pending watch events for a file reported settled
+      void RemoveWatchedFileLocked(const FileMonitorData& fileMonitor);
+      [[nodiscard]] bool GetSettledDuplicateLocked(const FileMonitorData& fileMonitor, std::chrono::system_clock::time_point now);
+
+      // A directory move waiting to be notified. Later events below it are part of the move.
+      struct PendingMove
+      {
+         std::string_view scanName;
+         std::filesystem::path oldPath;
+         std::filesystem::path newPath;
+      };
+
+      [[nodiscard]] std::pair<ActiveMonitor*, ActiveMonitorPath*> FindMoveLocked(const PendingMove& move);
+
+      // Refreshes the move covering the event and returns true if the event needs no path of its own
+      [[nodiscard]] bool UpdateCoveringMoveLocked(const FileMonitorData& fileMonitor, std::chrono::system_clock::time_point now);
 
       std::shared_ptr<ConfigReader> configReader_;
-      Notify notify_;
 
-      std::vector<std::filesystem::path> ignoreFolders_;
-      std::unordered_set<std::string> validImageExtensions_;
-      std::unordered_set<std::string> validExtensions_;
+      // Declared before the notifier which writes to it
+      EventLog eventLog_;
+      std::unique_ptr<Notify> notify_;
+      NotifyFunc notifyFunc_;
+
+      // The global delay spaces out all notifications, the priority class delays apply on top of it
+      std::chrono::seconds globalDelay_{0};
+      std::chrono::seconds priorityAging_{0};
+
+      // Monitors still receiving changes after this long notify the paths that have settled
+      std::chrono::seconds maxPending_{0};
+
+      // Longest extra time a monitor waits for a busy library to finish scanning
+      std::chrono::seconds maxDeferred_{0};
+      std::array<PriorityTiming, MONITOR_PRIORITY_COUNT> priorityTimings_;
+
+      mutable std::mutex filtersLock_;
+      std::shared_ptr<const MonitorFilters> filters_;
+
+      // Media files below the scans with Emby libraries. Declared after the filters its media check reads.
+      MediaIndex mediaIndex_;
 
       // Synchronization
       std::mutex workLock_;
       std::condition_variable_any workCv_;
       std::vector<ActiveMonitor> activeMonitors_;
-      std::chrono::system_clock::time_point lastNotifyTime_{std::chrono::system_clock::now() - std::chrono::hours(24)};
+      std::vector<PendingMove> pendingMoves_;
+      std::vector<SettledFile> settledFiles_;
+      std::chrono::system_clock::time_point lastNotifyTime_{std::chrono::system_clock::time_point::min()};
+      std::array<std::chrono::system_clock::time_point, MONITOR_PRIORITY_COUNT> lastPriorityNotifyTimes_;
+
+      bool paused_{false};
+
+      // Scans whose workers are all still notifying. Their monitors keep collecting changes until one is done.
+      std::set<std::string, std::less<>> busyScans_;
+
+      // Library scans running on the media servers. Only created when notifying real servers.
+      std::unique_ptr<ServerActivity> serverActivity_;
+
+      // Declared before the work thread that hands batches to it so the thread is stopped first
+      NotifyWorkers notifyWorkers_;
       std::jthread workThread_;
    };
 }
\ No newline at end of file
@@ -0,0 +1,131 @@
+﻿#include "notify-workers.h"
+
+#include <warp/log/log.h>
+#include <warp/log/log-utils.h>
+
+#include <utility>
+
+namespace remote_scan
+{
+   NotifyWorkers::NotifyWorkers(NotifyFunc notifyFunc, DoneFunc doneFunc)
+      : notifyFunc_(std::move(notifyFunc))
+      , doneFunc_(std::move(doneFunc))
+   {
+   }
+
+   NotifyWorkers::~NotifyWorkers()
+   {
+      Shutdown();
+   }
+
+   void NotifyWorkers::Add(ActiveMonitor monitor, const std::vector<NotifyTarget>& targets)
+   {
+      std::scoped_lock lock(workersLock_);
+      if (shutdown_) return;
+
+      for (size_t i = 0; i < targets.size(); ++i)
+      {
+         auto [workerIter, added] = workers_.try_emplace(std::make_pair(monitor.scanName, targets[i]));
+         if (added)
+         {
+            auto& worker = *(workerIter->second = std::make_unique<Worker>());
+            worker.target = targets[i];
+            worker.thread = std::jthread([this, &worker](std::stop_token stopToken) {
+               this->Work(worker, stopToken);
+            });
+            warp::log::Trace("Started notify worker for {} {}", monitor.scanName, warp::GetTag("target", std::string(GetNotifyTargetName(targets[i]))));
+         }
+
+         // The last target takes the monitor itself so a single target does not copy it
+         auto batch = (i + 1 < targets.size()) ? monitor : std::move(monitor);
+
+         auto& worker = *workerIter->second;
+         {
+            std::scoped_lock queueLock(worker.queueLock);
+            if (worker.queue.empty())
+            {
+               worker.queue.emplace_back(std::move(batch));
+            }
+            else
+            {
+               MergeMonitor(worker.queue.back(), batch);
+            }
+         }
+         worker.queueCv.notify_one();
+      }
+   }
+
+   void NotifyWorkers::Remove(const KeepFunc& keepFunc)
+   {
+      std::vector<std::unique_ptr<Worker>> removed;
+      {
+         std::scoped_lock lock(workersLock_);
+         for (auto iter = workers_.begin(); iter != workers_.end();)
+         {
+            const auto& [scanName, target] = iter->first;
+            if (keepFunc(scanName, target))
+            {
+               ++iter;
+               continue;
+            }
+
+            warp::log::Trace("Stopped notify worker for {} {}", scanName, warp::GetTag("target", std::string(GetNotifyTargetName(target))));
+            removed.emplace_back(std::move(iter->second));
+            iter = workers_.erase(iter);
+         }
+      }
+
+      // A notify already being sent is finished outside the lock so the other scans can keep queueing
+      for (auto& worker : removed)
+      {
+         {
+            std::scoped_lock queueLock(worker->queueLock);
+            worker->queue.clear();
+         }
+         worker->thread.request_stop();
+      }
+
+      for (auto& worker : removed)
+      {
+         if (worker->thread.joinable()) worker->thread.join();
+      }
+   }
+
+   void NotifyWorkers::Shutdown()
+   {
+      std::scoped_lock lock(workersLock_);
+      shutdown_ = true;
+
+      // Stop every worker first so slow servers are waited on together instead of one after another
+      for (auto& [scanName, worker] : workers_)
+      {
+         worker->thread.request_stop();
+      }
+
+      for (auto& [scanName, worker] : workers_)
+      {
+         if (worker->thread.joinable()) worker->thread.join();
+      }
+   }
+
+   void NotifyWorkers::Work(Worker& worker, std::stop_token stopToken)
+   {
+      while (true)
+      {
+         ActiveMonitor monitor;
+         {
+            std::unique_lock lock(worker.queueLock);
+            worker.queueCv.wait(lock, stopToken, [&worker] { return !worker.queue.empty(); });
+
+            // Notifies released before the stop are still sent
+            if (worker.queue.empty()) break;
+
+            monitor = std::move(worker.queue.front());
+            worker.queue.pop_front();
+         }
+
+         notifyFunc_(monitor, worker.target);
+         doneFunc_(monitor.scanName);
+      }
+   }
+}
\ No newline at end of file
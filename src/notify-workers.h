@@ -0,0 +1,66 @@
+#pragma once
+
+#include "types.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace remote_scan
+{
+   // Runs the media server notifies of each scan and target on a thread of its own so a slow or unreachable
+   // server only holds back the scans and server type notifying it. The monitor decides when a batch is released
+   // and is told through the done function each time one of the scan's workers finishes a batch.
+   class NotifyWorkers
+   {
+   public:
+      using NotifyFunc = std::function<void(ActiveMonitor& monitor, NotifyTarget target)>;
+      using DoneFunc = std::function<void(std::string_view scanName)>;
+      using KeepFunc = std::function<bool(std::string_view scanName, NotifyTarget target)>;
+
+      NotifyWorkers(NotifyFunc notifyFunc, DoneFunc doneFunc);
+      virtual ~NotifyWorkers();
+
+      NotifyWorkers(const NotifyWorkers&) = delete;
+      NotifyWorkers& operator=(const NotifyWorkers&) = delete;
+
+      // Queues the monitor on the worker of its scan for each target. Workers are started on first use.
+      // A worker still sending an earlier batch merges the new one into the batch it has waiting so a slow
+      // server gets one request for everything released while it was busy.
+      void Add(ActiveMonitor monitor, const std::vector<NotifyTarget>& targets);
+
+      // Stops the workers of scans and targets no longer configured. Batches they have waiting are dropped.
+      void Remove(const KeepFunc& keepFunc);
+
+      // Finishes the notifies already queued and stops every worker
+      void Shutdown();
+
+   private:
+      struct Worker
+      {
+         NotifyTarget target{NotifyTarget::ALL};
+         std::mutex queueLock;
+         std::condition_variable_any queueCv;
+         std::deque<ActiveMonitor> queue;
+         std::jthread thread;
+      };
+
+      void Work(Worker& worker, std::stop_token stopToken);
+
+      NotifyFunc notifyFunc_;
+      DoneFunc doneFunc_;
+
+      std::mutex workersLock_;
+      // Keyed by the interned scan names of the monitors and the target
+      std::map<std::pair<std::string_view, NotifyTarget>, std::unique_ptr<Worker>> workers_;
+      bool shutdown_{false};
+   };
+}
\ No newline at end of file
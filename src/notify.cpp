@@ -10,18 +10,48 @@
 
 #include <algorithm>
 #include <cctype>
+#include <format>
 #include <ranges>
+#include <set>
 
 namespace remote_scan
 {
+   namespace
+   {
+      // Number of recent event to notify latencies kept for the percentile statistics
+      constexpr size_t MAX_LATENCY_SAMPLES{1024};
+
+      // How long notified paths are remembered. Overlapping scans settle well within this of each other.
+      constexpr auto RECENT_NOTIFY_RETENTION{std::chrono::minutes(10)};
+
+      // Samples must be sorted and not empty
+      std::chrono::milliseconds GetPercentile(const std::vector<std::chrono::milliseconds>& samples, size_t percent)
+      {
+         return samples[(samples.size() - 1) * percent / 100];
+      }
+
+      bool GetMovedAway(const ActiveMonitorPath& path, const std::filesystem::path& target)
+      {
+         if (path.movedFrom.empty()) return false;
+
+         auto [oldEnd, targetIter] = std::mismatch(path.movedFrom.begin(), path.movedFrom.end(), target.begin(), target.end());
+         return oldEnd == path.movedFrom.end();
+      }
+   }
+
    Notify::Notify(std::shared_ptr<ConfigReader> configReader,
-                  std::function<bool(const std::filesystem::path)> getImageFunc)
+                  EventLog& eventLog,
+                  FileCheckFunc getMetadataFunc,
+                  FileCheckFunc getMediaFunc)
       : configReader_(configReader)
-      , getImageFunc_(std::move(getImageFunc))
+      , eventLog_(eventLog)
+      , getMetadataFunc_(std::move(getMetadataFunc))
+      , getMediaFunc_(std::move(getMediaFunc))
    {
       warp::ApiManagerConfig apiManagerConfig;
       for (const auto& plexServer : configReader_->GetPlexServers())
       {
+         serverRequests_[std::format("{}({})", warp::GetFormattedPlex(), plexServer.name)].limit = static_cast<size_t>(std::max(plexServer.maxConcurrentRequests, 0));
          apiManagerConfig.plexConfig.servers.emplace_back(warp::ServerConfig{
             .serverName = plexServer.name,
             .url = plexServer.url,
@@ -33,6 +63,7 @@ namespace remote_scan
 
       for (const auto& embyServer : configReader_->GetEmbyServers())
       {
+         serverRequests_[std::format("{}({})", warp::GetFormattedEmby(), embyServer.name)].limit = static_cast<size_t>(std::max(embyServer.maxConcurrentRequests, 0));
          apiManagerConfig.embyConfig.servers.emplace_back(warp::ServerConfig{
             .serverName = embyServer.name,
             .url = embyServer.url,
@@ -45,13 +76,174 @@ namespace remote_scan
       apiManager_ = std::make_unique<warp::ApiManager>(REMOTE_SCAN_NAME, REMOTE_SCAN_VERSION, apiManagerConfig);
    }
 
+   void Notify::UpdateConfig(std::shared_ptr<ConfigReader> configReader)
+   {
+      std::scoped_lock lock(configLock_);
+      if (configReader->GetPlexServers() != configReader_->GetPlexServers()
+          || configReader->GetEmbyServers() != configReader_->GetEmbyServers())
+      {
+         warp::log::Warning("Media server changes in the configuration require a restart to take effect");
+      }
+
+      configReader_ = configReader;
+   }
+
+   std::shared_ptr<ConfigReader> Notify::GetConfigReader()
+   {
+      std::scoped_lock lock(configLock_);
+      return configReader_;
+   }
+
    void Notify::GetTasks(std::vector<warp::Task>& tasks)
    {
       apiManager_->GetTasks(tasks);
    }
 
+   void Notify::RecordRequest(std::string_view serverType, std::string_view server, bool sent)
+   {
+      std::scoped_lock lock(statisticsLock_);
+      auto& statistics = serverStatistics_[std::format("{}({})", serverType, server)];
+      if (sent)
+      {
+         ++statistics.requests;
+      }
+      else
+      {
+         ++statistics.skipped;
+      }
+   }
+
+   Notify::ServerRequests& Notify::GetServerRequests(std::string_view serverType, std::string_view server)
+   {
+      auto iter = serverRequests_.find(std::format("{}({})", serverType, server));
+      return (iter != serverRequests_.end()) ? iter->second : unknownServerRequests_;
+   }
+
+   Notify::RequestSlot::RequestSlot(ServerRequests& requests)
+      : requests_(requests)
+   {
+      std::unique_lock lock(requests_.lock);
+      requests_.cv.wait(lock, [this] { return requests_.limit == 0 || requests_.active < requests_.limit; });
+      ++requests_.active;
+   }
+
+   Notify::RequestSlot::~RequestSlot()
+   {
+      {
+         std::scoped_lock lock(requests_.lock);
+         --requests_.active;
+      }
+      requests_.cv.notify_one();
+   }
+
+   void Notify::RecordDeduplicated(std::string_view serverType, std::string_view server)
+   {
+      std::scoped_lock lock(statisticsLock_);
+      ++serverStatistics_[std::format("{}({})", serverType, server)].deduplicated;
+   }
+
+   bool Notify::GetRecentlyNotifiedLocked(std::string_view serverType,
+                                          const ScanLibraryConfig& library,
+                                          const std::filesystem::path& mappedPath,
+                                          std::chrono::system_clock::time_point changeTime) const
+   {
+      if (recentNotifies_.empty()) return false;
+
+      auto server = std::format("{}({})", serverType, library.server);
+
+      // Walk up to the empty path which stands for a scan of the whole library
+      auto path = mappedPath;
+      while (true)
+      {
+         auto iter = recentNotifies_.find(RecentNotifyKey{server, library.library, path});
+         if (iter != recentNotifies_.end() && changeTime <= iter->second) return true;
+         if (path.empty()) return false;
+
+         auto parent = path.parent_path();
+         path = (parent == path) ? std::filesystem::path() : std::move(parent);
+      }
+   }
+
+   void Notify::AddRecentNotifyLocked(std::string_view serverType, const ScanLibraryConfig& library, const std::filesystem::path& mappedPath)
+   {
+      recentNotifies_.insert_or_assign(RecentNotifyKey{std::format("{}({})", serverType, library.server), library.library, mappedPath},
+                                       std::chrono::system_clock::now());
+   }
+
+   void Notify::PruneRecentNotifies()
+   {
+      const auto expired = std::chrono::system_clock::now() - RECENT_NOTIFY_RETENTION;
+
+      std::scoped_lock lock(recentLock_);
+      std::erase_if(recentNotifies_, [&expired](const auto& item) { return item.second < expired; });
+   }
+
+   void Notify::RecordLatency(std::chrono::system_clock::duration latency)
+   {
+      auto latencyMs = std::chrono::duration_cast<std::chrono::milliseconds>(latency);
+
+      std::scoped_lock lock(statisticsLock_);
+      if (latencySamples_.size() < MAX_LATENCY_SAMPLES)
+      {
+         latencySamples_.emplace_back(latencyMs);
+      }
+      else
+      {
+         latencySamples_[nextLatencySample_] = latencyMs;
+         nextLatencySample_ = (nextLatencySample_ + 1) % MAX_LATENCY_SAMPLES;
+      }
+   }
+
+   void Notify::LogStatistics()
+   {
+      std::scoped_lock lock(statisticsLock_);
+      for (const auto& [server, statistics] : serverStatistics_)
+      {
+         warp::log::Info("Notify statistics {} {} {} {}",
+                         server,
+                         warp::GetTag("requests", std::to_string(statistics.requests)),
+                         warp::GetTag("skipped", std::to_string(statistics.skipped)),
+                         warp::GetTag("deduplicated", std::to_string(statistics.deduplicated)));
+      }
+
+      if (latencySamples_.empty()) return;
+
+      auto samples = latencySamples_;
+      std::ranges::sort(samples);
+      auto getPercentile = [&samples](size_t percent) {
+         return std::to_string(GetPercentile(samples, percent).count());
+      };
+
+      warp::log::Info("Event to notify latency over the last {} notifies {} {} {} {}",
+                      samples.size(),
+                      warp::GetTag("p50ms", getPercentile(50)),
+                      warp::GetTag("p90ms", getPercentile(90)),
+                      warp::GetTag("p99ms", getPercentile(99)),
+                      warp::GetTag("maxms", std::to_string(samples.back().count())));
+   }
+
+   std::map<std::string, NotifyServerStatistics> Notify::GetServerStatistics()
+   {
+      std::scoped_lock lock(statisticsLock_);
+      return serverStatistics_;
+   }
+
+   std::optional<std::chrono::milliseconds> Notify::GetLatencyPercentile(size_t percent)
+   {
+      std::vector<std::chrono::milliseconds> samples;
+      {
+         std::scoped_lock lock(statisticsLock_);
+         if (latencySamples_.empty()) return std::nullopt;
+         samples = latencySamples_;
+      }
+
+      std::ranges::sort(samples);
+      return GetPercentile(samples, percent);
+   }
+
    void Notify::LogServerLibraryIssue(std::string_view serverType, const ScanLibraryConfig& library)
    {
+      RecordRequest(serverType, library.server, false);
       warp::log::Warning("{}({}) {} not found ... Skipped notify",
                          serverType,
                          library.server,
@@ -60,6 +252,7 @@ namespace remote_scan
 
    void Notify::LogServerNotAvailable(std::string_view serverType, const ScanLibraryConfig& library)
    {
+      RecordRequest(serverType, library.server, false);
       warp::log::Warning("{}({}) server not available ... Skipped notify for {}",
                          serverType,
                          library.server,
@@ -80,6 +273,8 @@ namespace remote_scan
          return false;
       }
 
+      RequestSlot requestSlot(GetServerRequests(warp::GetFormattedPlex(), library.server));
+
       auto libraryId{plexApi->GetLibraryId(library.library)};
       if (!libraryId)
       {
@@ -101,6 +296,9 @@ namespace remote_scan
             // Path is gone (like "New Folder"). Notify the parent so Plex sees it's missing.
             rawPaths.emplace_back(path.path.parent_path());
          }
+
+         // A moved directory is also gone from the folder it left
+         if (!path.movedFrom.empty()) rawPaths.emplace_back(path.movedFrom.parent_path());
       }
 
       // Remove exact duplicates and sort them by length (shallowest first)
@@ -124,15 +322,36 @@ namespace remote_scan
          }
       }
 
-      // Notify the optimized list
-      for (const auto& pathToNotify : optimizedPaths)
+      // Paths are recorded before they are sent so a scan notifying alongside this one skips them
+      std::vector<std::filesystem::path> libraryScanPaths;
       {
-         auto libraryScanPath = warp::ReplaceMediaPath(pathToNotify, basePath, library.mediaPath);
+         std::scoped_lock recentLock(recentLock_);
+         for (const auto& pathToNotify : optimizedPaths)
+         {
+            auto libraryScanPath = warp::ReplaceMediaPath(pathToNotify, basePath, library.mediaPath);
+            if (GetRecentlyNotifiedLocked(warp::GetFormattedPlex(), library, libraryScanPath, monitor.time))
+            {
+               RecordDeduplicated(warp::GetFormattedPlex(), library.server);
+               warp::log::Trace("{} already scanned {} ... Skipped duplicate", plexApi->GetPrettyName(), libraryScanPath.generic_string());
+               continue;
+            }
+            libraryScanPaths.emplace_back(std::move(libraryScanPath));
+         }
 
+         for (const auto& libraryScanPath : libraryScanPaths)
+         {
+            AddRecentNotifyLocked(warp::GetFormattedPlex(), library, libraryScanPath);
+         }
+      }
+
+      // Notify the optimized list
+      for (const auto& libraryScanPath : libraryScanPaths)
+      {
          if (!dryRun)
          {
             plexApi->SetLibraryScanPath(*libraryId, libraryScanPath);
          }
+         RecordRequest(warp::GetFormattedPlex(), library.server, true);
 
          warp::log::Trace("{} refresh library {} path {}",
                           plexApi->GetPrettyName(),
@@ -143,11 +362,51 @@ namespace remote_scan
       return true;
    }
 
+   std::optional<std::filesystem::path> Notify::GetOwningMedia(const ActiveMonitorPath& path,
+                                                               const std::vector<std::filesystem::path>& scanRoots,
+                                                               FolderMediaCache& folderMedia) const
+   {
+      auto [mediaIter, added] = folderMedia.try_emplace(path.path);
+      if (added && getMediaFunc_)
+      {
+         std::error_code ec;
+         for (auto iter = std::filesystem::directory_iterator(path.path, ec);
+              !ec && iter != std::filesystem::directory_iterator();
+              iter.increment(ec))
+         {
+            std::error_code typeEc;
+            if (iter->is_regular_file(typeEc) && getMediaFunc_(iter->path().filename())) mediaIter->second.emplace_back(iter->path().filename());
+         }
+      }
+
+      // Artwork is named after the media file it belongs to, for example "Movie (2020)-poster.jpg" or "S01E01-thumb.jpg"
+      const auto& mediaFiles = mediaIter->second;
+      const auto artworkStem = path.fileName.stem().string();
+      const std::filesystem::path* owner{nullptr};
+      for (const auto& mediaFile : mediaFiles)
+      {
+         const auto mediaStem = mediaFile.stem().string();
+         if (artworkStem.starts_with(mediaStem) && (!owner || mediaStem.size() > owner->stem().string().size())) owner = &mediaFile;
+      }
+
+      // A folder holding a single media file is that item, like a movie folder with poster.jpg
+      if (!owner && mediaFiles.size() == 1) owner = &mediaFiles.front();
+      if (owner) return path.path / *owner;
+
+      // Art at the top of a scan path belongs to the library itself and a missing folder cannot be refreshed
+      std::error_code ec;
+      if (std::ranges::find(scanRoots, NormalizePath(path.path)) != scanRoots.end() || !std::filesystem::is_directory(path.path, ec)) return std::nullopt;
+
+      // Otherwise the enclosing show or season folder owns it
+      return path.path;
+   }
+
    bool Notify::NotifyEmby(const ActiveMonitor& monitor,
-                           const std::filesystem::path& basePath,
+                           const ScanConfig& scan,
                            const ScanLibraryConfig& library,
                            bool dryRun)
    {
+      const auto& basePath = scan.basePath;
       if (basePath.empty()) return false;
 
       auto* embyApi = apiManager_->GetEmbyApi(library.server);
@@ -157,11 +416,58 @@ namespace remote_scan
          return false;
       }
 
-      // If any of the paths are a directory or an image file, we need to trigger a full library scan
-      bool needsLibraryScan = std::ranges::any_of(monitor.paths, [this](const auto& p) {
-         bool isImage = getImageFunc_ ? getImageFunc_(p.fileName) : false;
-         return p.fileName.empty() || isImage;
-      });
+      std::vector<std::filesystem::path> scanRoots;
+      for (const auto& pathConfig : scan.pathsFromBase)
+      {
+         scanRoots.emplace_back(NormalizePath(basePath / pathConfig.path));
+      }
+
+      // Artwork and metadata refresh the item that owns them and directories update the media files below them.
+      // A full library scan is the last resort for directories that could not be expanded and for artwork
+      // that does not belong to any item.
+      FolderMediaCache folderMedia;
+      std::vector<std::pair<const ActiveMonitorPath*, std::filesystem::path>> targets;
+      targets.reserve(monitor.paths.size());
+
+      bool needsLibraryScan{false};
+      for (const auto& path : monitor.paths)
+      {
+         if (path.fileName.empty())
+         {
+            if (!path.expandedFiles)
+            {
+               needsLibraryScan = true;
+               break;
+            }
+
+            for (const auto& file : *path.expandedFiles)
+            {
+               targets.emplace_back(&path, file);
+
+               // The files of a moved directory are removed from their old location in the same request
+               if (!path.movedFrom.empty()) targets.emplace_back(&path, path.movedFrom / file.lexically_relative(path.path));
+            }
+            continue;
+         }
+
+         if (getMetadataFunc_ && getMetadataFunc_(path.fileName))
+         {
+            auto owner = GetOwningMedia(path, scanRoots, folderMedia);
+            if (!owner)
+            {
+               needsLibraryScan = true;
+               break;
+            }
+            targets.emplace_back(nullptr, std::move(*owner));
+         }
+         else
+         {
+            targets.emplace_back(&path, path.path / path.fileName);
+         }
+      }
+
+      // Only the requests count against the server cap. Looking up owners above runs alongside other scans.
+      RequestSlot requestSlot(GetServerRequests(warp::GetFormattedEmby(), library.server));
 
       if (needsLibraryScan)
       {
@@ -172,20 +478,56 @@ namespace remote_scan
             return false;
          }
 
+         {
+            std::scoped_lock recentLock(recentLock_);
+            if (GetRecentlyNotifiedLocked(warp::GetFormattedEmby(), library, {}, monitor.time))
+            {
+               RecordDeduplicated(warp::GetFormattedEmby(), library.server);
+               warp::log::Trace("{} already scanned library {} ... Skipped duplicate", embyApi->GetPrettyName(), library.library);
+               return true;
+            }
+            AddRecentNotifyLocked(warp::GetFormattedEmby(), library, {});
+         }
+
          if (!dryRun)
             embyApi->SetLibraryScan(*libraryId);
+         RecordRequest(warp::GetFormattedEmby(), library.server, true);
 
          warp::log::Trace("Notified {} to refresh library {}", embyApi->GetPrettyName(), *libraryId);
       }
       else
       {
          std::vector<warp::EmbyMediaUpdate> mediaUpdates;
-         mediaUpdates.reserve(monitor.paths.size());
+         mediaUpdates.reserve(targets.size());
 
-         for (const auto& path : monitor.paths)
+         // Paths are recorded before they are sent so a scan notifying alongside this one skips them
+         std::unique_lock recentLock(recentLock_);
+
+         std::set<std::filesystem::path> ownersUpdated;
+         size_t duplicates{0};
+         for (const auto& [path, target] : targets)
          {
+            auto mappedPath = warp::ReplaceMediaPath(target, basePath, library.mediaPath);
+            if (GetRecentlyNotifiedLocked(warp::GetFormattedEmby(), library, mappedPath, path ? path->time : monitor.time))
+            {
+               ++duplicates;
+               continue;
+            }
+
+            // Owners of artwork are refreshed once however many of their images changed
+            if (!path)
+            {
+               if (!ownersUpdated.insert(target).second) continue;
+
+               mediaUpdates.emplace_back(warp::EmbyMediaUpdate{
+                  .path = std::move(mappedPath),
+                  .type = warp::EmbyUpdateType::MODIFIED
+               });
+               continue;
+            }
+
             warp::EmbyUpdateType embyUpdateType;
-            switch (path.effect)
+            switch (path->effect)
             {
                case EffectType::MODIFY:
                   embyUpdateType = warp::EmbyUpdateType::MODIFIED;
@@ -195,18 +537,35 @@ namespace remote_scan
                   break;
                default:
                   // For CREATE and RENAME, we want to trigger a CREATED update. Emby will handle the rest.
-                  embyUpdateType = warp::EmbyUpdateType::CREATED;
+                  // The old locations of a moved directory's files are deleted.
+                  embyUpdateType = GetMovedAway(*path, target) ? warp::EmbyUpdateType::DELETED : warp::EmbyUpdateType::CREATED;
                   break;
             }
 
             mediaUpdates.emplace_back(warp::EmbyMediaUpdate{
-               .path = warp::ReplaceMediaPath(path.path / path.fileName, basePath, library.mediaPath),
+               .path = std::move(mappedPath),
                .type = embyUpdateType
             });
          }
 
+         for (const auto& update : mediaUpdates)
+         {
+            AddRecentNotifyLocked(warp::GetFormattedEmby(), library, update.path);
+         }
+         recentLock.unlock();
+
+         if (duplicates > 0)
+         {
+            RecordDeduplicated(warp::GetFormattedEmby(), library.server);
+            warp::log::Trace("{} already updated {} of the paths ... Skipped duplicates", embyApi->GetPrettyName(), duplicates);
+         }
+
+         // Directories without media files or paths another scan already sent leave nothing for Emby to update
+         if (mediaUpdates.empty()) return true;
+
          if (!dryRun)
             embyApi->SetMediaScan(mediaUpdates);
+         RecordRequest(warp::GetFormattedEmby(), library.server, true);
 
          for (const auto& update : mediaUpdates)
          {
@@ -217,9 +576,10 @@ namespace remote_scan
       return true;
    }
 
-   void Notify::NotifyMediaServers(const ActiveMonitor& monitor)
+   void Notify::NotifyMediaServers(const ActiveMonitor& monitor, NotifyTarget target)
    {
-      const auto& scanConfig = configReader_->GetRemoteScanConfig();
+      auto configReader = GetConfigReader();
+      const auto& scanConfig = configReader->GetRemoteScanConfig();
 
       auto scanIter{std::ranges::find_if(scanConfig.scans, [&monitor](const auto& scan) { return scan.name == monitor.scanName; })};
       if (scanIter == scanConfig.scans.end())
@@ -229,34 +589,60 @@ namespace remote_scan
       }
 
       const auto& scan{*scanIter};
+      const bool plex{target != NotifyTarget::EMBY};
+      const bool emby{target != NotifyTarget::PLEX};
+
+      // A batch sent to Plex and Emby separately is only counted once
+      if (plex || scan.plexLibraries.empty()) RecordLatency(std::chrono::system_clock::now() - monitor.firstTime);
+
+      PruneRecentNotifies();
+
       std::string syncServers;
 
-      for (const auto& plexLibrary : scan.plexLibraries)
+      // A library listed twice in a scan is only notified once
+      auto getFirstNotify = [](std::set<std::pair<std::string_view, std::string_view>>& notified, const ScanLibraryConfig& library) {
+         if (notified.emplace(library.server, library.library).second) return true;
+
+         warp::log::Trace("{} listed more than once in {} ... Skipped duplicate", warp::GetTag("library", library.library), warp::GetTag("server", library.server));
+         return false;
+      };
+
+      std::vector<const ScanLibraryConfig*> plexSent;
+      if (plex)
       {
-         if (NotifyPlex(monitor, scan.basePath, plexLibrary, scanConfig.dryRun))
+         std::set<std::pair<std::string_view, std::string_view>> plexNotified;
+         for (const auto& plexLibrary : scan.plexLibraries)
          {
-            syncServers = warp::BuildSyncServerString(syncServers, warp::GetFormattedPlex(), plexLibrary.server);
+            if (!getFirstNotify(plexNotified, plexLibrary)) continue;
+            if (NotifyPlex(monitor, scan.basePath, plexLibrary, scanConfig.dryRun)) plexSent.emplace_back(&plexLibrary);
          }
       }
 
-      for (const auto& embyLibrary : scan.embyLibraries)
+      std::vector<const ScanLibraryConfig*> embySent;
+      if (emby)
       {
-         if (NotifyEmby(monitor, scan.basePath, embyLibrary, scanConfig.dryRun))
+         std::set<std::pair<std::string_view, std::string_view>> embyNotified;
+         for (const auto& embyLibrary : scan.embyLibraries)
          {
-            syncServers = warp::BuildSyncServerString(syncServers, warp::GetFormattedApiName(warp::ApiType::EMBY), embyLibrary.server);
+            if (!getFirstNotify(embyNotified, embyLibrary)) continue;
+            if (NotifyEmby(monitor, scan, embyLibrary, scanConfig.dryRun)) embySent.emplace_back(&embyLibrary);
          }
       }
 
+      for (const auto* plexLibrary : plexSent)
+      {
+         syncServers = warp::BuildSyncServerString(syncServers, warp::GetFormattedPlex(), plexLibrary->server);
+      }
+      for (const auto* embyLibrary : embySent)
+      {
+         syncServers = warp::BuildSyncServerString(syncServers, warp::GetFormattedApiName(warp::ApiType::EMBY), embyLibrary->server);
+      }
+
       if (syncServers.empty() == false)
       {
-         for (auto& path : monitor.paths)
+         for (const auto& path : monitor.paths)
          {
-            warp::log::Info("{}{} Moved {} to target {} {}",
-                            scanConfig.dryRun ? "[DRY RUN] " : "",
-                            warp::GetAnsiText(">>>", ANSI_MONITOR_PROCESSED),
-                            warp::GetTag("monitor", monitor.scanName),
-                            syncServers,
-                            warp::GetTag("media", path.displayFullPath.generic_string()));
+            eventLog_.Add(EventLogType::NOTIFIED, monitor, path, syncServers, scanConfig.dryRun);
          }
       }
       else
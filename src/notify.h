@@ -1,25 +1,46 @@
 #pragma once
 
 #include "config-reader/config-reader-types.h"
+#include "event-log.h"
 #include "types.h"
 
 #include <warp/api/api-manager.h>
 #include <warp/types.h>
 
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <filesystem>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
 #include <string_view>
+#include <tuple>
 #include <vector>
 
 namespace remote_scan
 {
    class ConfigReader;
 
+   struct NotifyServerStatistics
+   {
+      uint64_t requests{0};
+      uint64_t skipped{0};
+      uint64_t deduplicated{0};
+   };
+
    class Notify
    {
    public:
+      using FileCheckFunc = std::function<bool(const std::filesystem::path& filename)>;
+
+      // getMetadataFunc identifies artwork and metadata files and getMediaFunc the media files they belong to
       Notify(std::shared_ptr<ConfigReader> configReader,
-             std::function<bool(const std::filesystem::path)> getImageFunc);
+             EventLog& eventLog,
+             FileCheckFunc getMetadataFunc,
+             FileCheckFunc getMediaFunc);
       virtual ~Notify() = default;
 
       Notify(const Notify&) = delete;
@@ -27,17 +48,93 @@ namespace remote_scan
 
       void GetTasks(std::vector<warp::Task>& tasks);
 
-      void NotifyMediaServers(const ActiveMonitor& monitor);
+      // Notifies the libraries of the scan on the servers of the target. Plex and Emby are called from workers of their own.
+      void NotifyMediaServers(const ActiveMonitor& monitor, NotifyTarget target);
+
+      // Swaps in a reloaded configuration. Media server connections are only created at startup.
+      void UpdateConfig(std::shared_ptr<ConfigReader> configReader);
+
+      // Logs the request counts per server and the event to notify latency since startup
+      void LogStatistics();
+
+      // Request counts keyed by the formatted server name
+      [[nodiscard]] std::map<std::string, NotifyServerStatistics> GetServerStatistics();
+
+      // Event to notify latency at the percentile over the last notifies kept for the statistics
+      [[nodiscard]] std::optional<std::chrono::milliseconds> GetLatencyPercentile(size_t percent);
 
    private:
+      [[nodiscard]] std::shared_ptr<ConfigReader> GetConfigReader();
+
+      void RecordRequest(std::string_view serverType, std::string_view server, bool sent);
+      void RecordDeduplicated(std::string_view serverType, std::string_view server);
+      void RecordLatency(std::chrono::system_clock::duration latency);
       void LogServerLibraryIssue(std::string_view serverType, const ScanLibraryConfig& library);
       void LogServerNotAvailable(std::string_view serverType, const ScanLibraryConfig& library);
 
+      // A change that happened before the same library was notified of its path or a parent of it was already seen.
+      // recentLock_ is held from the checks until the paths to send are added so scans notifying side by side send a path once.
+      [[nodiscard]] bool GetRecentlyNotifiedLocked(std::string_view serverType,
+                                                   const ScanLibraryConfig& library,
+                                                   const std::filesystem::path& mappedPath,
+                                                   std::chrono::system_clock::time_point changeTime) const;
+      void AddRecentNotifyLocked(std::string_view serverType, const ScanLibraryConfig& library, const std::filesystem::path& mappedPath);
+      void PruneRecentNotifies();
+
+      // Requests in flight to one server. Capped by max_concurrent_requests when it is set.
+      struct ServerRequests
+      {
+         std::mutex lock;
+         std::condition_variable cv;
+         size_t active{0};
+         size_t limit{0};
+      };
+
+      // Holds one request of a server until it is destroyed. Waits while the server is at its cap.
+      class RequestSlot
+      {
+      public:
+         explicit RequestSlot(ServerRequests& requests);
+         virtual ~RequestSlot();
+
+         RequestSlot(const RequestSlot&) = delete;
+         RequestSlot& operator=(const RequestSlot&) = delete;
+
+      private:
+         ServerRequests& requests_;
+      };
+
+      // Scans notify from their own workers and their requests to one server run side by side
+      [[nodiscard]] ServerRequests& GetServerRequests(std::string_view serverType, std::string_view server);
+
       bool NotifyPlex(const ActiveMonitor& monitor, const std::filesystem::path& basePath, const ScanLibraryConfig& library, bool dryRun);
-      bool NotifyEmby(const ActiveMonitor& monitor, const std::filesystem::path& basePath, const ScanLibraryConfig& library, bool dryRun);
+      // Media files in a folder cached for the duration of one notify
+      using FolderMediaCache = std::map<std::filesystem::path, std::vector<std::filesystem::path>>;
 
+      [[nodiscard]] std::optional<std::filesystem::path> GetOwningMedia(const ActiveMonitorPath& path,
+                                                                        const std::vector<std::filesystem::path>& scanRoots,
+                                                                        FolderMediaCache& folderMedia) const;
+      bool NotifyEmby(const ActiveMonitor& monitor, const ScanConfig& scan, const ScanLibraryConfig& library, bool dryRun);
+
+      std::mutex configLock_;
       std::shared_ptr<ConfigReader> configReader_;
       std::unique_ptr<warp::ApiManager> apiManager_;
-      std::function<bool(const std::filesystem::path)> getImageFunc_;
+
+      // Built once at startup like the server connections so lookups need no lock
+      std::map<std::string, ServerRequests, std::less<>> serverRequests_;
+      ServerRequests unknownServerRequests_;
+      EventLog& eventLog_;
+      FileCheckFunc getMetadataFunc_;
+      FileCheckFunc getMediaFunc_;
+
+      // Server, library and mapped path of recent notifies with the time they were sent. An empty path is the whole library.
+      using RecentNotifyKey = std::tuple<std::string, std::string, std::filesystem::path>;
+      std::mutex recentLock_;
+      std::map<RecentNotifyKey, std::chrono::system_clock::time_point> recentNotifies_;
+
+      std::mutex statisticsLock_;
+      std::map<std::string, NotifyServerStatistics> serverStatistics_;
+      std::vector<std::chrono::milliseconds> latencySamples_;
+      size_t nextLatencySample_{0};
    };
 }
\ No newline at end of file
@@ -0,0 +1,321 @@
+﻿#include "poll-watch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <utility>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+namespace remote_scan
+{
+   namespace
+   {
+      // A new file is checked on every poll until it has been unchanged this many times
+      constexpr int RECENT_FILE_STABLE_POLLS{3};
+   }
+
+   PollWatch::PollWatch(std::vector<PollRoot> roots, const PollSettings& settings, EventFunc eventFunc)
+      : settings_(settings)
+      , eventFunc_(std::move(eventFunc))
+   {
+      settings_.threads = std::max<size_t>(settings_.threads, 1);
+
+      {
+         std::scoped_lock lock(directoryLock_);
+         AddDirectories(std::move(roots));
+      }
+
+      workThread_ = std::jthread([this](std::stop_token stopToken) {
+         this->Work(stopToken);
+      });
+   }
+
+   PollWatch::~PollWatch() = default;
+
+   size_t PollWatch::GetDirectoryCount()
+   {
+      std::scoped_lock lock(directoryLock_);
+      return directories_.size();
+   }
+
+   std::optional<PollWatch::FileState> PollWatch::GetFileState(const std::filesystem::path& path)
+   {
+#ifdef __linux__
+      // Only the time, size and inode are requested so network filesystems can skip fetching the other attributes
+      struct statx result{};
+      if (statx(AT_FDCWD, path.c_str(), AT_SYMLINK_NOFOLLOW, STATX_MTIME | STATX_SIZE | STATX_INO, &result) != 0
+          || (result.stx_mask & STATX_MTIME) == 0)
+      {
+         return std::nullopt;
+      }
+
+      FileState state;
+      state.writeTime = (static_cast<int64_t>(result.stx_mtime.tv_sec) * 1'000'000'000) + result.stx_mtime.tv_nsec;
+      state.size = result.stx_size;
+      if ((result.stx_mask & STATX_INO) != 0) state.inode = result.stx_ino;
+      return state;
+#else
+      std::error_code ec;
+      auto writeTime = std::filesystem::last_write_time(path, ec);
+      if (ec) return std::nullopt;
+
+      FileState state;
+      state.writeTime = std::chrono::duration_cast<std::chrono::nanoseconds>(writeTime.time_since_epoch()).count();
+      if (std::filesystem::is_regular_file(path, ec))
+      {
+         state.size = std::filesystem::file_size(path, ec);
+      }
+      return state;
+#endif
+   }
+
+   bool PollWatch::ReadDirectory(const std::filesystem::path& path, DirectoryState& state)
+   {
+      auto fileState = GetFileState(path);
+      if (!fileState) return false;
+      state.writeTime = fileState->writeTime;
+
+      // The entry types come from the directory listing itself. Files get a stat of their own so one replaced
+      // under the same name is noticed the next time the directory changes.
+      std::error_code ec;
+      state.entries.clear();
+      for (auto iter = std::filesystem::directory_iterator(path, std::filesystem::directory_options::skip_permission_denied, ec);
+           !ec && iter != std::filesystem::directory_iterator();
+           iter.increment(ec))
+      {
+         std::error_code typeEc;
+         EntryState entry;
+         entry.isDirectory = iter->is_directory(typeEc) && !iter->is_symlink(typeEc);
+         if (!entry.isDirectory) entry.state = GetFileState(iter->path()).value_or(FileState{});
+         state.entries.emplace(iter->path().filename().string(), entry);
+      }
+      return !ec;
+   }
+
+   void PollWatch::RunParallel(size_t count, const std::function<void(size_t index)>& func) const
+   {
+      std::atomic<size_t> nextIndex{0};
+      auto work = [&]() {
+         for (auto index = nextIndex++; index < count; index = nextIndex++)
+         {
+            func(index);
+         }
+      };
+
+      std::vector<std::jthread> workers;
+      for (size_t i = 1; i < std::min(settings_.threads, count); ++i)
+      {
+         workers.emplace_back(work);
+      }
+      work();
+   }
+
+   void PollWatch::AddDirectories(std::vector<PollRoot> roots)
+   {
+      if (roots.empty()) return;
+
+      // Directories are listed by a pool of workers sharing one queue so a large share is walked concurrently
+      std::mutex queueLock;
+      std::condition_variable queueCv;
+      std::deque<PollRoot> queue(std::make_move_iterator(roots.begin()), std::make_move_iterator(roots.end()));
+      size_t activeWorkers{0};
+
+      auto work = [&]() {
+         std::unique_lock lock(queueLock);
+         while (true)
+         {
+            queueCv.wait(lock, [&] { return !queue.empty() || activeWorkers == 0; });
+            if (queue.empty()) break;
+
+            auto root = std::move(queue.front());
+            queue.pop_front();
+            ++activeWorkers;
+            lock.unlock();
+
+            DirectoryState state;
+            state.recursive = root.recursive;
+            const auto valid = ReadDirectory(root.path, state);
+
+            lock.lock();
+            if (valid)
+            {
+               if (root.recursive)
+               {
+                  for (const auto& [name, entry] : state.entries)
+                  {
+                     if (entry.isDirectory) queue.emplace_back(root.path / name, true);
+                  }
+               }
+               directories_.insert_or_assign(std::move(root.path), std::move(state));
+            }
+            --activeWorkers;
+            queueCv.notify_all();
+         }
+      };
+
+      std::vector<std::jthread> workers;
+      for (size_t i = 1; i < settings_.threads; ++i)
+      {
+         workers.emplace_back(work);
+      }
+      work();
+   }
+
+   void PollWatch::RemoveDirectory(const std::filesystem::path& path)
+   {
+      // Children sort directly after their parent so the whole subtree is one range
+      auto iter = directories_.lower_bound(path);
+      while (iter != directories_.end())
+      {
+         auto [parentEnd, childIter] = std::mismatch(path.begin(), path.end(), iter->first.begin(), iter->first.end());
+         if (parentEnd != path.end()) break;
+
+         iter = directories_.erase(iter);
+      }
+   }
+
+   void PollWatch::CheckRecentFiles(std::vector<std::tuple<std::filesystem::path, bool, EffectType>>& events)
+   {
+      std::vector<std::filesystem::path> paths;
+      paths.reserve(recentFiles_.size());
+      for (const auto& [path, recentFile] : recentFiles_)
+      {
+         paths.emplace_back(path);
+      }
+
+      std::vector<std::optional<FileState>> states(paths.size());
+      RunParallel(paths.size(), [&](size_t index) {
+         states[index] = GetFileState(paths[index]);
+      });
+
+      for (size_t i = 0; i < paths.size(); ++i)
+      {
+         auto iter = recentFiles_.find(paths[i]);
+
+         // A file that is gone is reported by the listing of its parent
+         if (!states[i])
+         {
+            recentFiles_.erase(iter);
+            continue;
+         }
+
+         auto& recentFile = iter->second;
+         if (*states[i] != recentFile.state)
+         {
+            // A file still being copied keeps changing so report it to restart the settle time
+            if (recentFile.state.writeTime != 0) events.emplace_back(paths[i], false, EffectType::MODIFY);
+            recentFile.state = *states[i];
+            recentFile.unchangedPolls = 0;
+         }
+         else if (++recentFile.unchangedPolls >= RECENT_FILE_STABLE_POLLS)
+         {
+            recentFiles_.erase(iter);
+         }
+      }
+   }
+
+   void PollWatch::Poll()
+   {
+      std::vector<std::tuple<std::filesystem::path, bool, EffectType>> events;
+
+      {
+         std::scoped_lock lock(directoryLock_);
+
+         std::vector<std::pair<std::filesystem::path, int64_t>> known;
+         known.reserve(directories_.size());
+         for (const auto& [path, state] : directories_)
+         {
+            known.emplace_back(path, state.writeTime);
+         }
+
+         // Stat every directory concurrently and only list the ones whose time changed
+         std::vector<std::optional<DirectoryState>> changed(known.size());
+         RunParallel(known.size(), [&](size_t index) {
+            const auto& [path, writeTime] = known[index];
+
+            // A directory that is gone is reported by the listing of its parent
+            auto fileState = GetFileState(path);
+            if (!fileState || fileState->writeTime == writeTime) return;
+
+            DirectoryState newState;
+            if (ReadDirectory(path, newState)) changed[index] = std::move(newState);
+         });
+
+         std::vector<PollRoot> newDirectories;
+         for (size_t i = 0; i < known.size(); ++i)
+         {
+            if (!changed[i]) continue;
+
+            // The directory may have been removed along with its parent earlier in this poll
+            const auto& path = known[i].first;
+            auto stateIter = directories_.find(path);
+            if (stateIter == directories_.end()) continue;
+
+            auto& newState = *changed[i];
+            auto oldEntries = std::exchange(stateIter->second.entries, newState.entries);
+            stateIter->second.writeTime = newState.writeTime;
+
+            // An entry that changed type under the same name is removed and created again
+            for (const auto& [name, oldEntry] : oldEntries)
+            {
+               auto newIter = newState.entries.find(name);
+               if (newIter != newState.entries.end() && newIter->second.isDirectory == oldEntry.isDirectory) continue;
+
+               events.emplace_back(path / name, oldEntry.isDirectory, EffectType::DESTROY);
+               if (oldEntry.isDirectory) RemoveDirectory(path / name);
+            }
+
+            for (const auto& [name, entry] : newState.entries)
+            {
+               auto oldIter = oldEntries.find(name);
+               if (oldIter != oldEntries.end() && oldIter->second.isDirectory == entry.isDirectory)
+               {
+                  // A file replaced or rewritten under the same name. Files still settling are reported by CheckRecentFiles.
+                  if (entry.isDirectory || entry.state == oldIter->second.state || recentFiles_.contains(path / name)) continue;
+
+                  events.emplace_back(path / name, false, EffectType::MODIFY);
+                  recentFiles_.insert_or_assign(path / name, RecentFile{.state = entry.state, .unchangedPolls = 0});
+                  continue;
+               }
+
+               events.emplace_back(path / name, entry.isDirectory, EffectType::CREATE);
+
+               // New directories are always polled with their whole tree
+               if (entry.isDirectory)
+               {
+                  newDirectories.emplace_back(path / name, true);
+               }
+               else
+               {
+                  recentFiles_.try_emplace(path / name);
+               }
+            }
+         }
+
+         AddDirectories(std::move(newDirectories));
+         CheckRecentFiles(events);
+      }
+
+      for (const auto& [path, isDirectory, effect] : events)
+      {
+         eventFunc_(path, isDirectory, effect);
+      }
+   }
+
+   void PollWatch::Work(std::stop_token stopToken)
+   {
+      std::mutex m;
+      std::unique_lock lock(m);
+      while (!stopToken.stop_requested())
+      {
+         stopCv_.wait_for(lock, stopToken, settings_.interval, [] { return false; });
+         if (stopToken.stop_requested()) break;
+
+         Poll();
+      }
+   }
+}
\ No newline at end of file
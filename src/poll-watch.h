@@ -0,0 +1,105 @@
+#pragma once
+
+#include "types.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+namespace remote_scan
+{
+   struct PollRoot
+   {
+      std::filesystem::path path;
+      bool recursive{true};
+   };
+
+   struct PollSettings
+   {
+      std::chrono::seconds interval{60};
+      size_t threads{4};
+   };
+
+   // Detects changes by polling directory modification times instead of using kernel watches.
+   // Works on network shares where kernel watches do not see changes made by other machines.
+   // A directory is only listed again when its modification time changes so unchanged directories cost a single stat.
+   // New files are checked for a few polls after they appear so files still being copied report modifications.
+   class PollWatch
+   {
+   public:
+      using EventFunc = std::function<void(const std::filesystem::path& path, bool isDirectory, EffectType effect)>;
+
+      PollWatch(std::vector<PollRoot> roots, const PollSettings& settings, EventFunc eventFunc);
+      virtual ~PollWatch();
+
+      PollWatch(const PollWatch&) = delete;
+      PollWatch& operator=(const PollWatch&) = delete;
+
+      [[nodiscard]] size_t GetDirectoryCount();
+
+   private:
+      struct FileState
+      {
+         int64_t writeTime{0};
+         uint64_t size{0};
+
+         // A file replaced under the same name, for example by rsync renaming its temporary file over it, gets a new inode
+         uint64_t inode{0};
+
+         bool operator==(const FileState&) const = default;
+      };
+
+      struct EntryState
+      {
+         bool isDirectory{false};
+
+         // Only kept for files. Directories are tracked by their own DirectoryState.
+         FileState state;
+      };
+
+      struct DirectoryState
+      {
+         int64_t writeTime{0};
+         bool recursive{true};
+
+         // Entry names mapped to their type and for files their state when the directory was listed
+         std::map<std::string, EntryState> entries;
+      };
+
+      struct RecentFile
+      {
+         FileState state;
+         int unchangedPolls{0};
+      };
+
+      void Work(std::stop_token stopToken);
+      void Poll();
+      void CheckRecentFiles(std::vector<std::tuple<std::filesystem::path, bool, EffectType>>& events);
+
+      void AddDirectories(std::vector<PollRoot> roots);
+      void RemoveDirectory(const std::filesystem::path& path);
+      void RunParallel(size_t count, const std::function<void(size_t index)>& func) const;
+
+      [[nodiscard]] static std::optional<FileState> GetFileState(const std::filesystem::path& path);
+      [[nodiscard]] static bool ReadDirectory(const std::filesystem::path& path, DirectoryState& state);
+
+      PollSettings settings_;
+      EventFunc eventFunc_;
+
+      std::mutex directoryLock_;
+      std::map<std::filesystem::path, DirectoryState> directories_;
+      std::map<std::filesystem::path, RecentFile> recentFiles_;
+
+      std::condition_variable_any stopCv_;
+      std::jthread workThread_;
+   };
+}
\ No newline at end of file
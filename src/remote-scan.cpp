@@ -8,6 +8,7 @@
 
 #include <algorithm>
 #include <condition_variable>
+#include <cstdlib>
 #include <mutex>
 
 namespace remote_scan
@@ -15,24 +16,174 @@ namespace remote_scan
    namespace
    {
       constexpr std::string_view APP_NAME("Remote-Scan");
+
+      // How often the configuration file is checked for changes
+      constexpr auto CONFIG_CHECK_INTERVAL{std::chrono::seconds(10)};
    };
 
    RemoteScan::RemoteScan(std::shared_ptr<ConfigReader> configReader)
-      : monitor_(configReader)
+      : configReader_(configReader)
+      , monitor_(configReader)
       , scanConfig_(configReader->GetRemoteScanConfig())
+      , watchRegistry_(FileMonitorSink::Create<&RemoteScan::ProcessEvent>(*this))
    {
+      std::error_code ec;
+      configWriteTime_ = std::filesystem::last_write_time(configReader_->GetConfigFile(), ec);
+
       if (scanConfig_.dryRun)
       {
          warp::log::Info("[DRY RUN MODE] Remote Scan will not notify media servers of changes");
       }
+
+      // Record every file monitor event for later replay if requested
+      if (const auto* traceFile = std::getenv("REMOTE_SCAN_TRACE_FILE");
+          traceFile)
+      {
+         traceWriter_ = std::make_unique<TraceWriter>(traceFile);
+         if (!traceWriter_->GetValid())
+         {
+            traceWriter_.reset();
+         }
+      }
+
+      if (!scanConfig_.forwardTo.empty())
+      {
+         forwarder_ = std::make_unique<EventForwarder>(scanConfig_.forwardTo, scanConfig_.forwardKey);
+      }
+   }
+
+   void RemoteScan::ProcessEvent(FileMonitorData&& data)
+   {
+      if (traceWriter_) traceWriter_->Record(data);
+
+      if (forwarder_)
+      {
+         forwarder_->Add(data);
+      }
+      else
+      {
+         monitor_.Process(std::move(data));
+      }
+   }
+
+   WatchRegistrar RemoteScan::CreateWatchRegistrar() const
+   {
+      PollSettings pollSettings;
+      pollSettings.interval = std::chrono::seconds(std::max(scanConfig_.pollIntervalSeconds, 1));
+      pollSettings.threads = static_cast<size_t>(std::max(scanConfig_.pollThreads, 1));
+
+      return WatchRegistrar(static_cast<size_t>(std::max(scanConfig_.watchRegistrationThreads, 1)),
+                            watchRegistry_.GetWatchedDirectories(),
+                            pollSettings);
    }
 
    void RemoteScan::SetupScans()
    {
-      for (const auto& scan : scanConfig_.scans)
+      auto registrar{CreateWatchRegistrar()};
+      watchRegistry_.Update(scanConfig_.scans, registrar);
+      registrar.Run();
+   }
+
+   void RemoteScan::UpdateControlSocket()
+   {
+      // The monitor of a forwarding instance holds nothing to control
+      const std::filesystem::path socketPath(forwarder_ ? std::string() : scanConfig_.controlSocket);
+      if (controlSocket_ && controlSocket_->GetPath() == socketPath) return;
+
+      controlSocket_.reset();
+      if (socketPath.empty()) return;
+
+      controlSocket_ = std::make_unique<ControlSocket>(socketPath, monitor_);
+      if (!controlSocket_->Start()) controlSocket_.reset();
+   }
+
+   void RemoteScan::UpdateWebhook()
+   {
+      // Reported files go straight to the monitor which a forwarding instance does not run
+      const auto address = forwarder_ ? std::string() : scanConfig_.webhookListen;
+      if (webhook_ && webhook_->GetAddress() == address && webhook_->GetKey() == scanConfig_.webhookKey) return;
+
+      webhook_.reset();
+      if (address.empty()) return;
+
+      webhook_ = std::make_unique<WebhookReceiver>(address, scanConfig_.webhookKey, monitor_);
+      if (!webhook_->Start()) webhook_.reset();
+   }
+
+   void RemoteScan::UpdateAggregator()
+   {
+      // A forwarding instance does not notify so it has nothing to aggregate into
+      const auto address = forwarder_ ? std::string() : scanConfig_.aggregatorListen;
+      if (aggregator_ && aggregator_->GetAddress() == address && aggregator_->GetKey() == scanConfig_.forwardKey) return;
+
+      aggregator_.reset();
+      if (address.empty()) return;
+
+      aggregator_ = std::make_unique<EventAggregator>(address, scanConfig_.forwardKey, [this](FileMonitorData&& data) {
+         this->ProcessEvent(std::move(data));
+      });
+      if (!aggregator_->Start()) aggregator_.reset();
+   }
+
+   void RemoteScan::CheckConfigChanged()
+   {
+      std::error_code ec;
+      auto writeTime = std::filesystem::last_write_time(configReader_->GetConfigFile(), ec);
+      if (ec || writeTime == configWriteTime_) return;
+
+      // Only retry a file that failed to load once it changes again
+      configWriteTime_ = writeTime;
+      ReloadConfig();
+   }
+
+   void RemoteScan::ReloadConfig()
+   {
+      auto configReader{std::make_shared<ConfigReader>()};
+      if (!configReader->IsConfigValid())
+      {
+         warp::log::Warning("Config file changed but is not valid ... Keeping the current configuration");
+         return;
+      }
+
+      warp::log::Info("Config file changed ... Reloading the configuration");
+
+      const auto& newScanConfig = configReader->GetRemoteScanConfig();
+
+      auto hasScan = [](const RemoteScanConfig& config, const std::string& name) {
+         return std::ranges::any_of(config.scans, [&name](const auto& scanConfig) { return scanConfig.name == name; });
+      };
+      for (const auto& scanConfig : scanConfig_.scans)
+      {
+         if (!hasScan(newScanConfig, scanConfig.name)) warp::log::Info("Removing scan {}", scanConfig.name);
+      }
+      for (const auto& scanConfig : newScanConfig.scans)
+      {
+         if (!hasScan(scanConfig_, scanConfig.name)) warp::log::Info("Adding scan {}", scanConfig.name);
+      }
+
+      scanConfig_ = newScanConfig;
+      configReader_ = configReader;
+      if (forwarder_)
+      {
+         if (scanConfig_.forwardTo != forwarder_->GetAddress())
+         {
+            warp::log::Warning("forward_to changed ... Restart Remote Scan to forward to {}", scanConfig_.forwardTo.empty() ? "the media servers" : scanConfig_.forwardTo);
+         }
+      }
+      else
       {
-         scans_.emplace_back(std::make_unique<Scan>(scan, [this](const FileMonitorData& data) { monitor_.Process(data); }));
+         // The monitor drops events of scans it does not know so it learns of new scans before their watches start
+         monitor_.UpdateConfig(configReader_);
       }
+
+      // Only the watch roots that changed get watches created or destroyed
+      auto registrar{CreateWatchRegistrar()};
+      watchRegistry_.Update(scanConfig_.scans, registrar);
+      registrar.Run();
+
+      UpdateControlSocket();
+      UpdateAggregator();
+      UpdateWebhook();
    }
 
    void RemoteScan::AddTasksToScheduler()
@@ -47,35 +198,75 @@ namespace remote_scan
 
    void RemoteScan::CleanupShutdown()
    {
+      webhook_.reset();
+      aggregator_.reset();
+      controlSocket_.reset();
+
       warp::log::Info("Removing directory watches");
-      for (auto& scan : scans_)
-      {
-         scan->Shutdown();
-      }
+      watchRegistry_.Shutdown();
+
+      // Sends what is still queued before the connection is closed
+      if (forwarder_) forwarder_->Shutdown();
 
       monitor_.Shutdown();
    }
 
    void RemoteScan::Run()
    {
-      // Add any needed tasks to the scheduler
-      AddTasksToScheduler();
-
-      if (!cronScheduler_.Start())
+      if (forwarder_)
       {
-         warp::log::Critical("No enabled services");
-         return;
+         // A forwarding instance only watches. The aggregator it forwards to settles and notifies the changes.
+         forwarder_->Start();
+         SetupScans();
+         warp::log::Info("Watching for changes");
       }
+      else
+      {
+         // Watches start before the media servers are reached so changes made while a slow server answers are
+         // collected instead of missed. The monitor holds them until startup is done.
+         monitor_.SetPaused(true);
+         monitor_.Run();
 
-      // Setup all the scans from the configuration
-      SetupScans();
+         // Changes from other instances are collected the same as local ones
+         UpdateAggregator();
 
-      monitor_.Run();
+         // Setup all the scans from the configuration
+         SetupScans();
 
-      // Hold the main thread until shutdown
+         warp::log::Info("Watching for changes ... Connecting to the media servers");
+         monitor_.Connect();
+
+         // Add any needed tasks to the scheduler
+         AddTasksToScheduler();
+
+         if (!cronScheduler_.Start())
+         {
+            warp::log::Critical("No enabled services");
+            CleanupShutdown();
+            return;
+         }
+
+         // Changes collected during startup are notified from here as soon as they settle
+         const auto startupPending = monitor_.GetPending().size();
+         monitor_.SetPaused(false);
+         if (startupPending > 0) warp::log::Info("Collected {} pending groups during startup", startupPending);
+      }
+
+      UpdateControlSocket();
+      UpdateWebhook();
+
+      // Hold the main thread until shutdown checking for configuration changes
       std::mutex m;
       std::unique_lock lk(m);
-      std::condition_variable_any().wait(lk, stopSource_.get_token(), [] { return false; });
+      std::condition_variable_any stopCv;
+      auto stopToken = stopSource_.get_token();
+      while (!stopToken.stop_requested())
+      {
+         stopCv.wait_for(lk, stopToken, CONFIG_CHECK_INTERVAL, [] { return false; });
+         if (stopToken.stop_requested()) break;
+
+         CheckConfigChanged();
+      }
 
       // Clean up all threads before shutting down
       CleanupShutdown();
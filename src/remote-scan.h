@@ -1,11 +1,17 @@
 #pragma once
 
 #include "config-reader/config-reader-types.h"
+#include "control-socket.h"
+#include "forwarding.h"
 #include "monitor.h"
-#include "scan.h"
+#include "trace.h"
+#include "watch-registrar.h"
+#include "webhook.h"
+#include "watch-registry.h"
 
 #include <warp/scheduler/cron-scheduler.h>
 
+#include <filesystem>
 #include <memory>
 #include <vector>
 
@@ -29,13 +35,36 @@ namespace remote_scan
    private:
       void AddTasksToScheduler();
       void SetupScans();
+      void UpdateControlSocket();
+      void UpdateAggregator();
+      void UpdateWebhook();
+
+      // Records a change from the watches or a forwarder and hands it to the monitor or the aggregator
+      void ProcessEvent(FileMonitorData&& data);
+      [[nodiscard]] WatchRegistrar CreateWatchRegistrar() const;
+      void CheckConfigChanged();
+      void ReloadConfig();
       void CleanupShutdown();
 
+      std::shared_ptr<ConfigReader> configReader_;
+      std::filesystem::file_time_type configWriteTime_;
+
       warp::CronScheduler cronScheduler_;
       Monitor monitor_;
       RemoteScanConfig scanConfig_;
 
-      std::vector<std::unique_ptr<Scan>> scans_;
+      std::unique_ptr<TraceWriter> traceWriter_;
+
+      // Set when changes are forwarded to another instance instead of notified from this one
+      std::unique_ptr<EventForwarder> forwarder_;
+
+      // Declared after the monitor it controls
+      std::unique_ptr<ControlSocket> controlSocket_;
+      std::unique_ptr<WebhookReceiver> webhook_;
+      std::unique_ptr<EventAggregator> aggregator_;
+
+      // Declared after the monitor and trace writer so the watches feeding them stop first
+      WatchRegistry watchRegistry_;
 
       std::stop_source stopSource_;
    };
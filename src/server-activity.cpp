@@ -0,0 +1,372 @@
+﻿#include "server-activity.h"
+
+#include "config-reader/config-reader.h"
+
+#include <warp/log/log.h>
+#include <warp/utils.h>
+
+#include <glaze/glaze.hpp>
+#include <httplib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <format>
+#include <iterator>
+#include <utility>
+
+namespace remote_scan
+{
+   namespace
+   {
+      constexpr auto REQUEST_TIMEOUT{std::chrono::seconds(5)};
+
+      constexpr std::string_view PLEX_TYPE("plex");
+      constexpr std::string_view EMBY_TYPE("emby");
+
+      // Emby task that scans every library of the server
+      constexpr std::string_view EMBY_LIBRARY_SCAN_TASK("RefreshLibrary");
+
+      struct PlexActivityContext
+      {
+         std::string librarySectionId;
+
+         struct glaze
+         {
+            static constexpr auto value = glz::object(
+               "librarySectionID", &PlexActivityContext::librarySectionId
+            );
+         };
+      };
+
+      struct PlexActivity
+      {
+         std::string type;
+         std::optional<PlexActivityContext> context;
+
+         struct glaze
+         {
+            static constexpr auto value = glz::object(
+               "type", &PlexActivity::type,
+               "Context", &PlexActivity::context
+            );
+         };
+      };
+
+      struct PlexActivityContainer
+      {
+         std::vector<PlexActivity> activities;
+
+         struct glaze
+         {
+            static constexpr auto value = glz::object(
+               "Activity", &PlexActivityContainer::activities
+            );
+         };
+      };
+
+      struct PlexActivityResponse
+      {
+         PlexActivityContainer container;
+
+         struct glaze
+         {
+            static constexpr auto value = glz::object(
+               "MediaContainer", &PlexActivityResponse::container
+            );
+         };
+      };
+
+      struct PlexSection
+      {
+         std::string key;
+         std::string title;
+
+         struct glaze
+         {
+            static constexpr auto value = glz::object(
+               "key", &PlexSection::key,
+               "title", &PlexSection::title
+            );
+         };
+      };
+
+      struct PlexSectionContainer
+      {
+         std::vector<PlexSection> sections;
+
+         struct glaze
+         {
+            static constexpr auto value = glz::object(
+               "Directory", &PlexSectionContainer::sections
+            );
+         };
+      };
+
+      struct PlexSectionResponse
+      {
+         PlexSectionContainer container;
+
+         struct glaze
+         {
+            static constexpr auto value = glz::object(
+               "MediaContainer", &PlexSectionResponse::container
+            );
+         };
+      };
+
+      struct EmbyTask
+      {
+         std::string key;
+         std::string state;
+
+         struct glaze
+         {
+            static constexpr auto value = glz::object(
+               "Key", &EmbyTask::key,
+               "State", &EmbyTask::state
+            );
+         };
+      };
+
+      // Plex scans for new files and refreshes metadata as library activities. Thumbnail and analysis jobs are left alone.
+      bool GetPlexLibraryActivity(std::string_view type)
+      {
+         return type.starts_with("library.update") || type.starts_with("library.refresh");
+      }
+   }
+
+   std::string GetLibraryTarget(std::string_view serverType, std::string_view server, std::string_view library)
+   {
+      return std::format("{}/{}/{}", serverType, server, library);
+   }
+
+   ServerActivity::ServerActivity(std::shared_ptr<ConfigReader> configReader, ChangedFunc changedFunc)
+      : configReader_(std::move(configReader))
+      , changedFunc_(std::move(changedFunc))
+   {
+   }
+
+   ServerActivity::~ServerActivity()
+   {
+      Shutdown();
+   }
+
+   void ServerActivity::Run()
+   {
+      workThread_ = std::jthread([this](std::stop_token stopToken) {
+         this->Work(stopToken);
+      });
+   }
+
+   void ServerActivity::Shutdown()
+   {
+      if (workThread_.joinable())
+      {
+         workThread_.request_stop();
+         workThread_.join();
+      }
+   }
+
+   void ServerActivity::UpdateConfig(std::shared_ptr<ConfigReader> configReader)
+   {
+      {
+         std::scoped_lock lock(configLock_);
+         configReader_ = std::move(configReader);
+         configChanged_ = true;
+      }
+
+      workCv_.notify_one();
+   }
+
+   std::shared_ptr<ConfigReader> ServerActivity::GetConfigReader()
+   {
+      std::scoped_lock lock(configLock_);
+      return configReader_;
+   }
+
+   bool ServerActivity::GetBusy(std::string_view libraryTarget) const
+   {
+      std::scoped_lock lock(busyLock_);
+      if (busyTargets_.contains(libraryTarget)) return true;
+
+      // A busy server is stored as its target with an empty library which prefixes the targets of its libraries
+      return std::ranges::any_of(busyTargets_, [libraryTarget](const auto& target) {
+         return target.ends_with('/') && libraryTarget.starts_with(target);
+      });
+   }
+
+   void ServerActivity::Work(std::stop_token stopToken)
+   {
+      while (!stopToken.stop_requested())
+      {
+         Poll();
+
+         std::unique_lock lock(configLock_);
+         const auto pollSeconds = configReader_->GetRemoteScanConfig().serverActivityPollSeconds;
+         if (pollSeconds > 0)
+         {
+            workCv_.wait_for(lock, stopToken, std::chrono::seconds(pollSeconds), [this] { return configChanged_; });
+         }
+         else
+         {
+            // Disabled until the configuration changes
+            workCv_.wait(lock, stopToken, [this] { return configChanged_; });
+         }
+
+         // Library ids are looked up again in case the servers changed
+         if (std::exchange(configChanged_, false)) plexSections_.clear();
+      }
+   }
+
+   void ServerActivity::Poll()
+   {
+      auto configReader = GetConfigReader();
+
+      std::set<std::string, std::less<>> busyTargets;
+      if (configReader->GetRemoteScanConfig().serverActivityPollSeconds > 0)
+      {
+         // Only the servers and libraries the scans notify are asked about
+         std::map<std::string, std::set<std::string>> plexLibraries;
+         std::set<std::string> embyServers;
+         for (const auto& scan : configReader->GetRemoteScanConfig().scans)
+         {
+            for (const auto& library : scan.plexLibraries) plexLibraries[library.server].emplace(library.library);
+            for (const auto& library : scan.embyLibraries) embyServers.emplace(library.server);
+         }
+
+         for (const auto& server : configReader->GetPlexServers())
+         {
+            auto librariesIter = plexLibraries.find(server.name);
+            if (librariesIter == plexLibraries.end()) continue;
+
+            auto busy = GetPlexBusy(server, librariesIter->second);
+            UpdateUnreachable(std::format("{}({})", warp::GetFormattedPlex(), server.name), !busy);
+            if (busy) busyTargets.insert(busy->begin(), busy->end());
+         }
+
+         for (const auto& server : configReader->GetEmbyServers())
+         {
+            if (!embyServers.contains(server.name)) continue;
+
+            auto busy = GetEmbyBusy(server);
+            UpdateUnreachable(std::format("{}({})", warp::GetFormattedEmby(), server.name), !busy);
+            if (busy) busyTargets.insert(busy->begin(), busy->end());
+         }
+      }
+
+      std::vector<std::string> started;
+      std::vector<std::string> finished;
+      {
+         std::scoped_lock lock(busyLock_);
+         std::ranges::set_difference(busyTargets, busyTargets_, std::back_inserter(started));
+         std::ranges::set_difference(busyTargets_, busyTargets, std::back_inserter(finished));
+         busyTargets_ = std::move(busyTargets);
+      }
+
+      for (const auto& target : started)
+      {
+         warp::log::Info("Server activity {} is scanning ... Holding its notifies", target);
+      }
+
+      for (const auto& target : finished)
+      {
+         warp::log::Info("Server activity {} finished scanning ... Releasing its notifies", target);
+      }
+
+      if ((!started.empty() || !finished.empty()) && changedFunc_) changedFunc_();
+   }
+
+   std::optional<std::set<std::string>> ServerActivity::GetPlexBusy(const ServerConfig& server, const std::set<std::string>& libraries)
+   {
+      auto body = Get(server, "/activities", "X-Plex-Token");
+      if (!body) return std::nullopt;
+
+      PlexActivityResponse response;
+      if (glz::read<glz::opts{.error_on_unknown_keys = false}>(response, *body)) return std::nullopt;
+
+      std::set<std::string> busy;
+      for (const auto& activity : response.container.activities)
+      {
+         if (!GetPlexLibraryActivity(activity.type)) continue;
+
+         const auto sectionId = activity.context ? activity.context->librarySectionId : std::string();
+         auto& sections = plexSections_[server.name];
+         if (!sectionId.empty() && !sections.contains(sectionId))
+         {
+            // Section ids only change when libraries are added so they are fetched again only for an unknown id
+            if (auto sectionBody = Get(server, "/library/sections", "X-Plex-Token"); sectionBody)
+            {
+               PlexSectionResponse sectionResponse;
+               if (!glz::read<glz::opts{.error_on_unknown_keys = false}>(sectionResponse, *sectionBody))
+               {
+                  sections.clear();
+                  for (auto& section : sectionResponse.container.sections)
+                  {
+                     sections.emplace(std::move(section.key), std::move(section.title));
+                  }
+               }
+            }
+         }
+
+         // An activity that does not name a known library holds back the whole server
+         auto sectionIter = sections.find(sectionId);
+         if (sectionIter == sections.end())
+         {
+            busy.emplace(GetLibraryTarget(PLEX_TYPE, server.name, ""));
+         }
+         else if (libraries.contains(sectionIter->second))
+         {
+            busy.emplace(GetLibraryTarget(PLEX_TYPE, server.name, sectionIter->second));
+         }
+      }
+      return busy;
+   }
+
+   std::optional<std::set<std::string>> ServerActivity::GetEmbyBusy(const ServerConfig& server)
+   {
+      auto body = Get(server, "/emby/ScheduledTasks?IsHidden=false", "X-Emby-Token");
+      if (!body) return std::nullopt;
+
+      std::vector<EmbyTask> tasks;
+      if (glz::read<glz::opts{.error_on_unknown_keys = false}>(tasks, *body)) return std::nullopt;
+
+      std::set<std::string> busy;
+      if (std::ranges::any_of(tasks, [](const auto& task) { return task.key == EMBY_LIBRARY_SCAN_TASK && task.state != "Idle"; }))
+      {
+         busy.emplace(GetLibraryTarget(EMBY_TYPE, server.name, ""));
+      }
+      return busy;
+   }
+
+   std::optional<std::string> ServerActivity::Get(const ServerConfig& server, std::string_view path, std::string_view tokenHeader)
+   {
+      // The url may carry a path when the server is behind a reverse proxy
+      const auto schemeEnd = server.url.find("://");
+      const auto pathStart = server.url.find('/', (schemeEnd == std::string::npos) ? 0 : schemeEnd + 3);
+      auto basePath = (pathStart == std::string::npos) ? std::string() : server.url.substr(pathStart);
+      while (basePath.ends_with('/')) basePath.pop_back();
+
+      httplib::Client client(server.url.substr(0, pathStart));
+      if (!client.is_valid()) return std::nullopt;
+
+      client.set_connection_timeout(REQUEST_TIMEOUT);
+      client.set_read_timeout(REQUEST_TIMEOUT);
+
+      const httplib::Headers headers{{std::string(tokenHeader), server.apiKey}, {"Accept", "application/json"}};
+      auto result = client.Get(basePath + std::string(path), headers);
+      if (!result || result->status != 200) return std::nullopt;
+      return result->body;
+   }
+
+   void ServerActivity::UpdateUnreachable(const std::string& serverName, bool unreachable)
+   {
+      if (unreachable && unreachableServers_.emplace(serverName).second)
+      {
+         warp::log::Warning("Could not get the activity of {} ... Notifying it without waiting for its scans", serverName);
+      }
+      else if (!unreachable && unreachableServers_.erase(serverName) > 0)
+      {
+         warp::log::Info("Getting the activity of {} again", serverName);
+      }
+   }
+}
\ No newline at end of file
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "config-reader/config-reader-types.h"
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace remote_scan
+{
+   class ConfigReader;
+
+   // Name of a server and library pair notified by a scan, for example plex/Server/Movies
+   [[nodiscard]] std::string GetLibraryTarget(std::string_view serverType, std::string_view server, std::string_view library);
+
+   // Polls the media servers used by the scans for library scans they are already running.
+   // Notifies for a busy library are held back by the monitor so partial scans do not stack on top of
+   // a running library scan. A server that cannot be reached counts as idle.
+   //   Plex  /activities library updates and refreshes, per library when the activity names its section
+   //   Emby  the Scan Media Library scheduled task, which covers every library of the server
+   class ServerActivity
+   {
+   public:
+      // Called after a poll changed which libraries are busy
+      using ChangedFunc = std::function<void()>;
+
+      ServerActivity(std::shared_ptr<ConfigReader> configReader, ChangedFunc changedFunc);
+      virtual ~ServerActivity();
+
+      ServerActivity(const ServerActivity&) = delete;
+      ServerActivity& operator=(const ServerActivity&) = delete;
+
+      void Run();
+      void Shutdown();
+
+      // Swaps in a reloaded configuration. The servers and poll interval are picked up on the next poll.
+      void UpdateConfig(std::shared_ptr<ConfigReader> configReader);
+
+      // True if the library of a target or its whole server is busy
+      [[nodiscard]] bool GetBusy(std::string_view libraryTarget) const;
+
+   private:
+      void Work(std::stop_token stopToken);
+      void Poll();
+
+      // Both return the busy targets of one server or nullopt if the server could not be asked
+      [[nodiscard]] std::optional<std::set<std::string>> GetPlexBusy(const ServerConfig& server, const std::set<std::string>& libraries);
+      [[nodiscard]] std::optional<std::set<std::string>> GetEmbyBusy(const ServerConfig& server);
+
+      // Returns the body of a successful GET or nullopt
+      [[nodiscard]] static std::optional<std::string> Get(const ServerConfig& server,
+                                                          std::string_view path,
+                                                          std::string_view tokenHeader);
+
+      [[nodiscard]] std::shared_ptr<ConfigReader> GetConfigReader();
+      void UpdateUnreachable(const std::string& serverName, bool unreachable);
+
+      std::mutex configLock_;
+      std::shared_ptr<ConfigReader> configReader_;
+      bool configChanged_{false};
+      ChangedFunc changedFunc_;
+
+      mutable std::mutex busyLock_;
+      std::set<std::string, std::less<>> busyTargets_;
+
+      // Only touched by the work thread. Plex section ids mapped to library names per server.
+      std::map<std::string, std::map<std::string, std::string>> plexSections_;
+      std::set<std::string> unreachableServers_;
+
+      std::condition_variable_any workCv_;
+      std::jthread workThread_;
+   };
+}
\ No newline at end of file
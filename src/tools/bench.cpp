@@ -0,0 +1,231 @@
+﻿#include "config-reader/config-reader.h"
+#include "monitor.h"
+#include "types.h"
+#include "version.h"
+
+#include <warp/log/log.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace
+{
+   constexpr std::string_view BENCH_SCAN_NAME("Television Shows 4K");
+   constexpr std::string_view BENCH_SERVER_NAME("bench");
+   constexpr std::string_view BENCH_LIBRARY_NAME("Bench");
+
+   constexpr size_t SEASON_COUNT{4};
+
+   // Nothing is notified during the run so only the event path is measured
+   constexpr int BENCH_SECONDS_BEFORE_NOTIFY{3600};
+   constexpr int BENCH_SECONDS_BETWEEN_NOTIFIES{0};
+
+   // Allocations made by the measured thread while counting is on and by every thread during the run
+   thread_local bool countAllocations{false};
+   thread_local size_t threadAllocations{0};
+   std::atomic<bool> countAllAllocations{false};
+   std::atomic<size_t> allAllocations{0};
+
+   struct BenchSettings
+   {
+      size_t shows{200};
+      size_t filesPerSeason{25};
+      bool emby{false};
+   };
+
+   void PrintUsage()
+   {
+      std::cout << "Usage: remote-scan-bench <directory> [--shows 200] [--files-per-season 25] [--emby]\n"
+                << "  directory  Where the bench scan is rooted. Only its remote-scan-bench folder is created and no files are written.\n"
+                << "  Every file is created then modified twice the way a copy shows up and the events go straight to Monitor::Process.\n"
+                << "  --emby adds an Emby library to the scan so the media index is updated as well.\n"
+                << "  The configuration is read from CONFIG_PATH the same as remote-scan for its extensions and ignore folders.\n";
+   }
+
+   bool ParseOption(int argc, char* argv[], int& i, BenchSettings& settings)
+   {
+      const std::string_view option(argv[i]);
+      if (option == "--emby")
+      {
+         settings.emby = true;
+         return true;
+      }
+
+      if (i + 1 >= argc) return false;
+
+      char* end{nullptr};
+      const auto number = std::strtoul(argv[++i], &end, 10);
+      if (*end != '\0' || number == 0) return false;
+
+      if (option == "--shows") settings.shows = number;
+      else if (option == "--files-per-season") settings.filesPerSeason = number;
+      else return false;
+      return true;
+   }
+}
+
+// Counts the allocations so the cost of an event can be reported. Only replaced in this tool.
+void* operator new(std::size_t size)
+{
+   if (countAllocations) ++threadAllocations;
+   if (countAllAllocations.load(std::memory_order_relaxed)) allAllocations.fetch_add(1, std::memory_order_relaxed);
+   if (void* memory = std::malloc(size == 0 ? 1 : size)) return memory;
+   throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+   return operator new(size);
+}
+
+void operator delete(void* memory) noexcept
+{
+   std::free(memory);
+}
+
+void operator delete[](void* memory) noexcept
+{
+   std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept
+{
+   std::free(memory);
+}
+
+void operator delete[](void* memory, std::size_t) noexcept
+{
+   std::free(memory);
+}
+
+int main(int argc, char* argv[])
+{
+   if (argc < 2)
+   {
+      PrintUsage();
+      return 1;
+   }
+
+   BenchSettings settings;
+   for (int i = 2; i < argc; ++i)
+   {
+      if (!ParseOption(argc, argv, i, settings))
+      {
+         PrintUsage();
+         return 1;
+      }
+   }
+
+   auto baseConfig{std::make_shared<remote_scan::ConfigReader>()};
+   if (!baseConfig->IsConfigValid())
+   {
+      warp::log::Critical("Config file not valid shutting down");
+      return 1;
+   }
+
+   const auto& extensions = baseConfig->GetValidFileExtensions();
+   if (extensions.empty())
+   {
+      warp::log::Critical("No valid_file_extensions configured ... The bench needs one to name media files");
+      return 1;
+   }
+   auto extension = extensions.front().extension;
+   if (!extension.starts_with('.')) extension = "." + extension;
+
+   const auto benchRoot = std::filesystem::absolute(argv[1]) / "remote-scan-bench";
+   std::error_code ec;
+   std::filesystem::create_directories(benchRoot / "media", ec);
+   if (ec)
+   {
+      warp::log::Critical("Unable to create the bench folder {} ... {}", benchRoot.generic_string(), ec.message());
+      return 1;
+   }
+
+   remote_scan::ScanConfig scan;
+   scan.name = BENCH_SCAN_NAME;
+   scan.basePath = benchRoot;
+   scan.pathsFromBase.emplace_back(remote_scan::ScanConfigPath{.path = "media", .mode = {}});
+   scan.groupDepth = 3;
+   if (settings.emby)
+   {
+      scan.embyLibraries.emplace_back(remote_scan::ScanLibraryConfig{.server = std::string(BENCH_SERVER_NAME),
+                                                                     .library = std::string(BENCH_LIBRARY_NAME),
+                                                                     .mediaPath = benchRoot.generic_string()});
+   }
+   auto configReader = baseConfig->CreateWithTimings(BENCH_SECONDS_BEFORE_NOTIFY, BENCH_SECONDS_BETWEEN_NOTIFIES)->CreateWithScans({scan});
+
+   std::vector<std::filesystem::path> files;
+   files.reserve(settings.shows * SEASON_COUNT * settings.filesPerSeason);
+   for (size_t show = 0; show < settings.shows; ++show)
+   {
+      for (size_t season = 1; season <= SEASON_COUNT; ++season)
+      {
+         for (size_t episode = 1; episode <= settings.filesPerSeason; ++episode)
+         {
+            files.emplace_back(benchRoot / "media" / std::format("Show Number {:04}", show) / std::format("Season {:02}", season)
+                               / std::format("Show Number {:04} - S{:02}E{:02} - Episode Title WEBDL-2160p{}", show, season, episode, extension));
+         }
+      }
+   }
+
+   std::vector<std::pair<const std::filesystem::path*, remote_scan::EffectType>> events;
+   events.reserve(files.size() * 3);
+   for (const auto& file : files) events.emplace_back(&file, remote_scan::EffectType::CREATE);
+   for (int modify = 0; modify < 2; ++modify)
+   {
+      for (const auto& file : files) events.emplace_back(&file, remote_scan::EffectType::MODIFY);
+   }
+
+   warp::log::Info("Remote Scan Bench {} Starting ... {} events for {} files", remote_scan::REMOTE_SCAN_VERSION, events.size(), files.size());
+
+   remote_scan::Monitor monitor(configReader, [](const remote_scan::ActiveMonitor&) {});
+   monitor.Run();
+
+   // The watch registry hands over the scan name it subscribed with
+   const auto scanName = remote_scan::InternScanName(BENCH_SCAN_NAME);
+   const auto now = std::chrono::system_clock::now();
+
+   size_t createAllocations{0};
+   size_t processAllocations{0};
+   std::chrono::steady_clock::duration processTime{};
+   countAllAllocations = true;
+   const auto startTime = std::chrono::steady_clock::now();
+   for (const auto& [file, effect] : events)
+   {
+      countAllocations = true;
+      threadAllocations = 0;
+      auto fileMonitor = remote_scan::FileMonitorData::Create(*file, false, effect);
+      fileMonitor.scanName = scanName;
+      createAllocations += threadAllocations;
+
+      threadAllocations = 0;
+      const auto processStart = std::chrono::steady_clock::now();
+      monitor.Process(std::move(fileMonitor), now);
+      processTime += std::chrono::steady_clock::now() - processStart;
+      processAllocations += threadAllocations;
+      countAllocations = false;
+   }
+   const auto elapsed = std::chrono::steady_clock::now() - startTime;
+   countAllAllocations = false;
+
+   monitor.Shutdown();
+
+   const auto count = static_cast<double>(events.size());
+   std::cout << std::format("Events                        {}\n", events.size())
+             << std::format("Events per second             {:.0f}\n", count / std::chrono::duration<double>(elapsed).count())
+             << std::format("Process events per second     {:.0f}\n", count / std::chrono::duration<double>(processTime).count())
+             << std::format("Allocations building an event {:.2f}\n", static_cast<double>(createAllocations) / count)
+             << std::format("Allocations in Process        {:.2f}\n", static_cast<double>(processAllocations) / count)
+             << std::format("Allocations on all threads    {:.2f}\n", static_cast<double>(allAllocations.load()) / count);
+   return 0;
+}
\ No newline at end of file
@@ -0,0 +1,345 @@
+﻿#include "config-reader/config-reader.h"
+#include "monitor.h"
+#include "tools/stub-media-server.h"
+#include "types.h"
+#include "version.h"
+#include "watch-registrar.h"
+#include "watch-registry.h"
+
+#include <warp/log/log.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace
+{
+   using Clock = std::chrono::steady_clock;
+
+   constexpr std::string_view LOAD_SCAN_NAME("load");
+   constexpr std::string_view LOAD_SERVER_NAME("stub");
+   constexpr std::string_view LOAD_LIBRARY_NAME("Load");
+
+   constexpr size_t SHOW_COUNT{20};
+   constexpr size_t SEASON_COUNT{4};
+
+   struct LoadSettings
+   {
+      size_t files{2000};
+      int opsPerSecond{200};
+      int settleSeconds{2};
+      int drainSeconds{60};
+      int latencyMs{0};
+      int failurePercent{0};
+   };
+
+   // Matches the requests the stand-in receives to the files that were written before them
+   class LatencyTracker
+   {
+   public:
+      void AddWrite(const std::filesystem::path& file)
+      {
+         std::scoped_lock lock(lock_);
+         pending_.emplace(file, Clock::now());
+      }
+
+      void RemoveWrite(const std::filesystem::path& file)
+      {
+         std::scoped_lock lock(lock_);
+         pending_.erase(file);
+      }
+
+      // A Plex request names a folder and covers every file below it, an Emby request names the files
+      void AddRequest(const std::vector<std::string>& paths)
+      {
+         const auto now = Clock::now();
+
+         std::scoped_lock lock(lock_);
+         for (const auto& requestPath : paths)
+         {
+            const std::filesystem::path path(requestPath);
+            for (auto iter = pending_.lower_bound(path); iter != pending_.end() && GetBelow(iter->first, path);)
+            {
+               latencies_.emplace_back(std::chrono::duration<double>(now - iter->second).count());
+               iter = pending_.erase(iter);
+            }
+         }
+      }
+
+      [[nodiscard]] size_t GetPendingCount()
+      {
+         std::scoped_lock lock(lock_);
+         return pending_.size();
+      }
+
+      [[nodiscard]] std::vector<double> GetLatencies()
+      {
+         std::scoped_lock lock(lock_);
+         auto latencies = latencies_;
+         std::ranges::sort(latencies);
+         return latencies;
+      }
+
+   private:
+      [[nodiscard]] static bool GetBelow(const std::filesystem::path& file, const std::filesystem::path& folder)
+      {
+         auto [folderEnd, fileIter] = std::mismatch(folder.begin(), folder.end(), file.begin(), file.end());
+         return folderEnd == folder.end();
+      }
+
+      std::mutex lock_;
+
+      // Written files not covered by a request yet. Sorted so the files below a folder are found together.
+      std::map<std::filesystem::path, Clock::time_point> pending_;
+      std::vector<double> latencies_;
+   };
+
+   // Writes new episodes into a show tree and removes some of them again
+   class Churn
+   {
+   public:
+      Churn(std::filesystem::path root, std::string extension, LatencyTracker& tracker)
+         : root_(std::move(root))
+         , extension_(std::move(extension))
+         , tracker_(tracker)
+      {
+      }
+
+      void Step()
+      {
+         // One in four steps removes an episode so the run sends deletes as well as creates
+         if (!files_.empty() && GetRandom(4) == 0)
+         {
+            const auto index = GetRandom(files_.size());
+            std::error_code ec;
+            std::filesystem::remove(files_[index], ec);
+            tracker_.RemoveWrite(files_[index]);
+            files_.erase(files_.begin() + static_cast<std::ptrdiff_t>(index));
+            return;
+         }
+
+         const auto season = root_ / std::format("show-{}", GetRandom(SHOW_COUNT)) / std::format("season-{}", GetRandom(SEASON_COUNT));
+         std::error_code ec;
+         std::filesystem::create_directories(season, ec);
+
+         auto file = season / std::format("episode-{}{}", writeCount_++, extension_);
+         std::ofstream(file) << "remote-scan load " << writeCount_;
+         tracker_.AddWrite(file);
+         files_.emplace_back(std::move(file));
+      }
+
+      [[nodiscard]] size_t GetWriteCount() const { return writeCount_; }
+
+   private:
+      [[nodiscard]] size_t GetRandom(size_t count)
+      {
+         return std::uniform_int_distribution<size_t>(0, count - 1)(random_);
+      }
+
+      std::filesystem::path root_;
+      std::string extension_;
+      LatencyTracker& tracker_;
+      std::vector<std::filesystem::path> files_;
+      std::mt19937_64 random_{std::random_device{}()};
+      size_t writeCount_{0};
+   };
+
+   void UpdateWatches(remote_scan::WatchRegistry& watchRegistry, const std::vector<remote_scan::ScanConfig>& scans)
+   {
+      remote_scan::WatchRegistrar registrar(1, watchRegistry.GetWatchedDirectories(), remote_scan::PollSettings{});
+      watchRegistry.Update(scans, registrar);
+      registrar.Run();
+   }
+
+   void PrintReport(const LoadSettings& settings,
+                    Clock::duration elapsed,
+                    size_t writes,
+                    size_t unmatched,
+                    const std::vector<double>& latencies,
+                    const remote_scan::StubServerCounts& counts,
+                    const std::map<std::string, remote_scan::NotifyServerStatistics>& statistics)
+   {
+      auto getPercentile = [&latencies](size_t percent) {
+         return latencies.empty() ? std::string("-") : std::format("{:.2f}", latencies[(latencies.size() - 1) * percent / 100]);
+      };
+
+      const auto seconds = std::chrono::duration<double>(elapsed).count();
+      const auto requests = counts.plexScans + counts.embyUpdates + counts.embyLibraryScans;
+      std::cout << std::format("writes {} in {:.1f}s ({:.0f}/s) latency:{}ms failures:{}%\n",
+                               writes, seconds, (seconds > 0) ? static_cast<double>(writes) / seconds : 0.0, settings.latencyMs, settings.failurePercent)
+                << std::format("requests plex:{} emby_updates:{} emby_library_scans:{} failed:{} unknown:{}\n",
+                               counts.plexScans, counts.embyUpdates, counts.embyLibraryScans, counts.failed, counts.unknown)
+                << std::format("writes per request {:.1f}\n", (requests > 0) ? static_cast<double>(writes) / static_cast<double>(requests) : 0.0)
+                << std::format("write to request seconds p50:{} p90:{} p99:{} max:{} unmatched:{}\n",
+                               getPercentile(50), getPercentile(90), getPercentile(99), getPercentile(100), unmatched);
+
+      for (const auto& [server, serverStatistics] : statistics)
+      {
+         std::cout << std::format("notify {} requests:{} skipped:{} deduplicated:{}\n",
+                                  server, serverStatistics.requests, serverStatistics.skipped, serverStatistics.deduplicated);
+      }
+   }
+
+   void PrintUsage()
+   {
+      std::cout << "Usage: remote-scan-load <directory> [--files 2000] [--ops-per-second 200] [--settle-seconds 2] [--drain-seconds 60]\n"
+                << "                        [--latency-ms 0] [--failure-percent 0]\n"
+                << "  directory  Where the load tree is created, ideally on tmpfs. Only its remote-scan-load folder is touched.\n"
+                << "  Changes are notified to a local stand-in for Plex and Emby. --latency-ms delays and --failure-percent fails its scan requests.\n"
+                << "  The configuration is read from CONFIG_PATH the same as remote-scan for its extensions and ignore folders.\n";
+   }
+
+   bool ParseOption(std::string_view option, std::string_view value, LoadSettings& settings)
+   {
+      char* end{nullptr};
+      const std::string text(value);
+      const auto number = std::strtol(text.c_str(), &end, 10);
+      if (text.empty() || *end != '\0' || number < 0) return false;
+
+      const auto count = static_cast<int>(number);
+      if (option == "--files") settings.files = static_cast<size_t>(number);
+      else if (option == "--ops-per-second") settings.opsPerSecond = std::max(count, 1);
+      else if (option == "--settle-seconds") settings.settleSeconds = count;
+      else if (option == "--drain-seconds") settings.drainSeconds = count;
+      else if (option == "--latency-ms") settings.latencyMs = count;
+      else if (option == "--failure-percent") settings.failurePercent = std::min(count, 100);
+      else return false;
+      return true;
+   }
+}
+
+int main(int argc, char* argv[])
+{
+   if (argc < 2)
+   {
+      PrintUsage();
+      return 1;
+   }
+
+   LoadSettings settings;
+   for (int i = 2; i < argc; i += 2)
+   {
+      if (i + 1 >= argc || !ParseOption(argv[i], argv[i + 1], settings))
+      {
+         PrintUsage();
+         return 1;
+      }
+   }
+
+   auto baseConfig{std::make_shared<remote_scan::ConfigReader>()};
+   if (!baseConfig->IsConfigValid())
+   {
+      warp::log::Critical("Config file not valid shutting down");
+      return 1;
+   }
+
+   const auto& extensions = baseConfig->GetValidFileExtensions();
+   if (extensions.empty())
+   {
+      warp::log::Critical("No valid_file_extensions configured ... The load needs one to create media files");
+      return 1;
+   }
+   auto extension = extensions.front().extension;
+   if (!extension.starts_with('.')) extension = "." + extension;
+
+   const auto loadRoot = std::filesystem::absolute(argv[1]) / "remote-scan-load";
+   std::error_code ec;
+   std::filesystem::remove_all(loadRoot, ec);
+   std::filesystem::create_directories(loadRoot / "media", ec);
+   if (ec)
+   {
+      warp::log::Critical("Unable to create the load tree {} ... {}", loadRoot.generic_string(), ec.message());
+      return 1;
+   }
+
+   LatencyTracker tracker;
+   remote_scan::StubMediaServer stubServer(remote_scan::StubServerSettings{.plexLibrary = std::string(LOAD_LIBRARY_NAME),
+                                                                           .embyLibrary = std::string(LOAD_LIBRARY_NAME),
+                                                                           .latency = std::chrono::milliseconds(settings.latencyMs),
+                                                                           .failurePercent = settings.failurePercent},
+                                           [&tracker](remote_scan::StubRequestType, const std::vector<std::string>& paths) { tracker.AddRequest(paths); });
+   if (!stubServer.Start())
+   {
+      warp::log::Critical("Unable to start the stand-in media server");
+      return 1;
+   }
+
+   // The library sees the tree at the same path so requests can be matched to the files written
+   const remote_scan::ScanLibraryConfig library{.server = std::string(LOAD_SERVER_NAME),
+                                                .library = std::string(LOAD_LIBRARY_NAME),
+                                                .mediaPath = loadRoot.generic_string()};
+   remote_scan::ScanConfig scan;
+   scan.name = LOAD_SCAN_NAME;
+   scan.plexLibraries.emplace_back(library);
+   scan.embyLibraries.emplace_back(library);
+   scan.basePath = loadRoot;
+   scan.pathsFromBase.emplace_back(remote_scan::ScanConfigPath{.path = "media", .mode = {}});
+   scan.groupDepth = 2;
+   const std::vector<remote_scan::ScanConfig> scans{scan};
+
+   const remote_scan::ServerConfig server{.name = std::string(LOAD_SERVER_NAME), .url = stubServer.GetUrl(), .apiKey = "remote-scan-load", .maxConcurrentRequests = 0};
+   auto configReader = baseConfig->CreateWithTimings(settings.settleSeconds, 0)
+                          ->CreateWithScans(scans)
+                          ->CreateWithServers({server}, {server});
+
+   warp::log::Info("Remote Scan Load {} Starting ... {} files in {} notified to {}",
+                   remote_scan::REMOTE_SCAN_VERSION, settings.files, loadRoot.generic_string(), stubServer.GetUrl());
+
+   remote_scan::Monitor monitor(configReader);
+   auto processEvent = [&monitor](remote_scan::FileMonitorData&& data) {
+      monitor.Process(std::move(data));
+   };
+   remote_scan::WatchRegistry watchRegistry(processEvent);
+   UpdateWatches(watchRegistry, scans);
+   monitor.Connect();
+   monitor.Run();
+
+   Churn churn(loadRoot / "media", extension, tracker);
+
+   const auto startTime = Clock::now();
+   const auto opInterval = std::chrono::duration_cast<Clock::duration>(std::chrono::seconds(1)) / settings.opsPerSecond;
+   auto nextOp = startTime;
+   while (churn.GetWriteCount() < settings.files)
+   {
+      std::this_thread::sleep_until(nextOp);
+      nextOp += opInterval;
+      churn.Step();
+   }
+   const auto writeTime = Clock::now() - startTime;
+
+   // Every write is covered by a request once the last groups settle unless requests failed
+   const auto drainEnd = Clock::now() + std::chrono::seconds(settings.drainSeconds);
+   while (tracker.GetPendingCount() > 0 && Clock::now() < drainEnd)
+   {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+   }
+
+   const auto unmatched = tracker.GetPendingCount();
+   PrintReport(settings, writeTime, churn.GetWriteCount(), unmatched, tracker.GetLatencies(), stubServer.GetCounts(), monitor.GetNotifyStatistics());
+
+   watchRegistry.Shutdown();
+   monitor.Shutdown();
+   stubServer.Shutdown();
+   std::filesystem::remove_all(loadRoot, ec);
+
+   if (unmatched > 0 && settings.failurePercent == 0)
+   {
+      warp::log::Error("Load failed ... {} written files were never sent to a media server", unmatched);
+      return 1;
+   }
+
+   return 0;
+}
\ No newline at end of file
@@ -0,0 +1,163 @@
+﻿#include "config-reader/config-reader.h"
+#include "monitor.h"
+#include "trace.h"
+#include "types.h"
+#include "version.h"
+
+#include <warp/log/log.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <format>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <thread>
+
+namespace
+{
+   using Clock = std::chrono::system_clock;
+
+   // Stands in for the media server notify and records what would have been sent
+   class RecordingNotify
+   {
+   public:
+      explicit RecordingNotify(const Clock::time_point& virtualNow)
+         : virtualNow_(virtualNow)
+      {
+      }
+
+      void Record(const remote_scan::ActiveMonitor& monitor)
+      {
+         ++notifyCount_;
+         pathCount_ += monitor.paths.size();
+
+         std::cout << std::format("[{:>10.3f}s] notify {} {} paths:{} settled:{:.3f}s\n",
+                                  GetSeconds(virtualNow_ - startTime_),
+                                  monitor.scanName,
+                                  remote_scan::GetPriorityName(monitor.priority),
+                                  monitor.paths.size(),
+                                  GetSeconds(virtualNow_ - monitor.time));
+      }
+
+      void SetStartTime(Clock::time_point startTime) { startTime_ = startTime; }
+
+      [[nodiscard]] size_t GetNotifyCount() const { return notifyCount_; }
+      [[nodiscard]] size_t GetPathCount() const { return pathCount_; }
+
+      [[nodiscard]] static double GetSeconds(Clock::duration duration)
+      {
+         return std::chrono::duration<double>(duration).count();
+      }
+
+   private:
+      const Clock::time_point& virtualNow_;
+      Clock::time_point startTime_;
+      size_t notifyCount_{0};
+      size_t pathCount_{0};
+   };
+
+   void PrintUsage()
+   {
+      std::cout << "Usage: remote-scan-replay <trace-file> [speed]\n"
+                << "  speed  Replay speed multiplier (1 = real time) or 'max' to run on the virtual clock only. Default: max\n"
+                << "  The configuration is read from CONFIG_PATH the same as remote-scan\n";
+   }
+}
+
+int main(int argc, char* argv[])
+{
+   if (argc < 2)
+   {
+      PrintUsage();
+      return 1;
+   }
+
+   // A speed of zero replays as fast as possible
+   double speed{0.0};
+   if (argc > 2 && std::string_view(argv[2]) != "max")
+   {
+      speed = std::strtod(argv[2], nullptr);
+      if (speed <= 0.0)
+      {
+         PrintUsage();
+         return 1;
+      }
+   }
+
+   auto configReader{std::make_shared<remote_scan::ConfigReader>()};
+   if (!configReader->IsConfigValid())
+   {
+      warp::log::Critical("Config file not valid shutting down");
+      return 1;
+   }
+
+   remote_scan::TraceReader reader(argv[1]);
+   if (!reader.GetValid())
+   {
+      return 1;
+   }
+
+   warp::log::Info("Remote Scan Replay {} Starting", remote_scan::REMOTE_SCAN_VERSION);
+
+   Clock::time_point virtualNow;
+   RecordingNotify recorder(virtualNow);
+   remote_scan::Monitor monitor(configReader, [&recorder](const remote_scan::ActiveMonitor& activeMonitor) { recorder.Record(activeMonitor); });
+
+   std::optional<Clock::time_point> traceStart;
+   const auto wallStart{std::chrono::steady_clock::now()};
+
+   // Hold the replay back so the trace plays out at the requested speed
+   auto pace = [&](Clock::time_point time) {
+      if (speed > 0.0 && traceStart)
+      {
+         auto offset = std::chrono::duration_cast<std::chrono::steady_clock::duration>((time - *traceStart) / speed);
+         std::this_thread::sleep_until(wallStart + offset);
+      }
+   };
+
+   // Notify everything that is ready up to the supplied time on the virtual clock
+   auto notifyUntil = [&](std::optional<Clock::time_point> until) {
+      while (auto wakeTime = monitor.GetNextWakeTime())
+      {
+         if (until && *wakeTime > *until) break;
+
+         pace(*wakeTime);
+         virtualNow = std::max(virtualNow, *wakeTime);
+         if (!monitor.NotifyReady(virtualNow)) break;
+      }
+   };
+
+   size_t eventCount{0};
+   while (auto record = reader.Next())
+   {
+      if (!traceStart)
+      {
+         traceStart = record->time;
+         virtualNow = record->time;
+         recorder.SetStartTime(record->time);
+      }
+
+      notifyUntil(record->time);
+
+      pace(record->time);
+      virtualNow = std::max(virtualNow, record->time);
+      monitor.Process(record->GetFileMonitorData(), virtualNow);
+      ++eventCount;
+   }
+
+   // Let everything still pending settle and notify
+   notifyUntil(std::nullopt);
+
+   auto wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+   std::cout << std::format("Replayed {} events over {:.3f}s of trace time in {:.3f}s ({:.0f} events/s)\n",
+                            eventCount,
+                            traceStart ? RecordingNotify::GetSeconds(virtualNow - *traceStart) : 0.0,
+                            wallSeconds,
+                            wallSeconds > 0.0 ? static_cast<double>(eventCount) / wallSeconds : 0.0);
+   std::cout << std::format("Notifications: {} Paths notified: {}\n", recorder.GetNotifyCount(), recorder.GetPathCount());
+
+   return 0;
+}
\ No newline at end of file
@@ -0,0 +1,484 @@
+﻿#include "config-reader/config-reader.h"
+#include "monitor.h"
+#include "tools/stub-media-server.h"
+#include "types.h"
+#include "version.h"
+#include "watch-registrar.h"
+#include "watch-registry.h"
+
+#include <warp/log/log.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace
+{
+   constexpr std::string_view SOAK_SCAN_NAME("soak");
+   constexpr std::string_view SOAK_SERVER_NAME("stub");
+   constexpr std::string_view SOAK_LIBRARY_NAME("Soak");
+
+   // Percentile of the event to notify latency that is sampled
+   constexpr size_t LATENCY_PERCENT{99};
+
+   // The tree is kept around this size so growth can only come from remote-scan itself
+   constexpr size_t MAX_FILES{500};
+   constexpr size_t SHOW_COUNT{10};
+   constexpr size_t SEASON_COUNT{4};
+
+   // Short timings so changes are notified many times during the soak
+   constexpr int SOAK_SECONDS_BEFORE_NOTIFY{2};
+   constexpr int SOAK_SECONDS_BETWEEN_NOTIFIES{0};
+
+   struct SoakSettings
+   {
+      double hours{4.0};
+      int sampleSeconds{60};
+      int warmupMinutes{10};
+      int rewatchMinutes{10};
+      int opsPerSecond{50};
+      size_t maxRssGrowthMb{64};
+      size_t maxFdGrowth{16};
+      size_t maxThreadGrowth{4};
+      size_t maxPendingGrowth{100};
+      double maxLatencyGrowth{30.0};
+   };
+
+   struct ProcessSample
+   {
+      size_t rssKb{0};
+      size_t fds{0};
+      size_t threads{0};
+      size_t pending{0};
+
+      // p99 seconds from the first change of a group to its notify over the notifies the statistics keep
+      std::optional<double> latency;
+   };
+
+   // Scan requests the stand-in media server answered
+   size_t GetRequestCount(remote_scan::StubMediaServer& stubServer)
+   {
+      const auto counts = stubServer.GetCounts();
+      return counts.plexScans + counts.embyUpdates + counts.embyLibraryScans;
+   }
+
+   // Creates, renames and deletes files and directories below the soak root
+   class Workload
+   {
+   public:
+      Workload(std::filesystem::path root, std::string extension)
+         : root_(std::move(root))
+         , extension_(std::move(extension))
+      {
+      }
+
+      void Step()
+      {
+         if (files_.empty() || refresh_) Refresh();
+
+         const auto roll = GetRandom(100);
+         if (files_.size() < MAX_FILES && roll < 40)
+         {
+            AddFile();
+         }
+         else if (files_.empty())
+         {
+            return;
+         }
+         else if (roll < 55)
+         {
+            RenameFile();
+         }
+         else if (roll < 88)
+         {
+            RemoveFile();
+         }
+         else if (roll < 96)
+         {
+            RenameSeason();
+         }
+         else
+         {
+            DeleteShow();
+         }
+      }
+
+      [[nodiscard]] size_t GetOperationCount() const { return operationCount_; }
+
+   private:
+      [[nodiscard]] size_t GetRandom(size_t count)
+      {
+         return std::uniform_int_distribution<size_t>(0, count - 1)(random_);
+      }
+
+      [[nodiscard]] std::filesystem::path GetRandomSeason()
+      {
+         return root_ / std::format("show-{}", GetRandom(SHOW_COUNT)) / std::format("season-{}", GetRandom(SEASON_COUNT));
+      }
+
+      [[nodiscard]] size_t TakeRandomFile()
+      {
+         return GetRandom(files_.size());
+      }
+
+      // Directory operations move or remove files this does not track one by one
+      void Refresh()
+      {
+         refresh_ = false;
+         files_.clear();
+
+         std::error_code ec;
+         for (auto iter = std::filesystem::recursive_directory_iterator(root_, ec); !ec && iter != std::filesystem::recursive_directory_iterator(); iter.increment(ec))
+         {
+            if (iter->is_regular_file(ec)) files_.emplace_back(iter->path());
+         }
+      }
+
+      void AddFile()
+      {
+         const auto season = GetRandomSeason();
+         std::error_code ec;
+         std::filesystem::create_directories(season, ec);
+
+         auto file = season / std::format("episode-{}{}", nextId_++, extension_);
+         std::ofstream(file) << "remote-scan soak " << operationCount_;
+         files_.emplace_back(std::move(file));
+         ++operationCount_;
+      }
+
+      void RenameFile()
+      {
+         auto& file = files_[TakeRandomFile()];
+         auto newFile = file.parent_path() / std::format("episode-{}{}", nextId_++, extension_);
+
+         std::error_code ec;
+         std::filesystem::rename(file, newFile, ec);
+         if (!ec) file = std::move(newFile);
+         ++operationCount_;
+      }
+
+      void RemoveFile()
+      {
+         const auto index = TakeRandomFile();
+         std::error_code ec;
+         std::filesystem::remove(files_[index], ec);
+         files_.erase(files_.begin() + static_cast<std::ptrdiff_t>(index));
+         ++operationCount_;
+      }
+
+      void RenameSeason()
+      {
+         const auto season = files_[TakeRandomFile()].parent_path();
+         std::error_code ec;
+         std::filesystem::rename(season, season.parent_path() / std::format("season-{}", SEASON_COUNT + nextId_++), ec);
+         refresh_ = true;
+         ++operationCount_;
+      }
+
+      void DeleteShow()
+      {
+         const auto show = files_[TakeRandomFile()].parent_path().parent_path();
+         std::error_code ec;
+         std::filesystem::remove_all(show, ec);
+         refresh_ = true;
+         ++operationCount_;
+      }
+
+      std::filesystem::path root_;
+      std::string extension_;
+      std::vector<std::filesystem::path> files_;
+      std::mt19937_64 random_{std::random_device{}()};
+      size_t nextId_{0};
+      size_t operationCount_{0};
+      bool refresh_{false};
+   };
+
+#ifdef __linux__
+   // Reads a numeric field such as VmRSS or Threads from /proc/self/status
+   size_t ReadStatusField(std::string_view field)
+   {
+      std::ifstream status("/proc/self/status");
+      std::string line;
+      while (std::getline(status, line))
+      {
+         if (!line.starts_with(field) || line.size() <= field.size() || line[field.size()] != ':') continue;
+         return std::strtoull(line.c_str() + field.size() + 1, nullptr, 10);
+      }
+      return 0;
+   }
+
+   size_t CountOpenFiles()
+   {
+      std::error_code ec;
+      size_t count{0};
+      for (auto iter = std::filesystem::directory_iterator("/proc/self/fd", ec); !ec && iter != std::filesystem::directory_iterator(); iter.increment(ec))
+      {
+         ++count;
+      }
+      return count;
+   }
+#endif
+
+   ProcessSample TakeSample(remote_scan::Monitor& monitor)
+   {
+      ProcessSample sample;
+#ifdef __linux__
+      sample.rssKb = ReadStatusField("VmRSS");
+      sample.threads = ReadStatusField("Threads");
+      sample.fds = CountOpenFiles();
+#endif
+      sample.pending = monitor.GetPending().size();
+      if (auto latency = monitor.GetNotifyLatency(LATENCY_PERCENT)) sample.latency = std::chrono::duration<double>(*latency).count();
+      return sample;
+   }
+
+   // Returns a description of the first growth past its threshold or nullopt if the sample is within bounds
+   std::optional<std::string> GetGrowthFailure(const SoakSettings& settings, const ProcessSample& baseline, const ProcessSample& sample)
+   {
+      auto growth = [](size_t base, size_t value) { return (value > base) ? value - base : 0; };
+
+      if (growth(baseline.rssKb, sample.rssKb) > settings.maxRssGrowthMb * 1024)
+      {
+         return std::format("RSS grew from {}KB to {}KB", baseline.rssKb, sample.rssKb);
+      }
+      if (growth(baseline.fds, sample.fds) > settings.maxFdGrowth)
+      {
+         return std::format("Open files grew from {} to {}", baseline.fds, sample.fds);
+      }
+      if (growth(baseline.threads, sample.threads) > settings.maxThreadGrowth)
+      {
+         return std::format("Threads grew from {} to {}", baseline.threads, sample.threads);
+      }
+      if (growth(baseline.pending, sample.pending) > settings.maxPendingGrowth)
+      {
+         return std::format("Pending groups grew from {} to {}", baseline.pending, sample.pending);
+      }
+      if (baseline.latency && sample.latency && *sample.latency - *baseline.latency > settings.maxLatencyGrowth)
+      {
+         return std::format("p99 notify latency grew from {:.1f}s to {:.1f}s", *baseline.latency, *sample.latency);
+      }
+      return std::nullopt;
+   }
+
+   void PrintSample(std::chrono::steady_clock::duration elapsed, const ProcessSample& sample, size_t operations, size_t requests)
+   {
+      std::cout << std::format("{:>8.0f} {:>9} {:>5} {:>7} {:>7} {:>8} {:>10} {:>9}\n",
+                               std::chrono::duration<double>(elapsed).count(),
+                               sample.rssKb,
+                               sample.fds,
+                               sample.threads,
+                               sample.pending,
+                               sample.latency ? std::format("{:.1f}", *sample.latency) : std::string("-"),
+                               operations,
+                               requests);
+   }
+
+   void UpdateWatches(remote_scan::WatchRegistry& watchRegistry, const std::vector<remote_scan::ScanConfig>& scans)
+   {
+      remote_scan::WatchRegistrar registrar(1, watchRegistry.GetWatchedDirectories(), remote_scan::PollSettings{});
+      watchRegistry.Update(scans, registrar);
+      registrar.Run();
+   }
+
+   void PrintUsage()
+   {
+      std::cout << "Usage: remote-scan-soak <directory> [--hours 4] [--ops-per-second 50] [--sample-seconds 60] [--warmup-minutes 10]\n"
+                << "                        [--rewatch-minutes 10] [--max-rss-growth-mb 64] [--max-fd-growth 16] [--max-thread-growth 4]\n"
+                << "                        [--max-pending-growth 100] [--max-latency-growth 30]\n"
+                << "  directory  Where the soak tree is created, ideally on tmpfs. Only its remote-scan-soak folder is touched.\n"
+                << "  Growth is measured against the first sample after the warmup. The first growth past a limit fails the soak.\n"
+                << "  The configuration is read from CONFIG_PATH the same as remote-scan for its extensions and ignore folders.\n";
+   }
+
+   bool ParseOption(std::string_view option, std::string_view value, SoakSettings& settings)
+   {
+      char* end{nullptr};
+      const std::string text(value);
+      const auto number = std::strtod(text.c_str(), &end);
+      if (text.empty() || *end != '\0' || number < 0) return false;
+
+      const auto count = static_cast<size_t>(number);
+      if (option == "--hours") settings.hours = number;
+      else if (option == "--ops-per-second") settings.opsPerSecond = std::max(static_cast<int>(number), 1);
+      else if (option == "--sample-seconds") settings.sampleSeconds = std::max(static_cast<int>(number), 1);
+      else if (option == "--warmup-minutes") settings.warmupMinutes = static_cast<int>(number);
+      else if (option == "--rewatch-minutes") settings.rewatchMinutes = static_cast<int>(number);
+      else if (option == "--max-rss-growth-mb") settings.maxRssGrowthMb = count;
+      else if (option == "--max-fd-growth") settings.maxFdGrowth = count;
+      else if (option == "--max-thread-growth") settings.maxThreadGrowth = count;
+      else if (option == "--max-pending-growth") settings.maxPendingGrowth = count;
+      else if (option == "--max-latency-growth") settings.maxLatencyGrowth = number;
+      else return false;
+      return true;
+   }
+}
+
+int main(int argc, char* argv[])
+{
+   if (argc < 2)
+   {
+      PrintUsage();
+      return 1;
+   }
+
+   SoakSettings settings;
+   for (int i = 2; i < argc; i += 2)
+   {
+      if (i + 1 >= argc || !ParseOption(argv[i], argv[i + 1], settings))
+      {
+         PrintUsage();
+         return 1;
+      }
+   }
+
+   auto baseConfig{std::make_shared<remote_scan::ConfigReader>()};
+   if (!baseConfig->IsConfigValid())
+   {
+      warp::log::Critical("Config file not valid shutting down");
+      return 1;
+   }
+
+   const auto& extensions = baseConfig->GetValidFileExtensions();
+   if (extensions.empty())
+   {
+      warp::log::Critical("No valid_file_extensions configured ... The soak needs one to create media files");
+      return 1;
+   }
+   auto extension = extensions.front().extension;
+   if (!extension.starts_with('.')) extension = "." + extension;
+
+   const auto soakRoot = std::filesystem::absolute(argv[1]) / "remote-scan-soak";
+   std::error_code ec;
+   std::filesystem::remove_all(soakRoot, ec);
+   std::filesystem::create_directories(soakRoot / "media", ec);
+   if (ec)
+   {
+      warp::log::Critical("Unable to create the soak tree {} ... {}", soakRoot.generic_string(), ec.message());
+      return 1;
+   }
+
+   // Notifies go through the real Notify and media server APIs to a local stand-in that answers every request
+   remote_scan::StubMediaServer stubServer(remote_scan::StubServerSettings{.plexLibrary = std::string(SOAK_LIBRARY_NAME),
+                                                                           .embyLibrary = std::string(SOAK_LIBRARY_NAME),
+                                                                           .latency = std::chrono::milliseconds(0),
+                                                                           .failurePercent = 0},
+                                           nullptr);
+   if (!stubServer.Start())
+   {
+      warp::log::Critical("Unable to start the stand-in media server");
+      return 1;
+   }
+
+   const remote_scan::ScanLibraryConfig library{.server = std::string(SOAK_SERVER_NAME),
+                                                .library = std::string(SOAK_LIBRARY_NAME),
+                                                .mediaPath = soakRoot.generic_string()};
+   remote_scan::ScanConfig scan;
+   scan.name = SOAK_SCAN_NAME;
+   scan.plexLibraries.emplace_back(library);
+   scan.embyLibraries.emplace_back(library);
+   scan.basePath = soakRoot;
+   scan.pathsFromBase.emplace_back(remote_scan::ScanConfigPath{.path = "media", .mode = {}});
+   scan.groupDepth = 2;
+   const std::vector<remote_scan::ScanConfig> scans{scan};
+
+   const remote_scan::ServerConfig server{.name = std::string(SOAK_SERVER_NAME), .url = stubServer.GetUrl(), .apiKey = "remote-scan-soak", .maxConcurrentRequests = 0};
+   auto configReader = baseConfig->CreateWithTimings(SOAK_SECONDS_BEFORE_NOTIFY, SOAK_SECONDS_BETWEEN_NOTIFIES)
+                          ->CreateWithScans(scans)
+                          ->CreateWithServers({server}, {server});
+
+   warp::log::Info("Remote Scan Soak {} Starting ... {:.1f} hours in {}", remote_scan::REMOTE_SCAN_VERSION, settings.hours, soakRoot.generic_string());
+
+   remote_scan::Monitor monitor(configReader);
+   auto processEvent = [&monitor](remote_scan::FileMonitorData&& data) {
+      monitor.Process(std::move(data));
+   };
+   remote_scan::WatchRegistry watchRegistry(processEvent);
+   UpdateWatches(watchRegistry, scans);
+   monitor.Connect();
+   monitor.Run();
+
+   Workload workload(soakRoot / "media", extension);
+
+   const auto startTime = std::chrono::steady_clock::now();
+   const auto endTime = startTime + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::ratio<3600>>(settings.hours));
+   const auto warmupTime = startTime + std::chrono::minutes(settings.warmupMinutes);
+   const auto sampleInterval = std::chrono::seconds(settings.sampleSeconds);
+   const auto opInterval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::seconds(1)) / settings.opsPerSecond;
+
+   std::cout << std::format("{:>8} {:>9} {:>5} {:>7} {:>7} {:>8} {:>10} {:>9}\n",
+                            "elapsed", "rss_kb", "fds", "threads", "pending", "p99s", "operations", "requests");
+
+   std::optional<ProcessSample> baseline;
+   std::optional<std::string> failure;
+   auto nextSample = startTime + sampleInterval;
+   auto nextRewatch = startTime + std::chrono::minutes(settings.rewatchMinutes);
+   auto nextOp = startTime;
+   while (!failure && std::chrono::steady_clock::now() < endTime)
+   {
+      std::this_thread::sleep_until(nextOp);
+      nextOp += opInterval;
+      workload.Step();
+
+      const auto now = std::chrono::steady_clock::now();
+
+      // Dropping and adding the watch again exercises the whole watch lifecycle
+      if (settings.rewatchMinutes > 0 && now >= nextRewatch)
+      {
+         UpdateWatches(watchRegistry, {});
+         UpdateWatches(watchRegistry, scans);
+         nextRewatch = now + std::chrono::minutes(settings.rewatchMinutes);
+      }
+
+      if (now < nextSample) continue;
+      nextSample = now + sampleInterval;
+
+      auto sample = TakeSample(monitor);
+      PrintSample(now - startTime, sample, workload.GetOperationCount(), GetRequestCount(stubServer));
+
+      // Caches and thread pools fill up during the warmup so growth is only counted after it
+      if (now < warmupTime) continue;
+      if (!baseline)
+      {
+         baseline = sample;
+      }
+      else
+      {
+         // A quiet window keeps the baseline latency so a later spike is still compared to it
+         if (!baseline->latency) baseline->latency = sample.latency;
+         failure = GetGrowthFailure(settings, *baseline, sample);
+      }
+   }
+
+   watchRegistry.Shutdown();
+   monitor.Shutdown();
+   const auto requests = GetRequestCount(stubServer);
+   const auto unknown = stubServer.GetCounts().unknown;
+   stubServer.Shutdown();
+   std::filesystem::remove_all(soakRoot, ec);
+
+   if (failure)
+   {
+      warp::log::Error("Soak failed ... {}", *failure);
+      return 1;
+   }
+
+   if (unknown > 0)
+   {
+      warp::log::Warning("Stand-in media server got {} requests it has no reply for", unknown);
+   }
+
+   warp::log::Info("Soak passed ... {} operations and {} media server requests", workload.GetOperationCount(), requests);
+   return 0;
+}
\ No newline at end of file
@@ -0,0 +1,204 @@
+﻿#include "tools/stub-media-server.h"
+
+#include <warp/log/log.h>
+
+#include <glaze/glaze.hpp>
+#include <httplib.h>
+
+#include <format>
+#include <string_view>
+#include <utility>
+
+namespace remote_scan
+{
+   namespace
+   {
+      constexpr std::string_view STUB_ADDRESS("127.0.0.1");
+      constexpr std::string_view STUB_LIBRARY_ID("1");
+      constexpr std::string_view JSON_TYPE("application/json");
+
+      struct EmbyUpdatePath
+      {
+         std::string path;
+
+         struct glaze
+         {
+            static constexpr auto value = glz::object(
+               "Path", &EmbyUpdatePath::path
+            );
+         };
+      };
+
+      struct EmbyMediaUpdated
+      {
+         std::vector<EmbyUpdatePath> updates;
+
+         struct glaze
+         {
+            static constexpr auto value = glz::object(
+               "Updates", &EmbyMediaUpdated::updates
+            );
+         };
+      };
+
+      // Library names come from the tool so only quotes and backslashes need escaping
+      std::string GetJsonString(std::string_view value)
+      {
+         std::string json("\"");
+         for (auto c : value)
+         {
+            if (c == '"' || c == '\\') json += '\\';
+            json += c;
+         }
+         json += '"';
+         return json;
+      }
+   }
+
+   StubMediaServer::StubMediaServer(StubServerSettings settings, RequestFunc requestFunc)
+      : settings_(std::move(settings))
+      , requestFunc_(std::move(requestFunc))
+   {
+   }
+
+   StubMediaServer::~StubMediaServer()
+   {
+      Shutdown();
+   }
+
+   bool StubMediaServer::Start()
+   {
+      server_ = std::make_unique<httplib::Server>();
+
+      auto reply = [](std::string body) {
+         return [body = std::move(body)](const httplib::Request&, httplib::Response& response) {
+            response.set_content(body, std::string(JSON_TYPE));
+         };
+      };
+
+      // Plex
+      server_->Get("/identity", reply(R"({"MediaContainer":{"size":0,"machineIdentifier":"remote-scan-stub","version":"1.40.0.0"}})"));
+      server_->Get("/", reply(R"({"MediaContainer":{"size":0,"friendlyName":"remote-scan-stub","machineIdentifier":"remote-scan-stub","version":"1.40.0.0"}})"));
+      server_->Get("/library/sections", reply(std::format(R"({{"MediaContainer":{{"size":1,"Directory":[{{"key":"{}","title":{},"type":"show"}}]}}}})",
+                                                          STUB_LIBRARY_ID,
+                                                          GetJsonString(settings_.plexLibrary))));
+      server_->Get("/activities", reply(R"({"MediaContainer":{"size":0}})"));
+      server_->Get(R"(/library/sections/\w+/refresh)", [this](const httplib::Request& request, httplib::Response& response) {
+         response.status = this->HandleScan(StubRequestType::PLEX_SCAN, {request.get_param_value("path")}) ? 200 : 500;
+      });
+
+      // Emby
+      const std::string embyInfo(R"({"ServerName":"remote-scan-stub","Version":"4.8.0.0","Id":"remote-scan-stub"})");
+      server_->Get("/emby/System/Info", reply(embyInfo));
+      server_->Get("/emby/System/Info/Public", reply(embyInfo));
+      server_->Get("/emby/Library/VirtualFolders", reply(std::format(R"([{{"Name":{},"ItemId":"{}","Id":"{}","Locations":[]}}])",
+                                                                     GetJsonString(settings_.embyLibrary),
+                                                                     STUB_LIBRARY_ID,
+                                                                     STUB_LIBRARY_ID)));
+      server_->Get("/emby/Library/SelectableMediaFolders", reply(std::format(R"([{{"Name":{},"Id":"{}","SubFolders":[]}}])",
+                                                                             GetJsonString(settings_.embyLibrary),
+                                                                             STUB_LIBRARY_ID)));
+      server_->Get("/emby/ScheduledTasks", reply("[]"));
+      server_->Post("/emby/Library/Media/Updated", [this](const httplib::Request& request, httplib::Response& response) {
+         EmbyMediaUpdated updated;
+         if (glz::read<glz::opts{.error_on_unknown_keys = false}>(updated, request.body))
+         {
+            response.status = 400;
+            return;
+         }
+
+         std::vector<std::string> paths;
+         paths.reserve(updated.updates.size());
+         for (auto& update : updated.updates)
+         {
+            paths.emplace_back(std::move(update.path));
+         }
+         response.status = this->HandleScan(StubRequestType::EMBY_UPDATE, paths) ? 204 : 500;
+      });
+      auto libraryScan = [this](const httplib::Request&, httplib::Response& response) {
+         response.status = this->HandleScan(StubRequestType::EMBY_LIBRARY_SCAN, {}) ? 204 : 500;
+      };
+      server_->Post(R"(/emby/Items/\w+/Refresh)", libraryScan);
+      server_->Post("/emby/Library/Refresh", libraryScan);
+
+      // Anything else succeeds empty so a new warp call shows up in the counts instead of failing the run
+      auto unknown = [this](const httplib::Request& request, httplib::Response& response) {
+         {
+            std::scoped_lock lock(lock_);
+            ++counts_.unknown;
+         }
+         warp::log::Warning("Stub media server has no reply for {} ... Answered with an empty object", request.path);
+         response.set_content("{}", std::string(JSON_TYPE));
+      };
+      server_->Get(".*", unknown);
+      server_->Post(".*", unknown);
+      server_->Put(".*", unknown);
+
+      port_ = server_->bind_to_any_port(std::string(STUB_ADDRESS));
+      if (port_ <= 0)
+      {
+         warp::log::Error("Stub media server could not bind a port on {}", STUB_ADDRESS);
+         server_.reset();
+         return false;
+      }
+
+      workThread_ = std::jthread([this] {
+         server_->listen_after_bind();
+      });
+
+      return true;
+   }
+
+   void StubMediaServer::Shutdown()
+   {
+      if (server_) server_->stop();
+
+      if (workThread_.joinable())
+      {
+         workThread_.join();
+      }
+
+      server_.reset();
+   }
+
+   std::string StubMediaServer::GetUrl() const
+   {
+      return std::format("http://{}:{}", STUB_ADDRESS, port_);
+   }
+
+   StubServerCounts StubMediaServer::GetCounts()
+   {
+      std::scoped_lock lock(lock_);
+      return counts_;
+   }
+
+   bool StubMediaServer::HandleScan(StubRequestType type, const std::vector<std::string>& paths)
+   {
+      if (settings_.latency.count() > 0) std::this_thread::sleep_for(settings_.latency);
+
+      {
+         std::scoped_lock lock(lock_);
+         if (settings_.failurePercent > 0 && std::uniform_int_distribution<int>(0, 99)(random_) < settings_.failurePercent)
+         {
+            ++counts_.failed;
+            return false;
+         }
+
+         switch (type)
+         {
+            case StubRequestType::PLEX_SCAN:
+               ++counts_.plexScans;
+               break;
+            case StubRequestType::EMBY_UPDATE:
+               ++counts_.embyUpdates;
+               break;
+            default:
+               ++counts_.embyLibraryScans;
+               break;
+         }
+      }
+
+      if (requestFunc_) requestFunc_(type, paths);
+      return true;
+   }
+}
\ No newline at end of file
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace httplib
+{
+   class Server;
+}
+
+namespace remote_scan
+{
+   struct StubServerSettings
+   {
+      // The one library each server reports
+      std::string plexLibrary;
+      std::string embyLibrary;
+
+      // Added to every scan request and the share of them answered with a server error
+      std::chrono::milliseconds latency{0};
+      int failurePercent{0};
+   };
+
+   enum class StubRequestType
+   {
+      PLEX_SCAN,
+      EMBY_UPDATE,
+      EMBY_LIBRARY_SCAN
+   };
+
+   struct StubServerCounts
+   {
+      uint64_t plexScans{0};
+      uint64_t embyUpdates{0};
+      uint64_t embyLibraryScans{0};
+      uint64_t failed{0};
+
+      // Requests to endpoints the stand-in does not know. Points at a warp call that needs a canned reply.
+      uint64_t unknown{0};
+   };
+
+   // Local HTTP stand-in for the Plex and Emby endpoints Notify and ServerActivity call. Used by the developer tools
+   // to send real requests without a media server. Both servers share one port, Emby below /emby like the real one.
+   class StubMediaServer
+   {
+   public:
+      // Called with the paths of every scan request that was answered successfully
+      using RequestFunc = std::function<void(StubRequestType type, const std::vector<std::string>& paths)>;
+
+      StubMediaServer(StubServerSettings settings, RequestFunc requestFunc);
+      virtual ~StubMediaServer();
+
+      StubMediaServer(const StubMediaServer&) = delete;
+      StubMediaServer& operator=(const StubMediaServer&) = delete;
+
+      // Listens on a free loopback port. Returns false if no port could be bound.
+      bool Start();
+      void Shutdown();
+
+      [[nodiscard]] std::string GetUrl() const;
+      [[nodiscard]] StubServerCounts GetCounts();
+
+   private:
+      // Waits out the latency and returns false if the request should fail
+      [[nodiscard]] bool HandleScan(StubRequestType type, const std::vector<std::string>& paths);
+
+      StubServerSettings settings_;
+      RequestFunc requestFunc_;
+      int port_{0};
+
+      std::mutex lock_;
+      StubServerCounts counts_;
+      std::mt19937 random_{std::random_device{}()};
+
+      std::unique_ptr<httplib::Server> server_;
+      std::jthread workThread_;
+   };
+}
\ No newline at end of file
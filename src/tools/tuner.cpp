@@ -0,0 +1,277 @@
+﻿#include "config-reader/config-reader.h"
+#include "monitor.h"
+#include "trace.h"
+#include "types.h"
+#include "version.h"
+
+#include <warp/log/log.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <format>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace
+{
+   using Clock = std::chrono::system_clock;
+
+   // What one pair of settle and throttle settings would have sent over the trace
+   struct TuneResult
+   {
+      int secondsBeforeNotify{0};
+      int secondsBetweenNotifies{0};
+      size_t notifyCount{0};
+      size_t requestCount{0};
+      size_t fullScanCount{0};
+      std::map<std::string, size_t> serverRequests;
+
+      // Seconds from the first event of a notified group to its notify
+      std::vector<double> latencies;
+   };
+
+   // Counts the requests the media server notify would make without contacting any server.
+   // Plex gets one scan per folder left after dropping nested folders. Emby gets one batch of
+   // file updates or a full library scan when a folder is pending since folders cannot be expanded offline.
+   class SimulatedNotify
+   {
+   public:
+      SimulatedNotify(const remote_scan::RemoteScanConfig& config, const Clock::time_point& virtualNow, TuneResult& result)
+         : config_(config)
+         , virtualNow_(virtualNow)
+         , result_(result)
+      {
+      }
+
+      void Record(const remote_scan::ActiveMonitor& monitor)
+      {
+         auto scanIter = std::ranges::find(config_.scans, monitor.scanName, &remote_scan::ScanConfig::name);
+         if (scanIter == config_.scans.end()) return;
+
+         ++result_.notifyCount;
+         result_.latencies.emplace_back(std::chrono::duration<double>(virtualNow_ - monitor.firstTime).count());
+
+         std::set<std::pair<std::string_view, std::string_view>> plexNotified;
+         for (const auto& library : scanIter->plexLibraries)
+         {
+            if (!plexNotified.emplace(library.server, library.library).second) continue;
+            AddRequests(std::format("plex({})", library.server), GetPlexFolderCount(monitor));
+         }
+
+         std::set<std::pair<std::string_view, std::string_view>> embyNotified;
+         for (const auto& library : scanIter->embyLibraries)
+         {
+            if (!embyNotified.emplace(library.server, library.library).second) continue;
+
+            if (std::ranges::any_of(monitor.paths, [](const auto& path) { return path.fileName.empty(); })) ++result_.fullScanCount;
+            AddRequests(std::format("emby({})", library.server), 1);
+         }
+      }
+
+   private:
+      void AddRequests(const std::string& server, size_t count)
+      {
+         result_.serverRequests[server] += count;
+         result_.requestCount += count;
+      }
+
+      [[nodiscard]] static size_t GetPlexFolderCount(const remote_scan::ActiveMonitor& monitor)
+      {
+         // Removed folders are scanned through their parent the same as the live notify does
+         std::vector<std::filesystem::path> folders;
+         for (const auto& path : monitor.paths)
+         {
+            const auto removedFolder = path.fileName.empty() && path.effect == remote_scan::EffectType::DESTROY;
+            folders.emplace_back(removedFolder ? path.path.parent_path() : path.path);
+            if (!path.movedFrom.empty()) folders.emplace_back(path.movedFrom.parent_path());
+         }
+
+         std::ranges::sort(folders);
+         auto [newEnd, _] = std::ranges::unique(folders);
+         folders.erase(newEnd, folders.end());
+
+         std::vector<std::filesystem::path> kept;
+         for (const auto& folder : folders)
+         {
+            auto isChild = std::ranges::any_of(kept, [&folder](const auto& parent) {
+               auto [parentEnd, folderIter] = std::mismatch(parent.begin(), parent.end(), folder.begin(), folder.end());
+               return parentEnd == parent.end();
+            });
+            if (!isChild) kept.emplace_back(folder);
+         }
+         return kept.size();
+      }
+
+      const remote_scan::RemoteScanConfig& config_;
+      const Clock::time_point& virtualNow_;
+      TuneResult& result_;
+   };
+
+   TuneResult RunSetting(const remote_scan::ConfigReader& baseConfig,
+                         const std::vector<remote_scan::TraceRecord>& records,
+                         int secondsBeforeNotify,
+                         int secondsBetweenNotifies)
+   {
+      TuneResult result;
+      result.secondsBeforeNotify = secondsBeforeNotify;
+      result.secondsBetweenNotifies = secondsBetweenNotifies;
+
+      auto configReader = baseConfig.CreateWithTimings(secondsBeforeNotify, secondsBetweenNotifies);
+
+      Clock::time_point virtualNow;
+      SimulatedNotify notify(configReader->GetRemoteScanConfig(), virtualNow, result);
+      remote_scan::Monitor monitor(configReader, [&notify](const remote_scan::ActiveMonitor& activeMonitor) { notify.Record(activeMonitor); });
+
+      // Notify everything that is ready up to the supplied time on the virtual clock
+      auto notifyUntil = [&](std::optional<Clock::time_point> until) {
+         while (auto wakeTime = monitor.GetNextWakeTime())
+         {
+            if (until && *wakeTime > *until) break;
+
+            virtualNow = std::max(virtualNow, *wakeTime);
+            if (!monitor.NotifyReady(virtualNow)) break;
+         }
+      };
+
+      if (!records.empty()) virtualNow = records.front().time;
+      for (const auto& record : records)
+      {
+         notifyUntil(record.time);
+
+         virtualNow = std::max(virtualNow, record.time);
+         monitor.Process(record.GetFileMonitorData(), virtualNow);
+      }
+
+      notifyUntil(std::nullopt);
+      monitor.Shutdown();
+      return result;
+   }
+
+   std::optional<std::vector<int>> ParseList(std::string_view value)
+   {
+      std::vector<int> values;
+      while (!value.empty())
+      {
+         auto comma = value.find(',');
+         auto item = std::string(value.substr(0, comma));
+         value = (comma == std::string_view::npos) ? std::string_view() : value.substr(comma + 1);
+
+         char* end{nullptr};
+         auto number = std::strtol(item.c_str(), &end, 10);
+         if (item.empty() || *end != '\0' || number < 0) return std::nullopt;
+         values.emplace_back(static_cast<int>(number));
+      }
+
+      if (values.empty()) return std::nullopt;
+      return values;
+   }
+
+   std::string GetPercentile(std::vector<double>& samples, size_t percent)
+   {
+      if (samples.empty()) return "-";
+      return std::format("{:.1f}", samples[(samples.size() - 1) * percent / 100]);
+   }
+
+   void PrintResult(TuneResult& result)
+   {
+      std::ranges::sort(result.latencies);
+      std::cout << std::format("{:>7} {:>9} {:>9} {:>9} {:>11} {:>8} {:>8} {:>8} {:>8}\n",
+                               result.secondsBeforeNotify,
+                               result.secondsBetweenNotifies,
+                               result.notifyCount,
+                               result.requestCount,
+                               result.fullScanCount,
+                               GetPercentile(result.latencies, 50),
+                               GetPercentile(result.latencies, 90),
+                               GetPercentile(result.latencies, 99),
+                               result.latencies.empty() ? std::string("-") : std::format("{:.1f}", result.latencies.back()));
+
+      for (const auto& [server, requests] : result.serverRequests)
+      {
+         std::cout << std::format("{:>17} {} requests:{}\n", "", server, requests);
+      }
+   }
+
+   void PrintUsage()
+   {
+      std::cout << "Usage: remote-scan-tuner <trace-file> [--settle 30,60,90] [--throttle 0,15,30]\n"
+                << "  --settle    seconds_before_notify values to try. Default: 30,60,90,120,180\n"
+                << "  --throttle  seconds_between_notifies values to try. Default: 0,5,15,30,60\n"
+                << "  The configuration is read from CONFIG_PATH the same as remote-scan. Priority class overrides still apply.\n";
+   }
+}
+
+int main(int argc, char* argv[])
+{
+   if (argc < 2)
+   {
+      PrintUsage();
+      return 1;
+   }
+
+   std::vector<int> settleValues{30, 60, 90, 120, 180};
+   std::vector<int> throttleValues{0, 5, 15, 30, 60};
+   for (int i = 2; i < argc; i += 2)
+   {
+      const std::string_view option(argv[i]);
+      auto values = (i + 1 < argc) ? ParseList(argv[i + 1]) : std::nullopt;
+      if (!values || (option != "--settle" && option != "--throttle"))
+      {
+         PrintUsage();
+         return 1;
+      }
+
+      (option == "--settle" ? settleValues : throttleValues) = std::move(*values);
+   }
+
+   auto configReader{std::make_shared<remote_scan::ConfigReader>()};
+   if (!configReader->IsConfigValid())
+   {
+      warp::log::Critical("Config file not valid shutting down");
+      return 1;
+   }
+
+   remote_scan::TraceReader reader(argv[1]);
+   if (!reader.GetValid())
+   {
+      return 1;
+   }
+
+   warp::log::Info("Remote Scan Tuner {} Starting", remote_scan::REMOTE_SCAN_VERSION);
+
+   // The trace is read once and replayed for every setting
+   std::vector<remote_scan::TraceRecord> records;
+   while (auto record = reader.Next())
+   {
+      records.emplace_back(std::move(*record));
+   }
+
+   const auto traceSeconds = records.empty() ? 0.0 : std::chrono::duration<double>(records.back().time - records.front().time).count();
+   std::cout << std::format("Trace holds {} events over {:.0f}s\n", records.size(), traceSeconds);
+
+   std::vector<TuneResult> results;
+   for (auto settle : settleValues)
+   {
+      for (auto throttle : throttleValues)
+      {
+         results.emplace_back(RunSetting(*configReader, records, settle, throttle));
+      }
+   }
+
+   std::cout << std::format("{:>7} {:>9} {:>9} {:>9} {:>11} {:>8} {:>8} {:>8} {:>8}\n",
+                            "settle", "throttle", "notifies", "requests", "full_scans", "p50s", "p90s", "p99s", "maxs");
+   for (auto& result : results)
+   {
+      PrintResult(result);
+   }
+
+   return 0;
+}
\ No newline at end of file
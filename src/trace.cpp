@@ -0,0 +1,224 @@
+﻿#include "trace.h"
+
+#include <warp/log/log.h>
+
+#include <algorithm>
+#include <array>
+
+namespace remote_scan
+{
+   namespace
+   {
+      constexpr std::array<char, 8> TRACE_MAGIC{'R', 'S', 'T', 'R', 'A', 'C', 'E', '1'};
+      constexpr uint8_t EFFECT_MASK{0x07};
+      constexpr uint8_t DIRECTORY_FLAG{0x08};
+      constexpr uint8_t MOVED_FLAG{0x10};
+      constexpr auto FLUSH_INTERVAL{std::chrono::seconds(1)};
+
+      // Guards against reading garbage lengths from a corrupt trace
+      constexpr uint64_t MAX_STRING_LENGTH{64 * 1024};
+   }
+
+   FileMonitorData TraceRecord::GetFileMonitorData() const
+   {
+      return FileMonitorData{
+         .scanName = scanName,
+         .path = path,
+         .filename = filename,
+         .isDirectory = isDirectory,
+         .effect = effect,
+         .movedFrom = movedFrom
+      };
+   }
+
+   void TraceEncoder::WriteVarInt(std::ostream& output, uint64_t value)
+   {
+      while (value >= 0x80)
+      {
+         output.put(static_cast<char>((value & 0x7F) | 0x80));
+         value >>= 7;
+      }
+      output.put(static_cast<char>(value));
+   }
+
+   void TraceEncoder::WriteString(std::ostream& output, std::string_view value)
+   {
+      WriteVarInt(output, value.size());
+      output.write(value.data(), static_cast<std::streamsize>(value.size()));
+   }
+
+   void TraceEncoder::Encode(std::ostream& output, const FileMonitorData& fileMonitor, std::chrono::system_clock::time_point time)
+   {
+      // The system clock can step backwards so never record a negative delta
+      auto delta = std::chrono::duration_cast<std::chrono::microseconds>(time - lastTime_).count();
+      WriteVarInt(output, delta > 0 ? static_cast<uint64_t>(delta) : 0);
+      if (delta > 0) lastTime_ += std::chrono::microseconds(delta);
+
+      uint8_t flags = static_cast<uint8_t>(fileMonitor.effect) & EFFECT_MASK;
+      if (fileMonitor.isDirectory) flags |= DIRECTORY_FLAG;
+      if (!fileMonitor.movedFrom.empty()) flags |= MOVED_FLAG;
+      output.put(static_cast<char>(flags));
+
+      auto scanIter = std::ranges::find(scanNames_, fileMonitor.scanName);
+      WriteVarInt(output, static_cast<uint64_t>(std::distance(scanNames_.begin(), scanIter)));
+      if (scanIter == scanNames_.end())
+      {
+         WriteString(output, fileMonitor.scanName);
+         scanNames_.emplace_back(fileMonitor.scanName);
+      }
+
+      // Events arrive in bursts from the same folders so only store what changed from the previous path
+      auto path = fileMonitor.path.generic_string();
+      auto [lastIter, pathIter] = std::ranges::mismatch(lastPath_, path);
+      auto sharedLength = static_cast<uint64_t>(std::distance(path.begin(), pathIter));
+      WriteVarInt(output, sharedLength);
+      WriteString(output, std::string_view(path).substr(sharedLength));
+      lastPath_ = std::move(path);
+
+      WriteString(output, fileMonitor.filename.generic_string());
+      if (!fileMonitor.movedFrom.empty()) WriteString(output, fileMonitor.movedFrom.generic_string());
+   }
+
+   std::optional<uint64_t> TraceDecoder::ReadVarInt(std::istream& input)
+   {
+      uint64_t value{0};
+      for (int shift = 0; shift < 64; shift += 7)
+      {
+         auto byte = input.get();
+         if (byte == std::char_traits<char>::eof()) return std::nullopt;
+
+         value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+         if ((byte & 0x80) == 0) return value;
+      }
+      return std::nullopt;
+   }
+
+   std::optional<std::string> TraceDecoder::ReadString(std::istream& input)
+   {
+      auto length = ReadVarInt(input);
+      if (!length || *length > MAX_STRING_LENGTH) return std::nullopt;
+
+      std::string value(*length, '\0');
+      if (!input.read(value.data(), static_cast<std::streamsize>(*length))) return std::nullopt;
+      return value;
+   }
+
+   std::optional<TraceRecord> TraceDecoder::Decode(std::istream& input)
+   {
+      auto delta = ReadVarInt(input);
+      if (!delta) return std::nullopt;
+
+      auto flags = input.get();
+      if (flags == std::char_traits<char>::eof()) return std::nullopt;
+
+      auto scanIndex = ReadVarInt(input);
+      if (!scanIndex || *scanIndex > scanNames_.size()) return std::nullopt;
+      if (*scanIndex == scanNames_.size())
+      {
+         auto scanName = ReadString(input);
+         if (!scanName) return std::nullopt;
+         scanNames_.emplace_back(std::move(*scanName));
+      }
+
+      auto sharedLength = ReadVarInt(input);
+      if (!sharedLength || *sharedLength > lastPath_.size()) return std::nullopt;
+      auto pathSuffix = ReadString(input);
+      if (!pathSuffix) return std::nullopt;
+      lastPath_.resize(*sharedLength);
+      lastPath_ += *pathSuffix;
+
+      auto filename = ReadString(input);
+      if (!filename) return std::nullopt;
+
+      // Only directory moves carry their old location
+      std::optional<std::string> movedFrom;
+      if ((flags & MOVED_FLAG) != 0)
+      {
+         movedFrom = ReadString(input);
+         if (!movedFrom) return std::nullopt;
+      }
+
+      lastTime_ += std::chrono::microseconds(*delta);
+
+      return TraceRecord{
+         .time = lastTime_,
+         .scanName = scanNames_[*scanIndex],
+         .path = lastPath_,
+         .filename = std::move(*filename),
+         .isDirectory = (flags & DIRECTORY_FLAG) != 0,
+         .effect = static_cast<EffectType>(flags & EFFECT_MASK),
+         .movedFrom = movedFrom ? std::filesystem::path(std::move(*movedFrom)) : std::filesystem::path()
+      };
+   }
+
+   TraceWriter::TraceWriter(const std::filesystem::path& traceFile)
+      : file_(traceFile, std::ios::out | std::ios::binary | std::ios::trunc)
+   {
+      if (file_.is_open())
+      {
+         file_.write(TRACE_MAGIC.data(), TRACE_MAGIC.size());
+         warp::log::Info("Recording file monitor trace to {}", traceFile.generic_string());
+      }
+      else
+      {
+         warp::log::Error("Unable to open trace file {}", traceFile.generic_string());
+      }
+   }
+
+   TraceWriter::~TraceWriter()
+   {
+      if (file_.is_open())
+      {
+         file_.flush();
+      }
+   }
+
+   bool TraceWriter::GetValid() const
+   {
+      return file_.is_open();
+   }
+
+   void TraceWriter::Record(const FileMonitorData& fileMonitor)
+   {
+      Record(fileMonitor, std::chrono::system_clock::now());
+   }
+
+   void TraceWriter::Record(const FileMonitorData& fileMonitor, std::chrono::system_clock::time_point time)
+   {
+      std::scoped_lock lock(writeLock_);
+      if (!file_.is_open()) return;
+
+      encoder_.Encode(file_, fileMonitor, time);
+
+      if (time - lastFlushTime_ >= FLUSH_INTERVAL)
+      {
+         file_.flush();
+         lastFlushTime_ = time;
+      }
+   }
+
+   TraceReader::TraceReader(const std::filesystem::path& traceFile)
+      : file_(traceFile, std::ios::in | std::ios::binary)
+   {
+      std::array<char, TRACE_MAGIC.size()> magic{};
+      if (file_.is_open() && file_.read(magic.data(), magic.size()) && magic == TRACE_MAGIC)
+      {
+         valid_ = true;
+      }
+      else
+      {
+         warp::log::Error("{} is not a valid trace file", traceFile.generic_string());
+      }
+   }
+
+   bool TraceReader::GetValid() const
+   {
+      return valid_;
+   }
+
+   std::optional<TraceRecord> TraceReader::Next()
+   {
+      if (!valid_) return std::nullopt;
+      return decoder_.Decode(file_);
+   }
+}
\ No newline at end of file
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "types.h"
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <istream>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace remote_scan
+{
+   // A single recorded file monitor event owning all of its data
+   struct TraceRecord
+   {
+      std::chrono::system_clock::time_point time;
+      std::string scanName;
+      std::filesystem::path path;
+      std::filesystem::path filename;
+      bool isDirectory{false};
+      EffectType effect{EffectType::MODIFY};
+      std::filesystem::path movedFrom;
+
+      [[nodiscard]] FileMonitorData GetFileMonitorData() const;
+   };
+
+   // Encodes file monitor events in the trace record format.
+   // Each record stores a microsecond time delta, the scan name as an index into a
+   // table of names written on first use and the path as a suffix of the previous path.
+   // Directory moves also store their old location. Records only decode with a decoder
+   // that has seen every earlier record of the same stream.
+   class TraceEncoder
+   {
+   public:
+      void Encode(std::ostream& output, const FileMonitorData& fileMonitor, std::chrono::system_clock::time_point time);
+
+   private:
+      static void WriteVarInt(std::ostream& output, uint64_t value);
+      static void WriteString(std::ostream& output, std::string_view value);
+
+      std::chrono::system_clock::time_point lastTime_;
+      std::vector<std::string> scanNames_;
+      std::string lastPath_;
+   };
+
+   // Decodes the records written by a TraceEncoder
+   class TraceDecoder
+   {
+   public:
+      // Returns the next record or nullopt at the end of the input or on a corrupt record
+      [[nodiscard]] std::optional<TraceRecord> Decode(std::istream& input);
+
+   private:
+      [[nodiscard]] static std::optional<uint64_t> ReadVarInt(std::istream& input);
+      [[nodiscard]] static std::optional<std::string> ReadString(std::istream& input);
+
+      std::chrono::system_clock::time_point lastTime_;
+      std::vector<std::string> scanNames_;
+      std::string lastPath_;
+   };
+
+   // Records the normalized file monitor stream to a compact binary trace file
+   class TraceWriter
+   {
+   public:
+      explicit TraceWriter(const std::filesystem::path& traceFile);
+      virtual ~TraceWriter();
+
+      TraceWriter(const TraceWriter&) = delete;
+      TraceWriter& operator=(const TraceWriter&) = delete;
+
+      [[nodiscard]] bool GetValid() const;
+
+      void Record(const FileMonitorData& fileMonitor);
+      void Record(const FileMonitorData& fileMonitor, std::chrono::system_clock::time_point time);
+
+   private:
+      std::mutex writeLock_;
+      std::ofstream file_;
+      TraceEncoder encoder_;
+      std::chrono::system_clock::time_point lastFlushTime_;
+   };
+
+   // Reads back a trace file created by the TraceWriter
+   class TraceReader
+   {
+   public:
+      explicit TraceReader(const std::filesystem::path& traceFile);
+      virtual ~TraceReader() = default;
+
+      TraceReader(const TraceReader&) = delete;
+      TraceReader& operator=(const TraceReader&) = delete;
+
+      [[nodiscard]] bool GetValid() const;
+
+      // Returns the next record in the trace or nullopt at the end of the file or on a corrupt record
+      [[nodiscard]] std::optional<TraceRecord> Next();
+
+   private:
+      bool valid_{false};
+      std::ifstream file_;
+      TraceDecoder decoder_;
+   };
+}
\ No newline at end of file
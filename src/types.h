@@ -2,10 +2,17 @@
 
 #include <warp/log/log-types.h>
 
+#include <algorithm>
 #include <chrono>
 #include <filesystem>
 #include <format>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <set>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
 namespace remote_scan
@@ -21,6 +28,105 @@ namespace remote_scan
       DESTROY
    };
 
+   inline std::string_view GetEffectName(EffectType effect)
+   {
+      switch (effect)
+      {
+         case EffectType::RENAME: return "Rename";
+         case EffectType::CREATE: return "Create";
+         case EffectType::DESTROY: return "Delete";
+         default: return "Modify";
+      }
+   }
+
+   // Pending work is published most urgent first. New media is what users are waiting for,
+   // deletes keep libraries clean and artwork or nfo changes can wait the longest.
+   enum class MonitorPriority
+   {
+      MEDIA,
+      DELETION,
+      METADATA
+   };
+
+   constexpr size_t MONITOR_PRIORITY_COUNT{3};
+
+   inline std::string_view GetPriorityName(MonitorPriority priority)
+   {
+      switch (priority)
+      {
+         case MonitorPriority::MEDIA: return "media";
+         case MonitorPriority::DELETION: return "delete";
+         default: return "metadata";
+      }
+   }
+
+   // Plex and Emby are notified by workers of their own so a slow server of one type does not hold back the other.
+   // All notifies every server in one go, for notify functions and scans without servers.
+   enum class NotifyTarget
+   {
+      ALL,
+      PLEX,
+      EMBY
+   };
+
+   inline std::string_view GetNotifyTargetName(NotifyTarget target)
+   {
+      switch (target)
+      {
+         case NotifyTarget::PLEX: return "plex";
+         case NotifyTarget::EMBY: return "emby";
+         default: return "all";
+      }
+   }
+
+   // Event storms first collapse pending paths to their top level folders and then to a scan of the whole scan paths
+   enum class StormMode
+   {
+      NONE,
+      FOLDERS,
+      LIBRARY
+   };
+
+   // Configured paths are compared with event paths so they must not carry trailing separators or dot segments
+   inline std::filesystem::path NormalizePath(const std::filesystem::path& path)
+   {
+      auto normalPath = path.lexically_normal();
+      if (!normalPath.has_filename() && normalPath.has_relative_path()) normalPath = normalPath.parent_path();
+      return normalPath;
+   }
+
+   // Listeners given only a port stay on the local machine unless a host is set explicitly
+   inline const std::string DEFAULT_LISTEN_HOST{"127.0.0.1"};
+
+   inline bool GetIsLoopbackHost(std::string_view host)
+   {
+      return host == "localhost" || host == "::1" || host.starts_with("127.");
+   }
+
+   // Splits a host:port address. The host may be empty or an IPv6 address in brackets.
+   inline std::optional<std::pair<std::string, std::string>> SplitHostPort(std::string_view address)
+   {
+      const auto colon = address.rfind(':');
+      if (colon == std::string_view::npos || colon + 1 == address.size()) return std::nullopt;
+
+      auto host = address.substr(0, colon);
+      if (host.size() >= 2 && host.front() == '[' && host.back() == ']') host = host.substr(1, host.size() - 2);
+      return std::make_pair(std::string(host), std::string(address.substr(colon + 1)));
+   }
+
+   // Returns a view of the scan name that stays valid for the life of the process. Monitors and log entries
+   // hold these views instead of copies. Names are only added when the configuration is loaded so the set stays small.
+   inline std::string_view InternScanName(std::string_view scanName)
+   {
+      static std::mutex internLock;
+      static std::set<std::string, std::less<>> scanNames;
+
+      std::scoped_lock lock(internLock);
+      auto iter = scanNames.find(scanName);
+      if (iter == scanNames.end()) iter = scanNames.emplace(scanName).first;
+      return *iter;
+   }
+
    struct FileMonitorData
    {
       std::string_view scanName;
@@ -28,6 +134,23 @@ namespace remote_scan
       std::filesystem::path filename;
       bool isDirectory;
       EffectType effect;
+
+      // Old location of a directory moved within the scan. Set on RENAME events only.
+      std::filesystem::path movedFrom;
+
+      // Builds the event for a changed path the way the watchers report it. A file is split into its directory and name,
+      // which costs the path copies of both. The scan name is filled in by the caller.
+      [[nodiscard]] static FileMonitorData Create(const std::filesystem::path& path, bool isDirectory, EffectType effect)
+      {
+         return FileMonitorData{
+            .scanName = {},
+            .path = isDirectory ? path : path.parent_path(),
+            .filename = isDirectory ? std::filesystem::path() : path.filename(),
+            .isDirectory = isDirectory,
+            .effect = effect,
+            .movedFrom = {}
+         };
+      }
    };
 
    struct ActiveMonitorPath
@@ -35,14 +158,51 @@ namespace remote_scan
       std::filesystem::path path;
       std::filesystem::path fileName;
       EffectType effect{};
-      std::filesystem::path displayFullPath;
+
+      // Time of the last event for this path. The path is stable once this is older than the settle time.
+      std::chrono::system_clock::time_point time;
+
+      // Media files below a created or removed directory so Emby can update them instead of scanning the library
+      std::optional<std::vector<std::filesystem::path>> expandedFiles;
+
+      // Old location of a moved directory. The move is notified as the removal of the old
+      // location and the creation of the new one in a single batch.
+      std::filesystem::path movedFrom;
    };
 
    struct ActiveMonitor
    {
-      std::string scanName;
+      // Interned with InternScanName
+      std::string_view scanName;
+      MonitorPriority priority{MonitorPriority::MEDIA};
+
+      // Folder the paths were grouped under or empty when the whole scan settles together
+      std::filesystem::path groupPath;
+      std::chrono::system_clock::time_point firstTime;
       std::chrono::system_clock::time_point time;
       std::vector<ActiveMonitorPath> paths;
-      std::filesystem::path lastPath;
+
+      // Index of the path touched by the last event used to debounce repeated modifies
+      size_t lastPathIndex{0};
+
+      // Set from the control socket to notify without waiting for the settle and throttle times
+      bool flush{false};
+
+      // Holds files a download manager reported as finished. Notified without waiting for the settle time.
+      bool settled{false};
+
+      // Event rate tracking for storm detection
+      StormMode stormMode{StormMode::NONE};
+      std::chrono::system_clock::time_point rateWindowStart;
+      size_t rateWindowEvents{0};
    };
+
+   // Moves the paths of another monitor of the same scan into the monitor so they go out in one request
+   inline void MergeMonitor(ActiveMonitor& monitor, ActiveMonitor& other)
+   {
+      monitor.flush = monitor.flush || other.flush;
+      monitor.firstTime = std::min(monitor.firstTime, other.firstTime);
+      monitor.time = std::max(monitor.time, other.time);
+      std::ranges::move(other.paths, std::back_inserter(monitor.paths));
+   }
 }
\ No newline at end of file
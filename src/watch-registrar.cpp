@@ -0,0 +1,516 @@
+﻿#include "watch-registrar.h"
+
+#include <warp/log/log.h>
+#include <warp/log/log-utils.h>
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <format>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#ifdef __linux__
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#endif
+
+namespace remote_scan
+{
+   namespace
+   {
+      // Part of the kernel limit is left for other processes and for directories created after startup
+      constexpr size_t INOTIFY_RESERVE_PERCENT{10};
+
+      // Surveying walks every root before the watches walk it again so it only runs once this much of the budget is in use
+      constexpr size_t SURVEY_THRESHOLD_PERCENT{75};
+
+      // The watches have finished walking their trees once the count stops changing for this long
+      constexpr auto WATCH_COUNT_STABLE_TIME{std::chrono::seconds(2)};
+      constexpr auto WATCH_COUNT_INTERVAL{std::chrono::milliseconds(250)};
+
+      // A single root adds its watches steadily while it walks so it is waited on for a shorter time
+      constexpr auto ROOT_WATCH_COUNT_STABLE_TIME{std::chrono::seconds(1)};
+
+      // Device and inode of a watched directory as inotify lists them in fdinfo
+      struct WatchedInode
+      {
+         unsigned long long device{0};
+         unsigned long long inode{0};
+
+         bool operator==(const WatchedInode&) const = default;
+      };
+
+      struct InotifyInstance
+      {
+         std::filesystem::path fdInfo;
+         size_t watches{0};
+
+         // The directory with the lowest watch descriptor is the one the watch was started on
+         std::optional<WatchedInode> root;
+      };
+
+      // Reads the hexadecimal value following a field such as " ino:" in an fdinfo line
+      std::optional<unsigned long long> GetFdInfoField(std::string_view line, std::string_view field)
+      {
+         const auto position = line.find(field);
+         if (position == std::string_view::npos) return std::nullopt;
+
+         const auto value = line.substr(position + field.size());
+         unsigned long long result{0};
+         if (std::from_chars(value.data(), value.data() + value.size(), result, 16).ec != std::errc()) return std::nullopt;
+         return result;
+      }
+
+      void ReadInotifyInstance(InotifyInstance& instance)
+      {
+         instance.watches = 0;
+         instance.root.reset();
+
+         std::optional<unsigned long long> rootWd;
+         std::ifstream fdInfo(instance.fdInfo);
+         std::string line;
+         while (std::getline(fdInfo, line))
+         {
+            if (!line.starts_with("inotify wd:")) continue;
+
+            ++instance.watches;
+            const auto wd = GetFdInfoField(line, "wd:");
+            if (!wd || (rootWd && *wd >= *rootWd)) continue;
+
+            rootWd = wd;
+            instance.root = WatchedInode{.device = GetFdInfoField(line, " sdev:").value_or(0), .inode = GetFdInfoField(line, " ino:").value_or(0)};
+         }
+      }
+
+      std::vector<InotifyInstance> GetInotifyInstances()
+      {
+         std::vector<InotifyInstance> instances;
+         std::error_code ec;
+         for (auto iter = std::filesystem::directory_iterator("/proc/self/fd", ec); !ec && iter != std::filesystem::directory_iterator(); iter.increment(ec))
+         {
+            std::error_code linkEc;
+            if (std::filesystem::read_symlink(iter->path(), linkEc) != "anon_inode:inotify") continue;
+
+            auto& instance = instances.emplace_back();
+            instance.fdInfo = std::filesystem::path("/proc/self/fdinfo") / iter->path().filename();
+            ReadInotifyInstance(instance);
+         }
+         return instances;
+      }
+
+      std::optional<WatchedInode> GetWatchedInode(const std::filesystem::path& path)
+      {
+#ifdef __linux__
+         struct stat result{};
+         if (stat(path.c_str(), &result) != 0) return std::nullopt;
+
+         // fdinfo prints the kernel device number, which keeps the minor number in its low 20 bits
+         return WatchedInode{.device = (static_cast<unsigned long long>(major(result.st_dev)) << 20) | minor(result.st_dev),
+                             .inode = result.st_ino};
+#else
+         return std::nullopt;
+#endif
+      }
+
+      size_t GetInotifyBudget(size_t limit)
+      {
+         return limit - (limit * INOTIFY_RESERVE_PERCENT / 100);
+      }
+
+      std::string GetCountText(size_t count, bool counted)
+      {
+         return counted ? std::to_string(count) : std::string("-");
+      }
+   }
+
+   WatchRegistrar::WatchRegistrar(size_t workerCount, size_t watchesInUse, const PollSettings& pollSettings)
+      : workerCount_(std::max<size_t>(workerCount, 1))
+      , watchesInUse_(watchesInUse)
+      , pollSettings_(pollSettings)
+   {
+   }
+
+   void WatchRegistrar::Add(std::string_view scanName, const std::filesystem::path& path, RegisterFunc registerFunc)
+   {
+      auto& registration = registrations_.emplace_back();
+      registration.scanName = scanName;
+      registration.path = path;
+      registration.registerFunc = std::move(registerFunc);
+   }
+
+   void WatchRegistrar::AddPolled(std::string_view scanName, const std::filesystem::path& path, RegisterFunc registerFunc)
+   {
+      Add(scanName, path, std::move(registerFunc));
+      registrations_.back().poll = true;
+   }
+
+   std::optional<size_t> WatchRegistrar::GetInotifyWatchLimit()
+   {
+      std::ifstream file("/proc/sys/fs/inotify/max_user_watches");
+      size_t limit{0};
+      if (file >> limit && limit > 0) return limit;
+      return std::nullopt;
+   }
+
+   std::optional<size_t> WatchRegistrar::GetInotifyWatchCount()
+   {
+      std::error_code ec;
+      auto iter = std::filesystem::directory_iterator("/proc/self/fd", ec);
+      if (ec) return std::nullopt;
+
+      // Every inotify instance lists one line per watch in its fdinfo
+      size_t count{0};
+      for (; !ec && iter != std::filesystem::directory_iterator(); iter.increment(ec))
+      {
+         std::error_code linkEc;
+         if (std::filesystem::read_symlink(iter->path(), linkEc) != "anon_inode:inotify") continue;
+
+         std::ifstream fdInfo(std::filesystem::path("/proc/self/fdinfo") / iter->path().filename());
+         std::string line;
+         while (std::getline(fdInfo, line))
+         {
+            if (line.starts_with("inotify wd:")) ++count;
+         }
+      }
+      return count;
+   }
+
+   std::optional<size_t> WatchRegistrar::WaitForInotifyWatches(size_t budget)
+   {
+      auto count = GetInotifyWatchCount();
+      auto stableSince = std::chrono::steady_clock::now();
+      while (count && *count <= budget && std::chrono::steady_clock::now() - stableSince < WATCH_COUNT_STABLE_TIME)
+      {
+         std::this_thread::sleep_for(WATCH_COUNT_INTERVAL);
+
+         auto nextCount = GetInotifyWatchCount();
+         if (nextCount != count) stableSince = std::chrono::steady_clock::now();
+         count = nextCount;
+      }
+      return count;
+   }
+
+   WatchRegistrar::RootWatches WatchRegistrar::WaitForRootWatches(const WatchPlan& plan, std::chrono::steady_clock::time_point start)
+   {
+      std::vector<WatchedInode> roots;
+      for (const auto& watchPath : plan.watchPaths)
+      {
+         if (auto inode = GetWatchedInode(watchPath)) roots.emplace_back(*inode);
+      }
+
+      RootWatches result{.watches = std::nullopt,
+                         .time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start)};
+      if (roots.empty() || roots.size() != plan.watchPaths.size()) return result;
+
+      // The watch creates its inotify instance on its own thread so the instances are looked for until all are found
+      std::vector<std::filesystem::path> fdInfos(roots.size());
+      std::optional<size_t> count;
+      auto stableSince = std::chrono::steady_clock::now();
+      while (true)
+      {
+         if (std::ranges::any_of(fdInfos, &std::filesystem::path::empty))
+         {
+            for (const auto& instance : GetInotifyInstances())
+            {
+               if (!instance.root || std::ranges::find(fdInfos, instance.fdInfo) != fdInfos.end()) continue;
+
+               for (size_t i = 0; i < roots.size(); ++i)
+               {
+                  if (fdInfos[i].empty() && roots[i] == *instance.root) fdInfos[i] = instance.fdInfo;
+               }
+            }
+         }
+
+         size_t watches{0};
+         for (const auto& fdInfo : fdInfos)
+         {
+            if (fdInfo.empty()) continue;
+
+            InotifyInstance instance{.fdInfo = fdInfo, .watches = 0, .root = std::nullopt};
+            ReadInotifyInstance(instance);
+            watches += instance.watches;
+         }
+
+         const auto now = std::chrono::steady_clock::now();
+         if (watches != count)
+         {
+            count = watches;
+            stableSince = now;
+            result.time = std::chrono::duration_cast<std::chrono::milliseconds>(now - start);
+         }
+         else if (now - stableSince >= ROOT_WATCH_COUNT_STABLE_TIME)
+         {
+            break;
+         }
+         std::this_thread::sleep_for(WATCH_COUNT_INTERVAL);
+      }
+
+      if (std::ranges::none_of(fdInfos, &std::filesystem::path::empty)) result.watches = count;
+      return result;
+   }
+
+   void WatchRegistrar::SurveyRoot(Registration& registration)
+   {
+      registration.directories = 1;
+      registration.subtrees.clear();
+
+      // Polled paths use no kernel watches and are walked by their poller so walking them here would only double the startup time
+      if (registration.poll)
+      {
+         registration.directories = 0;
+         return;
+      }
+
+      std::error_code ec;
+      for (auto iter = std::filesystem::recursive_directory_iterator(registration.path, std::filesystem::directory_options::skip_permission_denied, ec);
+           !ec && iter != std::filesystem::recursive_directory_iterator();
+           iter.increment(ec))
+      {
+         std::error_code typeEc;
+         if (!iter->is_directory(typeEc) || iter->is_symlink(typeEc)) continue;
+
+         ++registration.directories;
+
+         // The walk is depth first so deeper directories belong to the last top level directory
+         if (iter.depth() == 0 || registration.subtrees.empty())
+         {
+            registration.subtrees.emplace_back().path = iter->path();
+         }
+
+         auto& subtree = registration.subtrees.back();
+         ++subtree.directories;
+
+         // Adding, removing or renaming an entry updates the directory time
+         auto writeTime = iter->last_write_time(typeEc);
+         if (!typeEc && writeTime > subtree.lastChange) subtree.lastChange = writeTime;
+      }
+   }
+
+   void WatchRegistrar::PlanBudget(size_t watchesInUse, size_t limit)
+   {
+      size_t required{watchesInUse};
+      for (const auto& registration : registrations_)
+      {
+         required += registration.directories;
+      }
+
+      const auto budget = GetInotifyBudget(limit);
+      warp::log::Info("Inotify watches required {} {} {}",
+                      required,
+                      warp::GetTag("budget", std::to_string(budget)),
+                      warp::GetTag("max_user_watches", std::to_string(limit)));
+
+      if (required <= budget) return;
+
+      // Poll the least recently changed subtrees until the rest fits in the budget
+      std::vector<SubtreeSurvey*> candidates;
+      for (auto& registration : registrations_)
+      {
+         for (auto& subtree : registration.subtrees)
+         {
+            candidates.emplace_back(&subtree);
+         }
+      }
+      std::ranges::sort(candidates, {}, [](const auto* subtree) { return subtree->lastChange; });
+
+      auto excess = required - budget;
+      size_t polledSubtrees{0};
+      size_t polledDirectories{0};
+      for (auto* subtree : candidates)
+      {
+         if (excess == 0) break;
+
+         subtree->poll = true;
+         excess -= std::min(excess, subtree->directories);
+         ++polledSubtrees;
+         polledDirectories += subtree->directories;
+      }
+
+      warp::log::Warning("Inotify watch budget exceeded ... Polling {} least recently changed folders covering {} directories. Raise fs.inotify.max_user_watches to watch everything",
+                         polledSubtrees,
+                         polledDirectories);
+   }
+
+   WatchPlan WatchRegistrar::CreatePlan(const Registration& registration) const
+   {
+      WatchPlan plan;
+      plan.root = registration.path;
+      plan.pollSettings = pollSettings_;
+      if (registration.poll)
+      {
+         plan.pollRoots.emplace_back(registration.path, true);
+         return plan;
+      }
+
+      if (std::ranges::none_of(registration.subtrees, &SubtreeSurvey::poll))
+      {
+         plan.watchPaths.emplace_back(registration.path);
+         plan.watchedDirectories = registration.directories;
+         return plan;
+      }
+
+      // The root itself is polled without its subtrees to catch new folders and files directly under it
+      plan.pollRoots.emplace_back(registration.path, false);
+      plan.polledDirectories = 1;
+      for (const auto& subtree : registration.subtrees)
+      {
+         if (subtree.poll)
+         {
+            plan.pollRoots.emplace_back(subtree.path, true);
+            plan.polledDirectories += subtree.directories;
+         }
+         else
+         {
+            plan.watchPaths.emplace_back(subtree.path);
+            plan.watchedDirectories += subtree.directories;
+         }
+      }
+      return plan;
+   }
+
+   void WatchRegistrar::RunParallel(const std::function<void(Registration& registration)>& func)
+   {
+      std::atomic<size_t> nextRegistration{0};
+      auto work = [&]() {
+         for (auto index = nextRegistration++; index < registrations_.size(); index = nextRegistration++)
+         {
+            func(registrations_[index]);
+         }
+      };
+
+      std::vector<std::jthread> workers;
+      for (size_t i = 0; i < std::min(workerCount_, registrations_.size()); ++i)
+      {
+         workers.emplace_back(work);
+      }
+   }
+
+   WatchRegistrar::RegisterTotals WatchRegistrar::RegisterAll(bool surveyed, std::optional<size_t> limit)
+   {
+      const auto total = registrations_.size();
+
+      std::atomic<size_t> completed{0};
+      std::atomic<size_t> watchedDirectories{0};
+      std::atomic<size_t> polledDirectories{0};
+      std::atomic<bool> counted{true};
+
+      std::mutex scanTotalsLock;
+      std::map<std::string, std::pair<size_t, size_t>> scanTotals;
+
+      RunParallel([&](Registration& registration) {
+         auto plan = CreatePlan(registration);
+
+         // The watch walks its tree on a thread of its own so the root is only registered once its watch count settles
+         const auto rootStart = std::chrono::steady_clock::now();
+         registration.registerFunc(plan);
+         RootWatches rootWatches{.watches = 0, .time = std::chrono::milliseconds(0)};
+         if (!plan.watchPaths.empty()) rootWatches = WaitForRootWatches(plan, rootStart);
+
+         // Without a kernel count the surveyed directories are the best known figure
+         const bool rootCounted = rootWatches.watches || surveyed;
+         const auto rootDirectories = rootWatches.watches.value_or(plan.watchedDirectories);
+         if (!rootCounted) counted = false;
+
+         auto totalDirectories = (watchedDirectories += rootDirectories) + (polledDirectories += plan.polledDirectories);
+         auto done = ++completed;
+
+         {
+            std::scoped_lock lock(scanTotalsLock);
+            auto& [scanWatched, scanPolled] = scanTotals[registration.scanName];
+            scanWatched += rootDirectories;
+            scanPolled += plan.polledDirectories;
+         }
+
+         // Polled paths are counted by their poller
+         warp::log::Info("Watch registered {}/{} for {} {} {} {} {} {}",
+                         done,
+                         total,
+                         registration.scanName,
+                         warp::GetTag("path", registration.path.generic_string()),
+                         warp::GetTag("directories", GetCountText(rootDirectories, rootCounted)),
+                         warp::GetTag("polled", std::to_string(plan.polledDirectories)),
+                         warp::GetTag("ms", GetCountText(static_cast<size_t>(rootWatches.time.count()), rootWatches.watches.has_value())),
+                         warp::GetTag("total_directories", GetCountText(totalDirectories, counted)));
+      });
+
+      // Every watched directory holds one kernel watch so each scan is shown with its share of the limit
+      for (const auto& [scanName, totals] : scanTotals)
+      {
+         const auto share = limit && counted ? std::format("{:.1f}%", static_cast<double>(totals.first) * 100.0 / static_cast<double>(*limit)) : std::string("-");
+         warp::log::Info("Scan {} watching {} {} {}",
+                         scanName,
+                         warp::GetTag("directories", GetCountText(totals.first, counted)),
+                         warp::GetTag("polled", std::to_string(totals.second)),
+                         warp::GetTag("max_user_watches", share));
+      }
+
+      return RegisterTotals{.watchedDirectories = watchedDirectories.load(), .polledDirectories = polledDirectories.load()};
+   }
+
+   void WatchRegistrar::Run()
+   {
+      if (registrations_.empty()) return;
+
+      const auto start = std::chrono::steady_clock::now();
+      const auto total = registrations_.size();
+
+      // The kernel count covers watches that failed or were added for new folders since they were last counted
+      const auto limit = GetInotifyWatchLimit();
+      const auto watchesInUse = GetInotifyWatchCount().value_or(watchesInUse_);
+      const bool surveyed = limit && watchesInUse * 100 >= GetInotifyBudget(*limit) * SURVEY_THRESHOLD_PERCENT;
+      if (surveyed)
+      {
+         RunParallel(&WatchRegistrar::SurveyRoot);
+         PlanBudget(watchesInUse, *limit);
+      }
+
+      auto totals = RegisterAll(surveyed, limit);
+      auto watchedDirectories = totals.watchedDirectories;
+
+      if (limit && !surveyed)
+      {
+         const auto budget = GetInotifyBudget(*limit);
+         auto watches = WaitForInotifyWatches(budget);
+         if (watches && *watches > budget)
+         {
+            warp::log::Warning("Inotify watch budget exceeded while registering {} {} ... Surveying the scan paths to fit them",
+                               warp::GetTag("watches", std::to_string(*watches)),
+                               warp::GetTag("budget", std::to_string(budget)));
+
+            // The overrun watches are dropped first so the planned ones do not compete with them for the budget
+            RunParallel([](Registration& registration) {
+               WatchPlan dropPlan;
+               dropPlan.root = registration.path;
+               registration.registerFunc(dropPlan);
+            });
+
+            RunParallel(&WatchRegistrar::SurveyRoot);
+            PlanBudget(watchesInUse, *limit);
+            totals = RegisterAll(true, limit);
+            watchedDirectories = totals.watchedDirectories;
+         }
+         else if (watches)
+         {
+            watchedDirectories = *watches - std::min(*watches, watchesInUse);
+            warp::log::Info("Inotify watches in use {} {} {}",
+                            *watches,
+                            warp::GetTag("budget", std::to_string(budget)),
+                            warp::GetTag("max_user_watches", std::to_string(*limit)));
+         }
+      }
+
+      warp::log::Info("Registered {} watches covering {} directories ({} polled) in {}ms",
+                      total,
+                      watchedDirectories,
+                      totals.polledDirectories,
+                      std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+
+      registrations_.clear();
+   }
+}
\ No newline at end of file
@@ -0,0 +1,120 @@
+#pragma once
+
+#include "poll-watch.h"
+
+#include <chrono>
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace remote_scan
+{
+   // How a scan path is covered. Normally the whole root gets one recursive kernel watch.
+   // When the inotify watch budget is short the root is polled on its own, its active subtrees
+   // get kernel watches and its least recently changed subtrees are polled.
+   // Scan paths configured for polling are polled as a whole and never use kernel watches.
+   // A plan with neither watch paths nor poll roots drops the watches of the root so it can be planned again.
+   struct WatchPlan
+   {
+      std::filesystem::path root;
+      std::vector<std::filesystem::path> watchPaths;
+      std::vector<PollRoot> pollRoots;
+      size_t watchedDirectories{0};
+      size_t polledDirectories{0};
+      PollSettings pollSettings;
+   };
+
+   // Registers directory watches on a bounded pool of worker threads.
+   // Recursive watches walk their whole tree so registering roots concurrently shortens startup on large libraries.
+   // A worker stays with its root until the kernel watch count of the root settles, which is when its walk is done.
+   // The roots are only surveyed for their directory counts ahead of time when the watches in use are close to the
+   // inotify budget. Otherwise the watches are counted once registered and the roots are only surveyed if they overran it.
+   class WatchRegistrar
+   {
+   public:
+      // The register function fills in the polled directory count for poll mode paths once they have been walked
+      using RegisterFunc = std::function<void(WatchPlan& plan)>;
+
+      // watchesInUse is the number of kernel watches already held by this process
+      WatchRegistrar(size_t workerCount, size_t watchesInUse, const PollSettings& pollSettings);
+      virtual ~WatchRegistrar() = default;
+
+      WatchRegistrar(const WatchRegistrar&) = delete;
+      WatchRegistrar& operator=(const WatchRegistrar&) = delete;
+
+      void Add(std::string_view scanName, const std::filesystem::path& path, RegisterFunc registerFunc);
+
+      // Adds a path that is only polled, for network shares where kernel watches miss remote changes
+      void AddPolled(std::string_view scanName, const std::filesystem::path& path, RegisterFunc registerFunc);
+
+      // Runs all the added registrations and returns once they have all completed
+      void Run();
+
+      // The maximum number of inotify watches for this user or nullopt if not available on this platform
+      [[nodiscard]] static std::optional<size_t> GetInotifyWatchLimit();
+
+      // The number of inotify watches held by this process or nullopt if not available on this platform
+      [[nodiscard]] static std::optional<size_t> GetInotifyWatchCount();
+
+   private:
+      struct SubtreeSurvey
+      {
+         std::filesystem::path path;
+         size_t directories{0};
+         std::filesystem::file_time_type lastChange;
+         bool poll{false};
+      };
+
+      struct Registration
+      {
+         std::string scanName;
+         std::filesystem::path path;
+         RegisterFunc registerFunc;
+         bool poll{false};
+
+         // Only counted when the root was surveyed
+         size_t directories{0};
+         std::vector<SubtreeSurvey> subtrees;
+      };
+
+      struct RegisterTotals
+      {
+         size_t watchedDirectories{0};
+         size_t polledDirectories{0};
+      };
+
+      struct RootWatches
+      {
+         // Kernel watches held for the root or nullopt if they cannot be counted on this platform
+         std::optional<size_t> watches;
+
+         // Time from registering the root until its last watch was added
+         std::chrono::milliseconds time{0};
+      };
+
+      static void SurveyRoot(Registration& registration);
+      void PlanBudget(size_t watchesInUse, size_t limit);
+      [[nodiscard]] WatchPlan CreatePlan(const Registration& registration) const;
+
+      // Registers every root and logs the directories per root and per scan when they were counted.
+      // The scan totals are shown as a share of the inotify watch limit when it is known.
+      [[nodiscard]] RegisterTotals RegisterAll(bool surveyed, std::optional<size_t> limit);
+
+      // Waits for the recursive watches of a plan to finish walking their trees and counts the kernel watches they hold
+      [[nodiscard]] static RootWatches WaitForRootWatches(const WatchPlan& plan, std::chrono::steady_clock::time_point start);
+
+      // Waits for the recursive watches to finish walking their trees. Returns early once the budget is overrun.
+      [[nodiscard]] static std::optional<size_t> WaitForInotifyWatches(size_t budget);
+
+      void RunParallel(const std::function<void(Registration& registration)>& func);
+
+      size_t workerCount_;
+      size_t watchesInUse_;
+      PollSettings pollSettings_;
+      std::vector<Registration> registrations_;
+   };
+}
\ No newline at end of file
@@ -0,0 +1,473 @@
+﻿#include "watch-registry.h"
+
+#include "config-reader/config-reader-types.h"
+#include "poll-watch.h"
+#include "types.h"
+#include "watch-registrar.h"
+
+#include <warp/log/log.h>
+#include <warp/log/log-utils.h>
+#include <warp/utils.h>
+#include <wtr/watcher.hpp>
+
+#include <algorithm>
+#include <cstdlib>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+
+namespace remote_scan
+{
+   namespace
+   {
+      using PathView = std::basic_string_view<std::filesystem::path::value_type>;
+
+      bool IsWithin(const std::filesystem::path& path, const std::filesystem::path& parent)
+      {
+         auto [parentEnd, pathIter] = std::mismatch(parent.begin(), parent.end(), path.begin(), path.end());
+         return parentEnd == parent.end();
+      }
+
+      bool IsSeparator(std::filesystem::path::value_type c)
+      {
+         return c == '/' || c == std::filesystem::path::preferred_separator;
+      }
+
+      // Length of the root like "/" or "C:\" that walking up a path stops at
+      size_t GetRootLength(PathView path)
+      {
+         size_t length{0};
+#ifdef _WIN32
+         if (path.size() >= 2 && path[1] == L':') length = 2;
+#endif
+         if (length < path.size() && IsSeparator(path[length])) ++length;
+         return length;
+      }
+   }
+
+   class WatchRegistryImpl
+   {
+   public:
+      bool testLogEnabled{false};
+      FileMonitorSink fileMonitorSink;
+
+      explicit WatchRegistryImpl(FileMonitorSink sink)
+         : fileMonitorSink(sink)
+      {
+      }
+
+      // The kernel watches and poller covering one physical subtree
+      struct ActiveWatch
+      {
+         std::list<wtr::watch> watches;
+         std::unique_ptr<PollWatch> pollWatch;
+         size_t watchedDirectories{0};
+         bool pollMode{false};
+      };
+
+      std::mutex watchLock;
+      std::map<std::filesystem::path, ActiveWatch> activeWatches;
+
+      // Every configured path mapped to the names of the scans it belongs to.
+      // Keyed by the native string so events look up their parents from views of their own path.
+      std::shared_mutex subscriptionLock;
+      std::map<std::filesystem::path::string_type, std::vector<std::string>, std::less<>> subscriptions;
+
+      // The watch roots when one is nested inside a root of the other mode. Both see changes below the inner root
+      // so only the innermost root covering a path emits it.
+      std::set<std::filesystem::path::string_type, std::less<>> nestedRoots;
+
+      void AddWatch(WatchPlan& plan)
+      {
+         if (plan.watchPaths.empty() && plan.pollRoots.empty())
+         {
+            std::scoped_lock lock(watchLock);
+            activeWatches.erase(plan.root);
+            return;
+         }
+
+         ActiveWatch activeWatch;
+         activeWatch.watchedDirectories = plan.watchedDirectories;
+         activeWatch.pollMode = plan.watchPaths.empty();
+         for (const auto& watchPath : plan.watchPaths)
+         {
+            activeWatch.watches.emplace_back(watchPath, [this, root = plan.root](const wtr::event& e) { return ProcessEvent(root, e); });
+            warp::log::Trace("Started watch on path {}", watchPath.generic_string());
+         }
+
+         if (!plan.pollRoots.empty())
+         {
+            activeWatch.pollWatch = std::make_unique<PollWatch>(plan.pollRoots, plan.pollSettings,
+               [this, root = plan.root](const std::filesystem::path& path, bool isDirectory, EffectType effect) { Emit(root, path, isDirectory, effect); });
+
+            // A path that is polled as a whole has not been walked yet so its size is only known once the poller has listed it
+            if (activeWatch.pollMode) plan.polledDirectories = activeWatch.pollWatch->GetDirectoryCount();
+
+            warp::log::Trace("Started polling {} folders on path {}", plan.pollRoots.size(), plan.root.generic_string());
+         }
+
+         std::scoped_lock lock(watchLock);
+         activeWatches.insert_or_assign(plan.root, std::move(activeWatch));
+      }
+
+      // Calls the function with the path and each of its parents, innermost first, until it returns false
+      template <typename Func>
+      static void ForEachLevel(const std::filesystem::path& path, Func&& func)
+      {
+         const PathView fullPath(path.native());
+         const auto rootLength = GetRootLength(fullPath);
+         for (auto current = fullPath; ; )
+         {
+            if (!func(current) || current.size() <= rootLength) break;
+
+            // Drop the last name and the separators before it
+            auto parentSize = current.size();
+            while (parentSize > rootLength && !IsSeparator(current[parentSize - 1])) --parentSize;
+            while (parentSize > rootLength && IsSeparator(current[parentSize - 1])) --parentSize;
+            current = current.substr(0, parentSize);
+         }
+      }
+
+      // True if no root nested inside the watch root covers the path. The subscription lock must be held.
+      [[nodiscard]] bool GetRootEmitsLocked(const std::filesystem::path& root, const std::filesystem::path& path) const
+      {
+         if (nestedRoots.empty()) return true;
+
+         bool emits{true};
+         ForEachLevel(path, [&](PathView current) {
+            if (!nestedRoots.contains(current)) return true;
+
+            emits = (current == PathView(root.native()));
+            return false;
+         });
+         return emits;
+      }
+
+      // Calls the function with the name of every scan covering the path. The subscription lock must be held.
+      template <typename Func>
+      void ForEachScanLocked(const std::filesystem::path& path, Func&& func) const
+      {
+         // Walk up from the changed path so every scan covering it is found with one lookup per level
+         ForEachLevel(path, [&](PathView current) {
+            if (auto iter = subscriptions.find(current); iter != subscriptions.end())
+            {
+               for (const auto& scanName : iter->second)
+               {
+                  func(scanName);
+               }
+            }
+            return true;
+         });
+      }
+
+      void Emit(const std::filesystem::path& root, const std::filesystem::path& path, bool isDirectory, EffectType effect)
+      {
+         std::shared_lock lock(subscriptionLock);
+         if (!GetRootEmitsLocked(root, path)) return;
+
+         // Every scan but the last gets a copy so the common single scan case hands over the event without copying it
+         auto fileMonitor = FileMonitorData::Create(path, isDirectory, effect);
+
+         const std::string* pendingScan{nullptr};
+         ForEachScanLocked(path, [&](const std::string& scanName) {
+            if (pendingScan)
+            {
+               auto copy = fileMonitor;
+               copy.scanName = *pendingScan;
+               fileMonitorSink(std::move(copy));
+            }
+            pendingScan = &scanName;
+         });
+
+         if (pendingScan)
+         {
+            fileMonitor.scanName = *pendingScan;
+            fileMonitorSink(std::move(fileMonitor));
+         }
+      }
+
+      bool GetIsDirectory(enum wtr::event::effect_type effectType,
+                          enum wtr::event::path_type pathType,
+                          const std::filesystem::path& path)
+      {
+         if (effectType != wtr::event::effect_type::destroy)
+         {
+            // If the item still exists, trust the OS check over the event metadata
+            std::error_code ec;
+            if (std::filesystem::is_directory(path, ec))
+            {
+               return true;
+            }
+         }
+         else
+         {
+            if (pathType == wtr::event::path_type::dir || !path.has_extension())
+            {
+               return true;
+            }
+         }
+         return false;
+      }
+
+      // A directory moved within the watched paths is sent as one move to the scans covering both locations.
+      // Scans only covering the old location see it removed and scans only covering the new location see it created.
+      void EmitDirectoryMove(const std::filesystem::path& root, const std::filesystem::path& oldPath, const std::filesystem::path& newPath)
+      {
+         // A side covered by a nested root is reported by that root's own watch or poller
+         std::shared_lock lock(subscriptionLock);
+         std::vector<const std::string*> oldScans;
+         if (GetRootEmitsLocked(root, oldPath))
+         {
+            ForEachScanLocked(oldPath, [&oldScans](const std::string& scanName) { oldScans.emplace_back(&scanName); });
+         }
+
+         std::vector<const std::string*> newScans;
+         if (GetRootEmitsLocked(root, newPath))
+         {
+            ForEachScanLocked(newPath, [&newScans](const std::string& scanName) { newScans.emplace_back(&scanName); });
+         }
+
+         auto contains = [](const auto& scans, const std::string* scanName) {
+            return std::ranges::any_of(scans, [scanName](const auto* other) { return *other == *scanName; });
+         };
+
+         for (const auto* scanName : oldScans)
+         {
+            if (contains(newScans, scanName)) continue;
+
+            fileMonitorSink(FileMonitorData{
+               .scanName = *scanName,
+               .path = oldPath,
+               .filename = {},
+               .isDirectory = true,
+               .effect = EffectType::DESTROY,
+               .movedFrom = {}
+            });
+         }
+
+         for (const auto* scanName : newScans)
+         {
+            const auto moved = contains(oldScans, scanName);
+            fileMonitorSink(FileMonitorData{
+               .scanName = *scanName,
+               .path = newPath,
+               .filename = {},
+               .isDirectory = true,
+               .effect = moved ? EffectType::RENAME : EffectType::CREATE,
+               .movedFrom = moved ? oldPath : std::filesystem::path()
+            });
+         }
+      }
+
+      void ProcessRenameEvent(const std::filesystem::path& root, const wtr::event& e)
+      {
+         if (e.associated)
+         {
+            // A directory keeps its type across the rename so the new location tells what the old one was
+            if (GetIsDirectory(wtr::event::effect_type::create, e.path_type, e.associated->path_name))
+            {
+               EmitDirectoryMove(root, e.path_name, e.associated->path_name);
+               return;
+            }
+
+            // If a rename event has occured and the associated field is set,
+            // we need to send a DESTROY for the old path and a CREATE for the new path.
+            auto oldIsDirectory = GetIsDirectory(wtr::event::effect_type::destroy, e.path_type, e.path_name);
+            Emit(root, e.path_name, oldIsDirectory, EffectType::DESTROY);
+
+            auto newIsDirectory = GetIsDirectory(wtr::event::effect_type::create, e.path_type, e.associated->path_name);
+            Emit(root, e.associated->path_name, newIsDirectory, EffectType::CREATE);
+         }
+         else
+         {
+            auto isDirectory = GetIsDirectory(e.effect_type, e.path_type, e.path_name);
+            Emit(root, e.path_name, isDirectory, EffectType::CREATE);
+         }
+      }
+
+      bool ProcessEvent(const std::filesystem::path& root, const wtr::event& e)
+      {
+         if ((e.effect_type == wtr::event::effect_type::rename ||
+              e.effect_type == wtr::event::effect_type::create ||
+              e.effect_type == wtr::event::effect_type::modify ||
+              e.effect_type == wtr::event::effect_type::destroy) &&
+                   e.path_type != wtr::event::path_type::watcher)
+         {
+            if (testLogEnabled)
+            {
+               warp::log::Info("[TEST] {} {} {}",
+                               warp::GetTag("effect", wtr::to<std::string>(e.effect_type)),
+                               warp::GetTag("type", wtr::to<std::string>(e.path_type)),
+                               warp::GetTag("path", e.path_name.generic_string()));
+
+            }
+
+            EffectType effectType;
+            switch (e.effect_type)
+            {
+               case wtr::event::effect_type::rename:
+                  effectType = EffectType::RENAME;
+                  break;
+               case wtr::event::effect_type::create:
+                  effectType = EffectType::CREATE;
+                  break;
+               case wtr::event::effect_type::destroy:
+                  effectType = EffectType::DESTROY;
+                  break;
+               default:
+                  effectType = EffectType::MODIFY;
+                  break;
+            }
+
+            if (effectType == EffectType::RENAME)
+            {
+               ProcessRenameEvent(root, e);
+            }
+            else
+            {
+               bool isDirectory = GetIsDirectory(e.effect_type, e.path_type, e.path_name);
+               Emit(root, e.path_name, isDirectory, effectType);
+            }
+         }
+         return true;
+      }
+   };
+
+   WatchRegistry::WatchRegistry(FileMonitorSink fileMonitorSink)
+      : pimpl_(std::make_unique<WatchRegistryImpl>(fileMonitorSink))
+   {
+      pimpl_->testLogEnabled = std::getenv("REMOTE_SCAN_TEST_LOGS") != nullptr;
+   }
+
+   WatchRegistry::~WatchRegistry() = default;
+
+   void WatchRegistry::Update(const std::vector<ScanConfig>& scans, WatchRegistrar& registrar)
+   {
+      // Configured paths mapped to whether they are polled and the scans they belong to
+      std::map<std::filesystem::path, bool> configPaths;
+      std::map<std::filesystem::path, std::vector<std::string>> subscriptions;
+      for (const auto& scan : scans)
+      {
+         for (const auto& pathConfig : scan.pathsFromBase)
+         {
+            const auto pollMode = warp::ToLower(pathConfig.mode) == "poll";
+            if (!pollMode && !pathConfig.mode.empty() && warp::ToLower(pathConfig.mode) != "watch")
+            {
+               warp::log::Warning("{} has unknown mode {} for path {} ... Using watch", scan.name, pathConfig.mode, pathConfig.path.generic_string());
+            }
+
+            const auto fullPath = NormalizePath(scan.basePath / pathConfig.path);
+
+            // A path shared by a watching and a polling scan is polled so the polling scan still sees remote changes
+            configPaths[fullPath] |= pollMode;
+
+            auto& scanNames = subscriptions[fullPath];
+            if (std::ranges::find(scanNames, scan.name) == scanNames.end()) scanNames.emplace_back(scan.name);
+         }
+      }
+
+      // Paths nested in another path of the same mode are covered by the outer watch.
+      // Paths sort element by element so a subtree always directly follows its root.
+      std::map<std::filesystem::path, bool> roots;
+      std::map<std::filesystem::path, std::set<std::string>> rootScans;
+      std::filesystem::path lastRoot[2];
+      for (const auto& [fullPath, pollMode] : configPaths)
+      {
+         auto& lastModeRoot = lastRoot[pollMode ? 1 : 0];
+         auto& scanNames = subscriptions[fullPath];
+         if (!lastModeRoot.empty() && IsWithin(fullPath, lastModeRoot))
+         {
+            warp::log::Trace("Path {} shares the watch on {}", fullPath.generic_string(), lastModeRoot.generic_string());
+            rootScans[lastModeRoot].insert(scanNames.begin(), scanNames.end());
+            continue;
+         }
+
+         roots.emplace(fullPath, pollMode);
+         rootScans[fullPath].insert(scanNames.begin(), scanNames.end());
+         lastModeRoot = fullPath;
+      }
+
+      // A root inside a root of the other mode takes over the changes below it from the outer root
+      std::set<std::filesystem::path::string_type, std::less<>> nestedRoots;
+      for (const auto& [root, pollMode] : roots)
+      {
+         for (const auto& [otherRoot, otherPollMode] : roots)
+         {
+            if (otherRoot == root || !IsWithin(otherRoot, root)) continue;
+
+            warp::log::Info("Path {} is watched in {} mode inside {} ... Changes below it are only taken from its own {}",
+                            otherRoot.generic_string(),
+                            otherPollMode ? "poll" : "watch",
+                            root.generic_string(),
+                            otherPollMode ? "poller" : "watch");
+            nestedRoots.insert(root.native());
+            nestedRoots.insert(otherRoot.native());
+         }
+      }
+
+      {
+         std::scoped_lock lock(pimpl_->subscriptionLock);
+         pimpl_->subscriptions.clear();
+         for (auto& [fullPath, scanNames] : subscriptions)
+         {
+            pimpl_->subscriptions.emplace(fullPath.native(), std::move(scanNames));
+         }
+         pimpl_->nestedRoots = std::move(nestedRoots);
+      }
+
+      std::scoped_lock lock(pimpl_->watchLock);
+
+      // Remove the watches for roots no longer needed or whose mode changed
+      std::erase_if(pimpl_->activeWatches, [&](const auto& activeWatch) {
+         auto rootIter = roots.find(activeWatch.first);
+         if (rootIter != roots.end() && rootIter->second == activeWatch.second.pollMode) return false;
+
+         warp::log::Info("Stopped watch on path {}", activeWatch.first.generic_string());
+         return true;
+      });
+
+      for (const auto& [root, pollMode] : roots)
+      {
+         if (pimpl_->activeWatches.contains(root) || !std::filesystem::exists(root)) continue;
+
+         std::string scanNames;
+         for (const auto& scanName : rootScans[root])
+         {
+            if (!scanNames.empty()) scanNames += ", ";
+            scanNames += scanName;
+         }
+
+         auto registerFunc = [impl = pimpl_.get()](WatchPlan& plan) { impl->AddWatch(plan); };
+         if (pollMode)
+         {
+            registrar.AddPolled(scanNames, root, std::move(registerFunc));
+         }
+         else
+         {
+            registrar.Add(scanNames, root, std::move(registerFunc));
+         }
+      }
+   }
+
+   size_t WatchRegistry::GetWatchedDirectories() const
+   {
+      std::scoped_lock lock(pimpl_->watchLock);
+
+      size_t directories{0};
+      for (const auto& [path, activeWatch] : pimpl_->activeWatches)
+      {
+         directories += activeWatch.watchedDirectories;
+      }
+      return directories;
+   }
+
+   void WatchRegistry::Shutdown()
+   {
+      std::scoped_lock lock(pimpl_->watchLock);
+      pimpl_->activeWatches.clear();
+   }
+}
\ No newline at end of file
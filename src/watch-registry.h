@@ -0,0 +1,88 @@
+#pragma once
+
+#include <concepts>
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace remote_scan
+{
+   struct ScanConfig;
+   struct FileMonitorData;
+
+   class WatchRegistryImpl;
+   class WatchRegistrar;
+
+   // Non owning handle to whatever receives the watch events. Called once per event so it is a plain
+   // function pointer and object instead of a std::function. The receiver must outlive the registry,
+   // which is why temporaries are refused.
+   class FileMonitorSink
+   {
+   public:
+      template<typename Func>
+         requires (!std::same_as<std::remove_cvref_t<Func>, FileMonitorSink>) && std::invocable<Func&, FileMonitorData&&>
+      FileMonitorSink(Func& func)
+         : object_(&func)
+         , call_([](void* object, FileMonitorData&& fileMonitor) { (*static_cast<Func*>(object))(std::move(fileMonitor)); })
+      {
+      }
+
+      template<typename Func>
+         requires (!std::is_lvalue_reference_v<Func>) && (!std::same_as<std::remove_cvref_t<Func>, FileMonitorSink>)
+      FileMonitorSink(Func&& func) = delete;
+
+      // Calls a member function such as RemoteScan::ProcessEvent
+      template<auto Method, typename Object>
+      static FileMonitorSink Create(Object& object)
+      {
+         return FileMonitorSink(&object, [](void* target, FileMonitorData&& fileMonitor) {
+            (static_cast<Object*>(target)->*Method)(std::move(fileMonitor));
+         });
+      }
+
+      void operator()(FileMonitorData&& fileMonitor) const
+      {
+         call_(object_, std::move(fileMonitor));
+      }
+
+   private:
+      using CallFunc = void (*)(void* object, FileMonitorData&& fileMonitor);
+
+      FileMonitorSink(void* object, CallFunc call)
+         : object_(object)
+         , call_(call)
+      {
+      }
+
+      void* object_;
+      CallFunc call_;
+   };
+
+   // Owns one watch per physical subtree for all the scans.
+   // Scan paths that are the same or nested inside another scan path share the outermost watch
+   // and each event is sent once for every scan whose paths cover it. A path nested in a path of the other
+   // mode gets a watch of its own and only that watch reports the changes below it.
+   class WatchRegistry
+   {
+   public:
+      // Each event is handed over once per covering scan. The last scan receives the event the registry built itself.
+      explicit WatchRegistry(FileMonitorSink fileMonitorSink);
+      virtual ~WatchRegistry();
+
+      WatchRegistry(const WatchRegistry&) = delete;
+      WatchRegistry& operator=(const WatchRegistry&) = delete;
+
+      // Number of directories covered by kernel watches as far as they were counted when registered
+      [[nodiscard]] size_t GetWatchedDirectories() const;
+
+      // Removes the watches no longer needed by the scans and adds the new watch roots to the registrar
+      void Update(const std::vector<ScanConfig>& scans, WatchRegistrar& registrar);
+
+      void Shutdown();
+
+   private:
+      std::unique_ptr<WatchRegistryImpl> pimpl_;
+   };
+}
\ No newline at end of file
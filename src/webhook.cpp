@@ -0,0 +1,233 @@
+﻿#include "webhook.h"
+
+#include "monitor.h"
+#include "types.h"
+
+#include <warp/log/log.h>
+
+#include <glaze/glaze.hpp>
+#include <httplib.h>
+
+#include <charconv>
+#include <filesystem>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace remote_scan
+{
+   namespace
+   {
+      // Webhook payloads are small. Anything larger is not from a download manager.
+      constexpr size_t MAX_PAYLOAD_BYTES{1024 * 1024};
+
+      struct WebhookFile
+      {
+         std::string path;
+         std::string previousPath;
+
+         struct glaze
+         {
+            static constexpr auto value = glz::object(
+               "path", &WebhookFile::path,
+               "previousPath", &WebhookFile::previousPath
+            );
+         };
+      };
+
+      // The fields Sonarr and Radarr send for imports, renames and file deletes
+      struct WebhookPayload
+      {
+         std::string eventType;
+         std::optional<WebhookFile> episodeFile;
+         std::optional<WebhookFile> movieFile;
+         std::optional<std::vector<WebhookFile>> episodeFiles;
+         std::optional<std::vector<WebhookFile>> movieFiles;
+         std::optional<std::vector<WebhookFile>> renamedEpisodeFiles;
+         std::optional<std::vector<WebhookFile>> renamedMovieFiles;
+
+         // The files an upgrade replaced on imports but only a flag on series and movie deletes
+         glz::raw_json deletedFiles;
+
+         struct glaze
+         {
+            static constexpr auto value = glz::object(
+               "eventType", &WebhookPayload::eventType,
+               "episodeFile", &WebhookPayload::episodeFile,
+               "movieFile", &WebhookPayload::movieFile,
+               "episodeFiles", &WebhookPayload::episodeFiles,
+               "movieFiles", &WebhookPayload::movieFiles,
+               "renamedEpisodeFiles", &WebhookPayload::renamedEpisodeFiles,
+               "renamedMovieFiles", &WebhookPayload::renamedMovieFiles,
+               "deletedFiles", &WebhookPayload::deletedFiles
+            );
+         };
+      };
+
+      using FileChanges = std::vector<std::pair<std::filesystem::path, EffectType>>;
+
+      void AddFile(FileChanges& changes, const std::optional<WebhookFile>& file, EffectType effect)
+      {
+         if (file && !file->path.empty()) changes.emplace_back(file->path, effect);
+      }
+
+      void AddFiles(FileChanges& changes, const std::optional<std::vector<WebhookFile>>& files, EffectType effect)
+      {
+         if (!files) return;
+
+         for (const auto& file : *files)
+         {
+            if (!file.path.empty()) changes.emplace_back(file.path, effect);
+         }
+      }
+
+      void AddRenamedFiles(FileChanges& changes, const std::optional<std::vector<WebhookFile>>& files)
+      {
+         if (!files) return;
+
+         for (const auto& file : *files)
+         {
+            if (!file.previousPath.empty()) changes.emplace_back(file.previousPath, EffectType::DESTROY);
+            if (!file.path.empty()) changes.emplace_back(file.path, EffectType::CREATE);
+         }
+      }
+   }
+
+   WebhookReceiver::WebhookReceiver(std::string address, std::string key, Monitor& monitor)
+      : address_(std::move(address))
+      , key_(std::move(key))
+      , monitor_(monitor)
+   {
+   }
+
+   WebhookReceiver::~WebhookReceiver()
+   {
+      Shutdown();
+   }
+
+   const std::string& WebhookReceiver::GetAddress() const
+   {
+      return address_;
+   }
+
+   const std::string& WebhookReceiver::GetKey() const
+   {
+      return key_;
+   }
+
+   bool WebhookReceiver::Start()
+   {
+      auto hostPort = SplitHostPort(address_);
+      int port{0};
+      if (!hostPort
+          || std::from_chars(hostPort->second.data(), hostPort->second.data() + hostPort->second.size(), port).ec != std::errc()
+          || port <= 0)
+      {
+         warp::log::Error("Webhook address {} is not valid ... Expected host:port or :port", address_);
+         return false;
+      }
+
+      const auto host = hostPort->first.empty() ? DEFAULT_LISTEN_HOST : hostPort->first;
+      if (key_.empty() && !GetIsLoopbackHost(host))
+      {
+         warp::log::Error("Webhook address {} accepts other machines so webhook_key is required ... Not listening for webhooks", address_);
+         return false;
+      }
+
+      server_ = std::make_unique<httplib::Server>();
+      server_->set_payload_max_length(MAX_PAYLOAD_BYTES);
+      server_->Post("/webhook", [this](const httplib::Request& request, httplib::Response& response) {
+         if (!key_.empty() && request.get_param_value("key") != key_)
+         {
+            warp::log::Warning("Rejected a webhook from {} ... webhook_key does not match", request.remote_addr);
+            response.status = 401;
+            return;
+         }
+
+         response.status = this->HandleWebhook(request.body);
+      });
+
+      if (!server_->bind_to_port(host, port))
+      {
+         warp::log::Error("Failed to listen for webhooks on {}", address_);
+         server_.reset();
+         return false;
+      }
+
+      workThread_ = std::jthread([this] {
+         server_->listen_after_bind();
+      });
+
+      warp::log::Info("Webhook listening on {}:{}", host, port);
+      return true;
+   }
+
+   void WebhookReceiver::Shutdown()
+   {
+      if (server_) server_->stop();
+
+      if (workThread_.joinable())
+      {
+         workThread_.join();
+      }
+
+      server_.reset();
+   }
+
+   int WebhookReceiver::HandleWebhook(std::string_view body)
+   {
+      WebhookPayload payload;
+      if (glz::read<glz::opts{.error_on_unknown_keys = false}>(payload, body))
+      {
+         warp::log::Warning("Received a webhook that is not a Sonarr or Radarr payload ... Ignoring it");
+         return 400;
+      }
+
+      FileChanges changes;
+      if (payload.eventType == "Download" || payload.eventType == "ImportComplete")
+      {
+         AddFile(changes, payload.episodeFile, EffectType::CREATE);
+         AddFile(changes, payload.movieFile, EffectType::CREATE);
+         AddFiles(changes, payload.episodeFiles, EffectType::CREATE);
+         AddFiles(changes, payload.movieFiles, EffectType::CREATE);
+
+         // Upgrades list the files they replaced
+         std::optional<std::vector<WebhookFile>> deletedFiles;
+         if (payload.deletedFiles.str.starts_with('[')
+             && !glz::read<glz::opts{.error_on_unknown_keys = false}>(deletedFiles, payload.deletedFiles.str))
+         {
+            AddFiles(changes, deletedFiles, EffectType::DESTROY);
+         }
+      }
+      else if (payload.eventType == "Rename")
+      {
+         AddRenamedFiles(changes, payload.renamedEpisodeFiles);
+         AddRenamedFiles(changes, payload.renamedMovieFiles);
+      }
+      else if (payload.eventType == "EpisodeFileDelete" || payload.eventType == "MovieFileDelete")
+      {
+         AddFile(changes, payload.episodeFile, EffectType::DESTROY);
+         AddFile(changes, payload.movieFile, EffectType::DESTROY);
+      }
+      else if (payload.eventType == "Test")
+      {
+         warp::log::Info("Received a webhook test");
+      }
+
+      // Other events such as grabs and health checks carry no finished files
+      for (const auto& [file, effect] : changes)
+      {
+         auto scans = monitor_.ProcessSettled(file, effect);
+         if (scans.empty())
+         {
+            warp::log::Warning("Webhook {} file {} matched no scan ... It is filtered out or the download manager sees the media at a different path", payload.eventType, file.generic_string());
+         }
+         else
+         {
+            warp::log::Info("Webhook {} {} {} ... Notifying without waiting to settle", payload.eventType, GetEffectName(effect), file.generic_string());
+         }
+      }
+
+      return 200;
+   }
+}
\ No newline at end of file
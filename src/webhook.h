@@ -0,0 +1,47 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+
+namespace httplib
+{
+   class Server;
+}
+
+namespace remote_scan
+{
+   class Monitor;
+
+   // Local HTTP endpoint for the webhooks of download managers such as Sonarr and Radarr.
+   // Imported, renamed and deleted files are handed to the monitor as settled so they are notified
+   // without waiting for seconds_before_notify.
+   //   POST /webhook   Sonarr or Radarr webhook payload. Needs ?key= when webhook_key is set.
+   class WebhookReceiver
+   {
+   public:
+      WebhookReceiver(std::string address, std::string key, Monitor& monitor);
+      virtual ~WebhookReceiver();
+
+      WebhookReceiver(const WebhookReceiver&) = delete;
+      WebhookReceiver& operator=(const WebhookReceiver&) = delete;
+
+      [[nodiscard]] const std::string& GetAddress() const;
+      [[nodiscard]] const std::string& GetKey() const;
+
+      // Returns false if the address could not be listened on
+      bool Start();
+      void Shutdown();
+
+   private:
+      // Returns the http status to reply with
+      [[nodiscard]] int HandleWebhook(std::string_view body);
+
+      std::string address_;
+      std::string key_;
+      Monitor& monitor_;
+      std::unique_ptr<httplib::Server> server_;
+      std::jthread workThread_;
+   };
+}
\ No newline at end of file